@@ -23,8 +23,10 @@
 #include <fstream>
 
 #include "fmt/core.h"
+#include "spdlog/spdlog.h"
 
 #include "carbon/carbon.h"
+#include "rgmvideo/videofile.h"
 
 using namespace carbon;
 using namespace rgms;
@@ -95,41 +97,82 @@ static cv::Mat CropWithZeroPadding(cv::Mat img, cv::Rect cropRect) {
     return m;
 }
 
-cv::Mat carbon::ApplyFilter(const cv::Mat img, const FilterConfig& filter,
-        const rgms::video::PixelContributions& contributions) {
-    cv::Rect cropRect(
-        static_cast<int>(std::round(filter.Crop.X)),
-        static_cast<int>(std::round(filter.Crop.Y)),
-        static_cast<int>(std::round(filter.Crop.Width)),
-        static_cast<int>(std::round(filter.Crop.Height))
-    );
-
-    if (filter.Type == FilterType::CROP) {
+std::vector<util::Vector2F> carbon::FilterMesh(int rows, int cols, const FilterConfig& filter) {
+    int outx = filter.OutWidth;
+    int outy = filter.OutHeight;
+    if (filter.Type == FilterType::UNCRT) {
+        return video::PixelContributionsMesh(filter.Patch, outx, outy);
+    }
 
-        cv::Mat ret = CropWithZeroPadding(img, cropRect); if (!(ret.rows == 0 || ret.cols == 0)) {
-            cv::resize(ret, ret, {filter.OutWidth, filter.OutHeight},
-                    0, 0, cv::INTER_AREA);
+    // The rectangle that is scaled to the output, of the frame (or of the
+    // frame once warped) in pixel edge coordinates
+    double rx = 0.0, ry = 0.0, rw = cols, rh = rows;
+    if (filter.Type != FilterType::NONE) {
+        rx = std::round(filter.Crop.X);
+        ry = std::round(filter.Crop.Y);
+        rw = std::round(filter.Crop.Width);
+        rh = std::round(filter.Crop.Height);
+        if (rw < 0) {
+            rx += rw;
+            rw = -rw;
         }
-        return ret;
-    } else if (filter.Type == FilterType::UNCRT) {
-        return rgms::video::RemoveCRT(img, contributions, filter.OutWidth, filter.OutHeight);
-    } else if (filter.Type == FilterType::PERSPECTIVE) {
-        cv::Mat ret;
-        cv::Mat m = GetFilterPerspectiveMatrix(img.cols, img.rows, filter);
-        cv::warpPerspective(img, ret, m, img.size());
+        if (rh < 0) {
+            ry += rh;
+            rh = -rh;
+        }
+    }
 
-        ret = CropWithZeroPadding(ret, cropRect);
-        if (!(ret.rows == 0 || ret.cols == 0)) {
-            cv::resize(ret, ret, {filter.OutWidth, filter.OutHeight}, 0, 0, cv::INTER_AREA);
+    // Warping the frame and then sampling it is the same as sampling the
+    // frame at the unwarped positions
+    cv::Mat inv;
+    if (filter.Type == FilterType::PERSPECTIVE) {
+        inv = GetFilterPerspectiveMatrix(cols, rows, filter).inv();
+    }
+
+    // The mesh has pixel centers on integers, the -0.5 is to there from edges
+    std::vector<util::Vector2F> mesh;
+    mesh.reserve(static_cast<size_t>(outx + 1) * (outy + 1));
+    for (int y = 0; y <= outy; y++) {
+        double py = ry + rh * y / outy - 0.5;
+        for (int x = 0; x <= outx; x++) {
+            double px = rx + rw * x / outx - 0.5;
+            if (!inv.empty()) {
+                const double* h = inv.ptr<double>(0);
+                double w = h[6] * px + h[7] * py + h[8];
+                double ix = (h[0] * px + h[1] * py + h[2]) / w;
+                double iy = (h[3] * px + h[4] * py + h[5]) / w;
+                mesh.emplace_back(static_cast<float>(ix), static_cast<float>(iy));
+            } else {
+                mesh.emplace_back(static_cast<float>(px), static_cast<float>(py));
+            }
         }
-        return ret;
     }
-    if (img.cols != filter.OutWidth || img.rows != filter.OutHeight) {
-        cv::Mat ret;
-        cv::resize(img, ret, {filter.OutWidth, filter.OutHeight}, 0, 0, cv::INTER_AREA);
-        return ret;
+    return mesh;
+}
+
+bool carbon::FilterZeroOutside(const FilterConfig& filter) {
+    return filter.Type != FilterType::UNCRT;
+}
+
+void carbon::CompileFilter(int rows, int cols, const FilterConfig& filter,
+        rgms::video::PixelContributions* contributions) {
+    if (filter.Type == FilterType::UNCRT) {
+        video::CachedPixelContributions(video::PixelContributionsCacheDirectory(),
+                rows, cols, filter.Patch, contributions, filter.OutWidth, filter.OutHeight);
+    } else {
+        video::ComputeMeshContributions(rows, cols, FilterMesh(rows, cols, filter),
+                filter.OutWidth, filter.OutHeight, FilterZeroOutside(filter), contributions);
     }
-    return img;
+}
+
+cv::Mat carbon::ApplyFilter(const cv::Mat img,
+        const rgms::video::PixelContributions& contributions) {
+    return rgms::video::RemoveCRT(img, contributions);
+}
+
+void carbon::ApplyFilter(const cv::Mat img,
+        const rgms::video::PixelContributions& contributions, cv::Mat* out) {
+    rgms::video::RemoveCRT(img, contributions, out);
 }
 
 void FilterConfig::FromString(const std::string& str) {
@@ -205,10 +248,17 @@ CarbonConfig CarbonConfig::Defaults() {
     cfg.FilterCfg = FilterConfig::Defaults();
     cfg.NumXGridDiv = 16;
     cfg.NumYGridDiv = 15;
+    cfg.Render = false;
+    cfg.RenderFps = 60.0;
+    cfg.RenderPipelineCfg = rgms::video::FramePipelineConfig::Defaults();
     return cfg;
 }
 
 bool carbon::ParseArgumentsToConfig(int* argc, char*** argv, CarbonConfig* config) {
+    if (*argc > 0 && std::string((*argv)[0]) == "--render") {
+        util::ArgNext(argc, argv);
+        config->Render = true;
+    }
     if (*argc == 2) {
         util::ArgReadString(argc, argv, &config->InPath);
         util::ArgReadString(argc, argv, &config->OutPath);
@@ -226,6 +276,66 @@ bool carbon::ParseArgumentsToConfig(int* argc, char*** argv, CarbonConfig* confi
     return false;
 }
 
+video::FramePipelineStats carbon::RenderVideo(const CarbonConfig& config) {
+    video::StaticVideoThreadConfig videoCfg = config.StaticVideoThreadCfg;
+    videoCfg.DecoderThreads = 0;
+    video::IVideoSourcePtr source = video::OpenVideoFile(config.InPath, videoCfg);
+    if (source->GetErrorState() != video::ErrorState::NO_ERROR) {
+        throw std::runtime_error(fmt::format("unable to open '{}': {}",
+                    config.InPath, source->GetLastError()));
+    }
+    video::ISeekableVideoSource* seekable = dynamic_cast<video::ISeekableVideoSource*>(source.get());
+
+    const FilterConfig& filter = config.FilterCfg;
+    spdlog::info("compiling filter for {}x{}", source->Width(), source->Height());
+    video::PixelContributions contrib;
+    CompileFilter(source->Height(), source->Width(), filter, &contrib);
+
+    video::FrameSink sink(config.OutPath, filter.OutWidth, filter.OutHeight, config.RenderFps);
+    spdlog::info("rendering {} to {}", config.InPath, config.OutPath);
+
+    auto start = std::chrono::steady_clock::now();
+    auto lastReport = start;
+    video::FramePipelineStats stats = video::RunFramePipeline(
+        video::VideoSourceReader(source.get()),
+        [&](const cv::Mat& in, cv::Mat* out){
+            ApplyFilter(in, contrib, out);
+        },
+        [&](int64_t frameIndex, int64_t ptsMilliseconds, const cv::Mat& out){
+            sink.Write(out, ptsMilliseconds);
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastReport < std::chrono::seconds(2)) {
+                return;
+            }
+            lastReport = now;
+            double fps = (frameIndex + 1) / std::chrono::duration<double>(now - start).count();
+
+            // The index is built in the background, so may not be there yet
+            std::shared_ptr<const video::VideoIndex> index;
+            if (seekable) {
+                index = seekable->GetIndex();
+            }
+            if (index && !index->Timestamps.empty()) {
+                int64_t total = static_cast<int64_t>(index->Timestamps.size());
+                spdlog::info("{} / {} frames ({:.1f}%), {:.1f} fps, {:.0f}s left",
+                        frameIndex + 1, total, 100.0 * (frameIndex + 1) / total, fps,
+                        (total - frameIndex - 1) / fps);
+            } else {
+                spdlog::info("{} frames, {:.1f} fps", frameIndex + 1, fps);
+            }
+        },
+        config.RenderPipelineCfg);
+    sink.Finish();
+
+    spdlog::info("rendered {} frames in {:.1f}s ({:.1f} fps) with {} workers",
+            stats.Frames, stats.Seconds,
+            stats.Seconds > 0.0 ? stats.Frames / stats.Seconds : 0.0, stats.Workers);
+    spdlog::info("busy: read {:.1f}s, filter {:.1f}s, write {:.1f}s",
+            stats.ReadSeconds, stats.TransformSeconds, stats.WriteSeconds);
+    return stats;
+}
+
 CarbonApp::CarbonApp(CarbonConfig* config)
     : m_Config(config)
     , m_VideoFrame(0)
@@ -233,13 +343,22 @@ CarbonApp::CarbonApp(CarbonConfig* config)
     , m_OutMult(4.0)
     , m_SelectedHandle(-1)
     , m_QuadHandlesActive(true)
+    , m_Refining(false)
+    , m_CancelRefine(false)
+    , m_RefineDone(false)
 {
+    video::IVideoIndexerPtr indexer = video::OpenVideoIndexer(m_Config->InPath);
     m_VideoThread = std::make_unique<video::StaticVideoThread>(
-        std::make_unique<video::CVVideoCaptureSource>(m_Config->InPath),
-        m_Config->StaticVideoThreadCfg);
+        [this, indexer](){
+            return video::OpenVideoFile(m_Config->InPath, m_Config->StaticVideoThreadCfg,
+                    video::VideoCrop{util::Rect2F(0, 0, 0, 0), 0, 0}, indexer);
+        },
+        m_Config->StaticVideoThreadCfg,
+        rgmui::RequestRedraw);
 }
 
 CarbonApp::~CarbonApp() {
+    StopRefiningContributions();
     if (!m_Config->OutPath.empty()) {
         std::ofstream of(m_Config->OutPath);
         of << m_Config->FilterCfg.ToString();
@@ -255,10 +374,16 @@ void CarbonApp::ReadFrame() {
                 CV_8UC3,
                 m_LiveInputFrame->Buffer);
 
-        if (m_Config->FilterCfg.Type == FilterType::UNCRT && m_PixelContributions.empty()) {
+        const FilterConfig& filter = m_Config->FilterCfg;
+        if (m_ContributionsFilter != filter.ToString() ||
+                (!m_Refining && !PixelContributionsMatch())) {
             UpdatePixelContributions();
         }
-        m_OutImage = ApplyFilter(m_Image, m_Config->FilterCfg, m_PixelContributions);
+        if (m_Refining) {
+            m_OutImage = video::RemoveCRTPreview(m_Image, m_Mesh, filter.OutWidth, filter.OutHeight);
+        } else {
+            m_OutImage = ApplyFilter(m_Image, m_PixelContributions);
+        }
 
         if (!(m_OutImage.rows == 0 || m_OutImage.cols == 0)) {
             cv::resize(m_OutImage, m_OutImage, {}, m_OutMult, m_OutMult, cv::INTER_NEAREST);
@@ -297,21 +422,85 @@ void CarbonApp::SelectHandleHotkeys() {
     }
 }
 
+bool CarbonApp::PixelContributionsMatch() const {
+    const video::PixelContributions& c = m_PixelContributions;
+    return m_LiveInputFrame && !c.empty() &&
+        c.InRows == m_LiveInputFrame->Height && c.InCols == m_LiveInputFrame->Width &&
+        c.OutX == m_Config->FilterCfg.OutWidth && c.OutY == m_Config->FilterCfg.OutHeight;
+}
+
 void CarbonApp::UpdatePixelContributions() {
-    if (m_LiveInputFrame) {
-        rgms::video::ComputePixelContributions(
-            m_LiveInputFrame->Height, m_LiveInputFrame->Width,
-            m_Config->FilterCfg.Patch,
-            &m_PixelContributions,
-            m_Config->FilterCfg.OutWidth,
-            m_Config->FilterCfg.OutHeight);
+    if (!m_LiveInputFrame) {
+        return;
+    }
+    StopRefiningContributions();
+
+    const FilterConfig& filter = m_Config->FilterCfg;
+    m_Mesh = FilterMesh(m_LiveInputFrame->Height, m_LiveInputFrame->Width, filter);
+    m_ContributionsFilter = filter.ToString();
+    m_Refining = true;
+    m_PixelContributions = video::PixelContributions();
+    m_RefineThread = std::thread(&CarbonApp::RefineContributions, this,
+            m_LiveInputFrame->Height, m_LiveInputFrame->Width, filter, m_Mesh);
+}
+
+void CarbonApp::StopRefiningContributions() {
+    if (m_RefineThread.joinable()) {
+        m_CancelRefine = true;
+        m_RefineThread.join();
+        m_CancelRefine = false;
+
+        // Empty if it was cancelled before finishing
+        std::lock_guard<std::mutex> lock(m_RefineMutex);
+        m_PixelContributions = std::move(m_RefinedContributions);
+        m_RefinedContributions = video::PixelContributions();
+    }
+    m_RefineDone = false;
+    m_Refining = false;
+}
+
+void CarbonApp::RefineContributions(int rows, int cols, FilterConfig filter,
+        std::vector<util::Vector2F> mesh) {
+    // Only uncrt is slow enough to be worth caching
+    std::string path;
+    if (filter.Type == FilterType::UNCRT) {
+        std::string dir = video::PixelContributionsCacheDirectory();
+        if (!dir.empty()) {
+            path = video::PixelContributionsCachePath(dir, rows, cols, filter.Patch,
+                    filter.OutWidth, filter.OutHeight);
+        }
+    }
+
+    video::PixelContributions contrib;
+    bool done = !path.empty() && video::LoadPixelContributions(path, &contrib);
+    if (!done) {
+        done = video::ComputeMeshContributions(rows, cols, mesh, filter.OutWidth,
+                filter.OutHeight, FilterZeroOutside(filter), &contrib, &m_CancelRefine);
+        if (done && !path.empty()) {
+            try {
+                video::SavePixelContributions(path, contrib);
+            } catch (const std::exception&) {
+            }
+        }
+    }
+
+    if (done) {
+        {
+            std::lock_guard<std::mutex> lock(m_RefineMutex);
+            m_RefinedContributions = std::move(contrib);
+        }
+        m_RefineDone = true;
+        rgmui::RequestRedraw();
     }
 }
 
 
 bool CarbonApp::OnFrame() {
     bool changed = !m_LiveInputFrame;
-    bool uncrtchanged = false;
+    if (m_RefineDone) {
+        StopRefiningContributions(); // just joins and takes the result
+        changed = true;
+    }
     if (ImGui::Begin("filter")) {
         FilterConfig* filter = &m_Config->FilterCfg;
 
@@ -333,7 +522,7 @@ bool CarbonApp::OnFrame() {
         }
         if (ImGui::RadioButton("Uncrt", filter->Type == FilterType::UNCRT)) {
             filter->Type = FilterType::UNCRT;
-            uncrtchanged = true;
+            changed = true;
             typeChanged = true;
         }
 
@@ -373,7 +562,7 @@ bool CarbonApp::OnFrame() {
             int i = 0;
             for (int y = 0; y < 4; y++) {
                 for (int x = 0; x < 4; x++) {
-                    uncrtchanged |= ImGui::InputFloat2(fmt::format("{:02d}", i).c_str(), filter->Patch[i].data.data(), "%.0f");
+                    changed |= ImGui::InputFloat2(fmt::format("{:02d}", i).c_str(), filter->Patch[i].data.data(), "%.0f");
                     i++;
                 }
             }
@@ -412,9 +601,6 @@ bool CarbonApp::OnFrame() {
                                 static_cast<float>(dx),
                                 static_cast<float>(dy)));
                     changed = true;
-                    if (m_Config->FilterCfg.Type == FilterType::UNCRT) {
-                        uncrtchanged = true;
-                    }
                 }
             }
 
@@ -449,9 +635,6 @@ bool CarbonApp::OnFrame() {
                 auto p = mat.ScreenPosToMatPos2F(sp);
                 m_Handles[m_SelectedHandle]->MoveTo(p);
                 changed = true;
-                if (m_Config->FilterCfg.Type == FilterType::UNCRT) {
-                    uncrtchanged = true;
-                }
             }
 
             DrawHandles(&mat);
@@ -485,11 +668,7 @@ bool CarbonApp::OnFrame() {
     }
     ImGui::End();
 
-    if (uncrtchanged) {
-        UpdatePixelContributions();
-    }
-
-    if (changed || uncrtchanged) {
+    if (changed) {
         ReadFrame();
     }
     return true;
@@ -28,11 +28,16 @@
 #ifndef CARBON_CARBON_HEADER
 #define CARBON_CARBON_HEADER
 
+#include <atomic>
 #include <initializer_list>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "rgmui/rgmui.h"
 #include "rgmvideo/video.h"
 #include "rgmvideo/uncrt.h"
+#include "rgmvideo/pipeline.h"
 
 namespace carbon {
 
@@ -56,8 +61,21 @@ struct FilterConfig {
 
     static FilterConfig Defaults();
 };
-cv::Mat ApplyFilter(const cv::Mat img, const FilterConfig& filter,
-        const rgms::video::PixelContributions& contributions);
+// Every filter is a resampling of the frame, each output pixel is a quad of
+// the frame and the frame pixels under it are averaged (see uncrt.h). So they
+// all compile, once per change of the filter or of the frame size, to
+// PixelContributions which are then applied to every frame the same way.
+
+// The (OutWidth + 1) x (OutHeight + 1) quad corners in frame coordinates
+std::vector<rgms::util::Vector2F> FilterMesh(int rows, int cols, const FilterConfig& filter);
+// Whether the parts of the mesh outside the frame are black (not uncrt)
+bool FilterZeroOutside(const FilterConfig& filter);
+// UNCRT goes through the contributions cache
+void CompileFilter(int rows, int cols, const FilterConfig& filter,
+        rgms::video::PixelContributions* contributions);
+cv::Mat ApplyFilter(const cv::Mat img, const rgms::video::PixelContributions& contributions);
+void ApplyFilter(const cv::Mat img, const rgms::video::PixelContributions& contributions,
+        cv::Mat* out);
 cv::Mat GetFilterPerspectiveMatrix(int width, int height, const FilterConfig& filter);
 
 struct CarbonConfig {
@@ -69,11 +87,19 @@ struct CarbonConfig {
 
     rgms::video::StaticVideoThreadConfig StaticVideoThreadCfg;
 
+    // carbon --render, OutPath is then the video (or .gfc frame cache) to write
+    bool Render;
+    double RenderFps;
+    rgms::video::FramePipelineConfig RenderPipelineCfg;
 
     static CarbonConfig Defaults();
 };
 bool ParseArgumentsToConfig(int* argc, char*** argv, CarbonConfig* config);
 
+// Applies the filter to every frame of InPath and writes them to OutPath,
+// without any ui. Throws on errors
+rgms::video::FramePipelineStats RenderVideo(const CarbonConfig& config);
+
 class IHandle {
 public:
     IHandle();
@@ -154,7 +180,11 @@ private:
     void DrawHandles(rgms::rgmui::MatAnnotator* mat);
     void SelectHandleHotkeys();
     rgms::util::Vector2F HandleSize(int x, int y);
+    bool PixelContributionsMatch() const;
     void UpdatePixelContributions();
+    void StopRefiningContributions();
+    void RefineContributions(int rows, int cols, FilterConfig filter,
+            std::vector<rgms::util::Vector2F> mesh);
 
 private:
     CarbonConfig* m_Config;
@@ -169,6 +199,20 @@ private:
     std::unique_ptr<rgms::video::StaticVideoThread> m_VideoThread;
     rgms::video::LiveInputFramePtr m_LiveInputFrame;
     rgms::video::PixelContributions m_PixelContributions;
+
+    // While the filter changes (its handles are dragged) the contributions
+    // are computed in the background, and until then the output is
+    // RemoveCRTPreview of m_Mesh. Cancelled and restarted whenever the mesh
+    // changes again.
+    std::string m_ContributionsFilter; // FilterConfig::ToString of m_Mesh
+    std::vector<rgms::util::Vector2F> m_Mesh;
+    bool m_Refining;
+    std::thread m_RefineThread;
+    std::atomic<bool> m_CancelRefine;
+    std::atomic<bool> m_RefineDone;
+    std::mutex m_RefineMutex;
+    rgms::video::PixelContributions m_RefinedContributions;
+
     cv::Mat m_Image;
     cv::Mat m_OutImage;
 };
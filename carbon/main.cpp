@@ -37,7 +37,10 @@ int main(int argc, char** argv) {
         CarbonConfig config = CarbonConfig::Defaults();
         if (!ParseArgumentsToConfig(&argc, &argv, &config)) {
             spdlog::error("usage: carbon in_path out_path <filter>");
+            spdlog::error("   or: carbon --render in_path out_video <filter>");
             ret = 1;
+        } else if (config.Render) {
+            RenderVideo(config);
         } else {
             spdlog::info("in path: {}", config.InPath);
             spdlog::info("out path: {}", config.OutPath);
@@ -49,7 +52,8 @@ int main(int argc, char** argv) {
             spdlog::info("app created");
 
             spdlog::info("main loop initiated");
-            rgmui::WindowAppMainLoop(&window, &app, std::chrono::microseconds(16333));
+            rgmui::WindowAppMainLoop(&window, &app, std::chrono::microseconds(16333),
+                std::chrono::milliseconds(250));
         }
     } catch(const std::exception& e) {
         rgmui::LogAndDisplayException(e);
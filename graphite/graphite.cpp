@@ -23,10 +23,16 @@
 #include <iomanip>
 #include <fstream>
 #include <iostream>
+#include <cstring>
 #define _SILENCE_EXPERIMENTAL_FILESYSTEM_DEPRECATION_WARNING
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RGMS_GRAPHITE_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "fmt/core.h"
 #include "imgui_internal.h"
 #include "spdlog/spdlog.h"
@@ -35,6 +41,8 @@ namespace fs = std::experimental::filesystem;
 
 #include "graphite/graphite.h"
 #include "rgmnes/nestopiaimpl.h"
+#include "rgmvideo/videofile.h"
+#include "rgmvideo/framecache.h"
 
 
 using namespace graphite;
@@ -148,11 +156,15 @@ GraphiteApp::GraphiteApp(GraphiteConfig* config)
     RegisterComponent(std::make_shared<NESEmulatorComponent>(
                 &m_EventQueue, m_Config->InesPath, &m_Config->EmuViewCfg, overlay));
     spdlog::info("registered NESEmulatorComponent");
+    std::vector<uint8_t> ines;
+    util::ReadFileToVector(m_Config->InesPath, &ines);
+    std::string romChecksum = nes::FM2RomChecksum(std::string(ines.begin(), ines.end()));
     RegisterComponent(std::make_shared<InputsComponent>(
-                &m_EventQueue, m_Config->FM2Path, &m_Config->InputsCfg));
+                &m_EventQueue, m_Config->FM2Path, romChecksum, &m_Config->InputsCfg));
     spdlog::info("registered InputsComponent");
     RegisterComponent(std::make_shared<VideoComponent>(
-                &m_EventQueue, m_Config->VideoPath, &m_Config->VideoCfg, overlay));
+                &m_EventQueue, m_Config->VideoPath, &m_Config->VideoCfg, overlay,
+                m_Config->EmuViewCfg.ScreenPeekCfg.NESPalette));
     spdlog::info("registered VideoComponent");
     RegisterComponent(std::make_shared<PlaybackComponent>(
                 &m_EventQueue));
@@ -224,6 +236,11 @@ bool GraphiteApp::DoMainMenuBar() {
             ImGui::Checkbox("Sticky auto-scroll", &m_Config->InputsCfg.StickyAutoScroll);
             ImGui::Checkbox("Display RAM watch", &m_Config->EmuViewCfg.RAMWatchCfg.Display);
             ImGui::Checkbox("Allow LR and UD", &m_Config->InputsCfg.AllowLROrUD);
+            ImGui::Separator();
+            // Read when the video is opened, so these apply from the next start
+            video::StaticVideoThreadConfig& videoCfg = m_Config->VideoCfg.StaticVideoThreadCfg;
+            ImGui::Checkbox("Frame cache (next start)", &videoCfg.FrameCache);
+            ImGui::Checkbox("Frame cache as palette indices", &videoCfg.FrameCachePalette);
             ImGui::EndMenu();
         }
 
@@ -240,7 +257,9 @@ NESEmulatorComponent::NESEmulatorComponent(rgmui::EventQueue* queue,
     , m_EmulatorFactory(InitializeEmulatorFactory(inesPath))
     , m_StateSequenceThread(
             emuViewConfig->StateSequenceThreadCfg,
-            std::move(m_EmulatorFactory->GetEmu()))
+            std::move(m_EmulatorFactory->GetEmu()),
+            std::vector<nes::ControllerState>(),
+            rgmui::RequestRedraw)
 {
     m_EventQueue->SubscribeI(EventType::INPUT_TARGET_SET_TO, [&](int v){
         m_StateSequenceThread.TargetChange(v);
@@ -409,11 +428,13 @@ InputsConfig InputsConfig::Defaults() {
 
 InputsComponent::InputsComponent(rgmui::EventQueue* queue,
         const std::string& fm2Path,
+        const std::string& romChecksum,
         InputsConfig* config)
     : m_EventQueue(queue)
     , m_TargetScroller(this)
     , m_DragInputChanger(this)
     , m_FM2Path(fm2Path)
+    , m_RomChecksum(romChecksum)
     , m_Config(config)
     , m_UndoRedo(queue, &m_Inputs)
     , m_Inputs(1000, 0)
@@ -425,6 +446,9 @@ InputsComponent::InputsComponent(rgmui::EventQueue* queue,
     , m_MarkerIndex(-1)
     , m_CurrentIndex(0)
     , m_OffsetMillis(0)
+    , m_SearchButtons(nes::Button::A)
+    , m_SearchMinHeld(1)
+    , m_ShiftFrames(1)
 {
     queue->SubscribeI(EventType::SET_INPUT_TARGET_TO, [&](int v){
         ChangeTargetTo(v, false);
@@ -447,9 +471,13 @@ InputsComponent::InputsComponent(rgmui::EventQueue* queue,
     });
     queue->SubscribeI(EventType::OFFSET_SET_TO, [&](int v){
         m_OffsetMillis = v;
+        UpdateOffsetLine();
+        if (m_Journal) {
+            m_Journal->SetHeader(m_Header);
+        }
     });
     queue->Subscribe(EventType::REQUEST_SAVE, [&](){
-        WriteFM2();
+        SaveFM2();
     });
 
     TryReadFM2();
@@ -489,9 +517,40 @@ void InputsComponent::HandleHotkeys() {
 }
 
 void InputsComponent::TryReadFM2() {
-    std::ifstream ifs(m_FM2Path);
-    if (ifs.good()) {
-        nes::ReadFM2File(ifs, &m_Inputs, &m_Header);
+    bool exists = util::FileExists(m_FM2Path);
+    if (exists) {
+        nes::ReadFM2File(m_FM2Path, &m_Inputs, &m_Header);
+    } else {
+        m_Header = nes::FM2Header::Defaults();
+    }
+    // Carrying on would stamp the movie with this rom on the next save, and
+    // hide that it was made for another
+    if (m_Header.romChecksum != nes::FM2Header::Defaults().romChecksum &&
+        m_Header.romChecksum != m_RomChecksum) {
+        throw std::runtime_error(fmt::format(
+                "'{}' was made with a different rom (checksum {}, rom is {}). "
+                "Open it with that rom, or remove its romChecksum line to use this one",
+                m_FM2Path, m_Header.romChecksum, m_RomChecksum));
+    }
+    m_Header.romChecksum = m_RomChecksum;
+
+    // Without a journal (read only directory, full disk...) edits are only
+    // written on save
+    try {
+        m_Journal = std::make_unique<nes::FM2Journal>(m_FM2Path, &m_Inputs, m_Header);
+    } catch (const std::exception& e) {
+        spdlog::warn("fm2 journal '{}' unavailable, edits are only kept on save: {}",
+                nes::FM2Journal::JournalPath(m_FM2Path), e.what());
+        m_Journal.reset();
+    }
+    m_UndoRedo.SetJournal(m_Journal.get());
+    if (m_Journal && m_Journal->ReplayedRecords() > 0) {
+        spdlog::info("recovered {} unsaved edits from '{}'", m_Journal->ReplayedRecords(),
+                nes::FM2Journal::JournalPath(m_FM2Path));
+        exists = true;
+    }
+
+    if (exists) {
         int frameIndex = 0;
         for (auto & input : m_Inputs) {
             if (input) {
@@ -507,9 +566,6 @@ void InputsComponent::TryReadFM2() {
                 break;
             }
         }
-
-    } else {
-        m_Header = nes::FM2Header::Defaults();
     }
 }
 
@@ -517,8 +573,7 @@ std::string InputsComponent::OffsetLine() const {
     return fmt::format("{}{}", FM2_OFFSET_COMMENT_LINE_START, m_OffsetMillis);
 }
 
-void InputsComponent::WriteFM2() {
-    std::ofstream ofs(m_FM2Path);
+void InputsComponent::UpdateOffsetLine() {
     bool offsetFound = false;
     for (auto & line : m_Header.additionalLines) {
         if (StringStartsWith(line, FM2_OFFSET_COMMENT_LINE_START)) {
@@ -529,6 +584,22 @@ void InputsComponent::WriteFM2() {
     if (!offsetFound) {
         m_Header.additionalLines.push_back(OffsetLine());
     }
+}
+
+// With a journal the edits since the last save are all that need writing, the
+// fm2 itself is rewritten by the journal's own compactions (and on exit)
+void InputsComponent::SaveFM2() {
+    if (!m_Journal) {
+        WriteFM2();
+        return;
+    }
+    spdlog::info("saving fm2 edits to '{}' sync offset: '{}'",
+            nes::FM2Journal::JournalPath(m_FM2Path), m_OffsetMillis);
+    m_Journal->Flush();
+}
+
+void InputsComponent::WriteFM2() {
+    UpdateOffsetLine();
     while (m_Inputs.size() > 1000 && m_Inputs.back() == 0) {
         m_Inputs.pop_back();
     }
@@ -538,8 +609,16 @@ void InputsComponent::WriteFM2() {
         }
     }
 
-    spdlog::info("written fm2 to '{}' sync offset: '{}'", m_FM2Path, m_OffsetMillis);
-    nes::WriteFM2File(ofs, m_Inputs, m_Header);
+    spdlog::info("saving fm2 to '{}' sync offset: '{}'", m_FM2Path, m_OffsetMillis);
+    if (m_Journal) {
+        m_Journal->Compact(m_Inputs, m_Header);
+    } else {
+        try {
+            nes::WriteFM2File(m_FM2Path, m_Inputs, m_Header);
+        } catch (const std::exception& e) {
+            spdlog::error("unable to save fm2 '{}': {}", m_FM2Path, e.what());
+        }
+    }
 }
 
 std::string InputsComponent::FrameText(int frameId) const {
@@ -837,26 +916,30 @@ void InputsComponent::DoInsertFrame(int frameIndex, int n) {
 }
 
 std::pair<int, int> InputsComponent::FindPreviousJump() {
-    bool foundEnd = false;
-    int start = 0;
-    int end = 0;
-    for (int i = m_TargetIndex; i >= 0; i--) {
-        if (!foundEnd && m_Inputs[i] & nes::Button::A) {
-            end = i;
-            foundEnd = true;
-        } else if (foundEnd && !(m_Inputs[i] & nes::Button::A)) {
-            start = i + 1;
-            break;
-        }
+    int end = nes::FindPreviousInput(m_Inputs, m_TargetIndex, nes::Button::A, nes::Button::A);
+    if (end < 0) {
+        return std::make_pair(0, 0);
     }
-    if (foundEnd) {
-        while (end < (m_Inputs.size()) && m_Inputs[end] & nes::Button::A) {
-            end++;
-        }
+    int start = nes::FindPreviousInput(m_Inputs, end, nes::Button::A, 0x00) + 1;
+    end = nes::FindNextInput(m_Inputs, end, nes::Button::A, 0x00);
+    if (end < 0) {
+        end = static_cast<int>(m_Inputs.size());
     }
     return std::make_pair(start, end);
 }
 
+void InputsComponent::TransformInputs(int from, int to,
+        std::function<void(std::vector<nes::ControllerState>* inputs)> transform) {
+    from = std::max(from, 0);
+    to = std::min(to, static_cast<int>(m_Inputs.size()));
+    if (from >= to) {
+        return;
+    }
+    std::vector<nes::ControllerState> inputs = m_Inputs;
+    transform(&inputs);
+    m_UndoRedo.ChangeInputsTo(from, std::vector<nes::ControllerState>(
+                inputs.begin() + from, inputs.begin() + to));
+}
 
 void InputsComponent::DoInputAction(InputAction action) {
     switch(action) {
@@ -914,14 +997,9 @@ void InputsComponent::DoInputAction(InputAction action) {
                     s = from;
                 }
 
-                int nchanges = 0;
-                for (int i = 0; i < 35; i++) {
-                    if (!(m_Inputs[s + i] & nes::Button::A)) {
-                        nchanges++;
-                        m_UndoRedo.ChangeInputTo(s + i, m_Inputs[s + i] | nes::Button::A);
-                    }
-                }
-                m_UndoRedo.ConsolidateLast(nchanges);
+                TransformInputs(s, s + 35, [&](std::vector<nes::ControllerState>* inputs){
+                    nes::SetButtons(inputs, s, s + 35, nes::Button::A);
+                });
             }
             break;
         }
@@ -937,10 +1015,9 @@ void InputsComponent::DoInputAction(InputAction action) {
         case InputAction::SMB_REMOVE_LAST_JUMP: {
             auto [from, to] = FindPreviousJump();
             if (from != to) {
-                for (int i = from; i < to; i++) {
-                    m_UndoRedo.ChangeInputTo(i, m_Inputs[i] & ~nes::Button::A);
-                }
-                m_UndoRedo.ConsolidateLast(to - from);
+                TransformInputs(from, to, [&](std::vector<nes::ControllerState>* inputs){
+                    nes::ClearButtons(inputs, from, to, nes::Button::A);
+                });
             }
             break;
         }
@@ -982,25 +1059,29 @@ void InputsComponent::DoInputAction(InputAction action) {
 }
 
 void InputsComponent::ChangeAllInputsTo(const std::vector<rgms::nes::ControllerState>& inputs) {
-    int numChanges = 0;
-    for (size_t i = inputs.size(); i < m_Inputs.size(); i++) {
-        if (m_Inputs[i] != 0x00) {
-            m_UndoRedo.ChangeInputTo(static_cast<int>(i), 0x00);
-            numChanges++;
-        }
-    }
+    size_t n = std::max(inputs.size(), m_Inputs.size());
+    auto At = [](const std::vector<nes::ControllerState>& v, size_t i) {
+        return (i < v.size()) ? v[i] : static_cast<nes::ControllerState>(0x00);
+    };
 
-    for (size_t i = 0; i < std::min(inputs.size(), m_Inputs.size()); i++) {
-        if (inputs[i] != m_Inputs[i]) {
-            m_UndoRedo.ChangeInputTo(static_cast<int>(i), inputs[i]);
-            numChanges++;
-        }
+    size_t first = 0;
+    while (first < n && At(inputs, first) == At(m_Inputs, first)) {
+        first++;
+    }
+    if (first == n) {
+        return;
+    }
+    size_t last = n - 1;
+    while (At(inputs, last) == At(m_Inputs, last)) {
+        last--;
     }
 
-    if (numChanges > 0) {
-        m_Inputs = inputs;
-        m_UndoRedo.ConsolidateLast(numChanges);
+    std::vector<nes::ControllerState> newStates(last - first + 1);
+    for (size_t i = first; i <= last; i++) {
+        newStates[i - first] = At(inputs, i);
     }
+    m_UndoRedo.ChangeInputsTo(static_cast<int>(first), newStates);
+    m_Inputs.resize(inputs.size(), 0x00);
 }
 
 void InputsComponent::CheckLRUD(uint8_t button, uint8_t* input) {
@@ -1052,7 +1133,7 @@ void InputsComponent::OnSDLEvent(const SDL_Event& e) {
             m_UndoRedo.Redo();
         }
         else if (rgmui::KeyDownWithCtrl(e, SDLK_s)) {
-            WriteFM2();
+            SaveFM2();
         }
     }
 }
@@ -1072,12 +1153,84 @@ void InputsComponent::DoMainMenuBar() {
             }
             ImGui::EndMenu();
         }
+        if (ImGui::BeginMenu("search")) {
+            DoSearchMenu();
+            ImGui::EndMenu();
+        }
 
         ImGui::EndMainMenuBar();
     }
 }
 
+void InputsComponent::DoSearchMenu() {
+    static const std::array<uint8_t, 8> BUTTONS = {
+        nes::Button::RIGHT, nes::Button::LEFT, nes::Button::DOWN, nes::Button::UP,
+        nes::Button::START, nes::Button::SELECT, nes::Button::B, nes::Button::A,
+    };
+    for (auto button : BUTTONS) {
+        ImGui::CheckboxFlags(ButtonText(button).c_str(), &m_SearchButtons, button);
+        ImGui::SameLine();
+    }
+    ImGui::NewLine();
+    nes::ControllerState buttons = static_cast<nes::ControllerState>(m_SearchButtons);
+
+    ImGui::PushItemWidth(80);
+    if (ImGui::MenuItem("Next press", nullptr, false, buttons != 0)) {
+        int i = nes::FindNextPress(m_Inputs, m_TargetIndex + 1, buttons);
+        if (i >= 0) {
+            ChangeTargetTo(i, true);
+        }
+    }
+    if (ImGui::MenuItem("Previous press", nullptr, false, buttons != 0)) {
+        int i = nes::FindPreviousPress(m_Inputs, m_TargetIndex - 1, buttons);
+        if (i >= 0) {
+            ChangeTargetTo(i, true);
+        }
+    }
+    ImGui::InputInt("min held", &m_SearchMinHeld);
+    m_SearchMinHeld = std::max(m_SearchMinHeld, 1);
+    if (ImGui::MenuItem("Next held run", nullptr, false, buttons != 0)) {
+        int from = nes::FindNextInput(m_Inputs, m_TargetIndex, buttons, 0x00);
+        int i = (from < 0) ? -1 : nes::FindNextHeldRun(m_Inputs, from, buttons, m_SearchMinHeld);
+        if (i >= 0) {
+            ChangeTargetTo(i, true);
+        }
+    }
+
+    // Transforms act on the frames between the marker and the target
+    ImGui::Separator();
+    bool hasRange = m_MarkerIndex >= 0 && buttons != 0;
+    int from = std::min(m_MarkerIndex, m_TargetIndex);
+    int to = std::max(m_MarkerIndex, m_TargetIndex) + 1;
+    if (hasRange) {
+        ImGui::TextUnformatted(fmt::format("frames {} to {}", from, to - 1).c_str());
+    } else {
+        ImGui::TextUnformatted("set a marker to transform a range");
+    }
+    ImGui::InputInt("frames", &m_ShiftFrames);
+    if (ImGui::MenuItem("Shift buttons", nullptr, false, hasRange && m_ShiftFrames != 0)) {
+        TransformInputs(from, to, [&](std::vector<nes::ControllerState>* inputs){
+            nes::ShiftButtons(inputs, from, to, buttons, m_ShiftFrames);
+        });
+    }
+    if (ImGui::MenuItem("Clear buttons", nullptr, false, hasRange)) {
+        TransformInputs(from, to, [&](std::vector<nes::ControllerState>* inputs){
+            nes::ClearButtons(inputs, from, to, buttons);
+        });
+    }
+    if (ImGui::MenuItem("Set buttons", nullptr, false, hasRange)) {
+        TransformInputs(from, to, [&](std::vector<nes::ControllerState>* inputs){
+            nes::SetButtons(inputs, from, to, buttons);
+        });
+    }
+    ImGui::PopItemWidth();
+}
+
 void InputsComponent::OnFrame() {
+    std::string journalError;
+    if (m_Journal && m_Journal->HasError(&journalError)) {
+        spdlog::error("fm2 journal '{}': {}", m_FM2Path, journalError);
+    }
     DoMainMenuBar();
 
     if (ImGui::Begin(WindowName().c_str())) {
@@ -1311,6 +1464,7 @@ UndoRedo::UndoRedo(rgmui::EventQueue* queue,
         std::vector<nes::ControllerState>* inputs)
     : m_EventQueue(queue)
     , m_Inputs(inputs)
+    , m_Journal(nullptr)
     , m_ChangeIndex(0)
 {
 }
@@ -1321,34 +1475,56 @@ UndoRedo::~UndoRedo() {
 UndoRedo::Change::Change()  {
 }
 
-UndoRedo::Change::Change(int _frameIndex, nes::ControllerState _oldState, nes::ControllerState _newState)
+UndoRedo::Change::Change(int _frameIndex,
+        std::vector<nes::ControllerState> _oldStates,
+        std::vector<nes::ControllerState> _newStates)
     : FrameIndex(_frameIndex)
-    , OldState(_oldState)
-    , NewState(_newState)
+    , OldStates(std::move(_oldStates))
+    , NewStates(std::move(_newStates))
     , Consolidated(false)
 {
 }
 
 void UndoRedo::ChangeInputTo(int frameIndex, nes::ControllerState newState) {
-    if (m_Inputs->size() <= frameIndex) {
-        m_Inputs->resize(frameIndex + 1, 0x00);
+    ChangeInputsTo(frameIndex, {newState});
+}
+
+void UndoRedo::ChangeInputsTo(int frameIndex, const std::vector<nes::ControllerState>& newStates) {
+    size_t end = static_cast<size_t>(frameIndex) + newStates.size();
+    if (m_Inputs->size() < end) {
+        m_Inputs->resize(end, 0x00);
     }
     m_Changes.resize(m_ChangeIndex);
-    m_Changes.emplace_back(frameIndex, m_Inputs->at(frameIndex), newState);
+    m_Changes.emplace_back(frameIndex,
+            std::vector<nes::ControllerState>(m_Inputs->begin() + frameIndex, m_Inputs->begin() + end),
+            newStates);
 
-    IntChangeInput(frameIndex, newState);
+    IntChangeInputs(frameIndex, newStates);
 
     m_ChangeIndex++;
 }
 
-void UndoRedo::IntChangeInput(int frameIndex, nes::ControllerState newState) {
-    if (frameIndex > m_Inputs->size()) {
-        m_Inputs->resize(frameIndex + 1, 0x00);
+void UndoRedo::IntChangeInputs(int frameIndex, const std::vector<nes::ControllerState>& newStates) {
+    size_t end = static_cast<size_t>(frameIndex) + newStates.size();
+    if (m_Inputs->size() < end) {
+        m_Inputs->resize(end, 0x00);
+    }
+    for (size_t i = 0; i < newStates.size(); i++) {
+        int f = frameIndex + static_cast<int>(i);
+        if (m_Inputs->at(f) == newStates[i]) {
+            continue;
+        }
+        m_Inputs->at(f) = newStates[i];
+        m_EventQueue->Publish(EventType::INPUT_SET_TO,
+                std::make_shared<InputChangeEvent>(f, newStates[i]));
+        if (m_Journal) {
+            m_Journal->RecordEdit(f, newStates[i]);
+        }
     }
-    m_Inputs->at(frameIndex) = newState;
-    m_EventQueue->Publish(EventType::INPUT_SET_TO,
-            std::make_shared<InputChangeEvent>(frameIndex, newState));
+}
 
+void UndoRedo::SetJournal(nes::FM2Journal* journal) {
+    m_Journal = journal;
 }
 
 void UndoRedo::Undo() {
@@ -1357,8 +1533,8 @@ void UndoRedo::Undo() {
             m_ChangeIndex--;
             assert(m_ChangeIndex >= 0);
 
-            IntChangeInput(m_Changes[m_ChangeIndex].FrameIndex,
-                    m_Changes[m_ChangeIndex].OldState);
+            IntChangeInputs(m_Changes[m_ChangeIndex].FrameIndex,
+                    m_Changes[m_ChangeIndex].OldStates);
         } while (m_Changes[m_ChangeIndex].Consolidated);
     }
 }
@@ -1366,8 +1542,8 @@ void UndoRedo::Undo() {
 void UndoRedo::Redo() {
     if (m_ChangeIndex < m_Changes.size()) {
         do {
-            IntChangeInput(m_Changes[m_ChangeIndex].FrameIndex,
-                    m_Changes[m_ChangeIndex].NewState);
+            IntChangeInputs(m_Changes[m_ChangeIndex].FrameIndex,
+                    m_Changes[m_ChangeIndex].NewStates);
 
             m_ChangeIndex++;
         } while (m_ChangeIndex < m_Changes.size() && m_Changes[m_ChangeIndex].Consolidated);
@@ -1381,7 +1557,7 @@ void UndoRedo::ConsolidateLast(int count) {
     int numNoChange = 0;
     int origChangeIndex = m_ChangeIndex;
     for (int i = origChangeIndex - 1; i >= (origChangeIndex - count); i--) {
-        if (m_Changes[i].OldState == m_Changes[i].NewState) {
+        if (m_Changes[i].OldStates == m_Changes[i].NewStates) {
             numNoChange++;
             m_ChangeIndex--;
             std::swap(m_Changes[i], m_Changes[m_ChangeIndex]);
@@ -1473,26 +1649,10 @@ ScreenPeekConfig ScreenPeekConfig::Defaults() {
 static cv::Mat ConstructPaletteImage(
     const uint8_t* imgData,
     int width, int height,
-    const uint8_t* paletteData
+    const nes::Palette& palette
 ) {
     cv::Mat m(height, width, CV_8UC3);
-
-    uint8_t* o = reinterpret_cast<uint8_t*>(m.data);
-
-    int a = 2;
-    int b = 1;
-    int c = 0;
-
-    for (int k = 0; k < (width * height); k++) {
-        const uint8_t* p = paletteData + (*imgData * 3);
-
-        *(o + 0) = *(p + a);
-        *(o + 1) = *(p + b);
-        *(o + 2) = *(p + c);
-
-        o += 3;
-        imgData++;
-    }
+    nes::ExpandPalette(imgData, width, height, palette, 1, 3, m.data, m.step[0]);
     return m;
 }
 
@@ -1501,9 +1661,13 @@ ScreenPeekSubComponent::ScreenPeekSubComponent(rgmui::EventQueue* queue,
     : m_EventQueue(queue)
     , m_Config(config)
     , m_Overlay(overlay)
+    , m_Blank(true)
+    , m_FrameGeneration(0)
+    , m_ImageGeneration(0)
+    , m_ImageStale(true)
 {
     m_EventQueue->Subscribe(EventType::REFRESH_CONFIG, [&](){
-        ConstructImageFromFrame();
+        m_ImageStale = true;
     });
     SetBlankImage();
 }
@@ -1514,31 +1678,36 @@ ScreenPeekSubComponent::~ScreenPeekSubComponent() {
 void ScreenPeekSubComponent::CacheNewEmulatorData(nes::INESEmulator* emu) {
     if (emu) {
         emu->ScreenPeekFrame(&m_Frame);
+        m_Blank = false;
+        m_FrameGeneration++;
 
-        cv::Mat m = ConstructPaletteImage(
-                m_Frame.data(), nes::FRAME_WIDTH, nes::FRAME_HEIGHT,
-                m_Config->NESPalette.data());
-        m_Overlay->SetNewEmuFrame(m);
-        ConstructImageFromFrame();
+        // Neither the overlay nor the screen are expanded to colors here,
+        // only once (and if) something actually draws them that way
+        m_Overlay->SetNewEmuFrame(m_Frame, m_Config->NESPalette);
+        m_ImageStale = true;
     } else {
         SetBlankImage();
     }
 }
 
 void ScreenPeekSubComponent::ConstructImageFromFrame() {
-    m_Image = ConstructPaletteImage(
-            m_Frame.data(), nes::FRAME_WIDTH, nes::FRAME_HEIGHT,
-            m_Config->NESPalette.data());
-    cv::resize(m_Image, m_Image, {}, m_Config->ScreenMultiplier, m_Config->ScreenMultiplier,
-            cv::INTER_NEAREST);
-    m_Overlay->ApplyEmuOverlay(m_Image, m_Config->ScreenMultiplier);
+    if (m_Blank) {
+        m_Image = cv::Mat::zeros(nes::FRAME_HEIGHT, nes::FRAME_WIDTH, CV_8UC3);
+    } else {
+        m_Image = ConstructPaletteImage(
+                m_Frame.data(), nes::FRAME_WIDTH, nes::FRAME_HEIGHT,
+                m_Config->NESPalette);
+        m_Overlay->ApplyEmuOverlay(m_Image, &m_Image);
+    }
+    m_ImageGeneration++;
+    m_ImageStale = false;
 }
 
 void ScreenPeekSubComponent::SetBlankImage() {
     m_Frame.fill(0);
-    m_Image = cv::Mat::zeros(
-            nes::FRAME_HEIGHT * m_Config->ScreenMultiplier,
-            nes::FRAME_WIDTH * m_Config->ScreenMultiplier, CV_8UC3);
+    m_Blank = true;
+    m_FrameGeneration++;
+    m_ImageStale = true;
 }
 
 
@@ -1548,11 +1717,23 @@ std::string ScreenPeekSubComponent::WindowName() {
 
 void ScreenPeekSubComponent::OnFrame() {
     if (ImGui::Begin(WindowName().c_str())) {
-        if (m_Overlay->NewEmuOverlay()) {
-            ConstructImageFromFrame();
-        }
         ImVec2 cursorPos = ImGui::GetCursorScreenPos();
-        rgmui::Mat("screen", m_Image);
+        float scale = static_cast<float>(m_Config->ScreenMultiplier);
+
+        // Without an overlay the palette lookup is left to the gpu, and only
+        // the indices are uploaded
+        bool drawn = false;
+        if (!m_Blank && !m_Overlay->EmuOverlayActive()) {
+            drawn = rgmui::PaletteMat("screen", m_Frame.data(),
+                    nes::FRAME_WIDTH, nes::FRAME_HEIGHT, m_FrameGeneration,
+                    m_Config->NESPalette.data(), scale);
+        }
+        if (!drawn) {
+            if (m_ImageStale || m_Overlay->NewEmuOverlay()) {
+                ConstructImageFromFrame();
+            }
+            rgmui::Mat("screen", m_Image, m_ImageGeneration, scale);
+        }
         if (ImGui::IsItemHovered()) {
             auto& io = ImGui::GetIO();
             int m = static_cast<int>(-io.MouseWheel);
@@ -1640,7 +1821,7 @@ void ScreenPeekSubComponent::DoPopupItems(int x, int y, uint8_t pixel) {
 
     ImGui::PushItemWidth(100);
     if (ImGui::SliderInt("mult", &m_Config->ScreenMultiplier, 1, 5)) {
-        ConstructImageFromFrame();
+        m_ImageStale = true;
     }
     ImGui::PopItemWidth();
 }
@@ -1752,7 +1933,8 @@ VideoConfig VideoConfig::Defaults() {
 VideoComponent::VideoComponent(rgmui::EventQueue* queue,
         const std::string& videoPath,
         VideoConfig* videoCfg,
-        std::shared_ptr<OverlayComponent> overlay)
+        std::shared_ptr<OverlayComponent> overlay,
+        const nes::Palette& palette)
     : m_EventQueue(queue)
     , m_Config(videoCfg)
     , m_Overlay(overlay)
@@ -1760,11 +1942,21 @@ VideoComponent::VideoComponent(rgmui::EventQueue* queue,
     , m_InputTarget(0)
     , m_VideoPath(videoPath)
     , m_PlatformFPS(static_cast<float>(nes::NTSC_FPS))
+    , m_PlaybackSpeed(0.0f)
+    , m_ScrubSpeed(0.0f)
+    , m_LastScrubTime(util::Now())
+    , m_ImageGeneration(0)
 {
     m_EventQueue->SubscribeI(EventType::INPUT_TARGET_SET_TO, [&](int v){
         m_InputTarget = v;
         FindTargetFrame(v);
     });
+    m_EventQueue->Subscribe(EventType::PLAYBACK_SPEED_SET_TO, [&](const rgmui::Event& e){
+        m_PlaybackSpeed = *reinterpret_cast<float*>(e.Data.get());
+        if (m_ScrubSpeed == 0.0f) {
+            m_VideoThread->SetPlaybackSpeed(m_PlaybackSpeed);
+        }
+    });
     m_EventQueue->SubscribeI(EventType::SET_OFFSET_TO, [&](int v){
         SetOffset(v);
     });
@@ -1781,9 +1973,33 @@ VideoComponent::VideoComponent(rgmui::EventQueue* queue,
         }
     }
 
+    // Crop and scale to the nes resolution on the decoding thread, so that
+    // the buffer holds small frames and the ui thread doesn't have to
+    video::VideoCrop crop{util::Rect2F(0, 0, 0, 0), 0, 0};
+    int width = 0;
+    int height = 0;
+    if (!video::ProbeVideoFile(videoPath, &width, &height) ||
+            width != nes::FRAME_WIDTH || height != nes::FRAME_HEIGHT) {
+        crop.CropRect = m_Config->CropRect;
+        crop.OutWidth = nes::FRAME_WIDTH;
+        crop.OutHeight = nes::FRAME_HEIGHT;
+    }
+    // A source per prefetching thread, and one for filling the frame cache,
+    // all sharing one index
+    video::IVideoIndexerPtr indexer = video::OpenVideoIndexer(videoPath);
+    video::StaticVideoThreadConfig cfg = m_Config->StaticVideoThreadCfg;
+    std::shared_ptr<video::PaletteQuantizer> quantizer;
+    if (cfg.FrameCachePalette) {
+        quantizer = std::make_shared<video::PaletteQuantizer>(palette.data());
+    }
     m_VideoThread = std::make_unique<video::StaticVideoThread>(
-                std::make_unique<video::CVVideoCaptureSource>(videoPath),
-                m_Config->StaticVideoThreadCfg);
+                [videoPath, cfg, crop, indexer](){
+                    return video::OpenVideoFile(videoPath, cfg, crop, indexer);
+                },
+                cfg,
+                rgmui::RequestRedraw,
+                video::FrameCachePath(videoPath, crop, cfg.FrameCacheJpegQuality, quantizer.get()),
+                quantizer);
 
     m_WaitingFrame = std::make_shared<video::LiveInputFrame>(nes::FRAME_WIDTH, nes::FRAME_HEIGHT);
     cv::Mat m(m_WaitingFrame->Height,
@@ -1919,9 +2135,11 @@ void VideoComponent::SetImageFromInputFrame(bool triggerNewFrame) {
         if (triggerNewFrame) {
             m_Overlay->SetNewVideoFrame(m_Image);
         }
-        cv::resize(m_Image, m_Image, {}, m_Config->ScreenMultiplier, m_Config->ScreenMultiplier,
-                cv::INTER_NEAREST);
-        m_Overlay->ApplyVideoOverlay(m_Image, m_Config->ScreenMultiplier);
+        // m_Image may still be the frame's own buffer, so not in place
+        cv::Mat overlaid;
+        m_Overlay->ApplyVideoOverlay(m_Image, &overlaid);
+        m_Image = overlaid;
+        m_ImageGeneration++;
     } else {
         SetBlankImage();
     }
@@ -1938,9 +2156,8 @@ void VideoComponent::SetVideoFrame(int videoIndex) {
 }
 
 void VideoComponent::SetBlankImage() {
-    m_Image = cv::Mat::zeros(
-            nes::FRAME_HEIGHT * m_Config->ScreenMultiplier,
-            nes::FRAME_WIDTH * m_Config->ScreenMultiplier, CV_8UC3);
+    m_Image = cv::Mat::zeros(nes::FRAME_HEIGHT, nes::FRAME_WIDTH, CV_8UC3);
+    m_ImageGeneration++;
 }
 
 void VideoComponent::SetOffset(int offset) {
@@ -1985,8 +2202,30 @@ void VideoComponent::HandleHotkeys() {
     }
 }
 
+static constexpr int64_t SCRUB_HOLD_MILLIS = 250;
+
+void VideoComponent::UpdateScrubSpeed(int dx) {
+    double dt = std::max(util::ElapsedMillisFrom(m_LastScrubTime), static_cast<int64_t>(1)) / 1000.0;
+    m_LastScrubTime = util::Now();
+
+    double fps = nes::NTSC_FPS;
+    if (m_PTS.size() > 1 && m_PTS.back() > m_PTS.front()) {
+        fps = (m_PTS.size() - 1) * 1000.0 / static_cast<double>(m_PTS.back() - m_PTS.front());
+    }
+    m_ScrubSpeed = static_cast<float>(dx / dt / fps);
+    m_VideoThread->SetPlaybackSpeed(m_ScrubSpeed);
+}
+
+void VideoComponent::EndScrub() {
+    if (m_ScrubSpeed != 0.0f && util::ElapsedMillisFrom(m_LastScrubTime) > SCRUB_HOLD_MILLIS) {
+        m_ScrubSpeed = 0.0f;
+        m_VideoThread->SetPlaybackSpeed(m_PlaybackSpeed);
+    }
+}
+
 void VideoComponent::OnFrame() {
     HandleHotkeys();
+    EndScrub();
 
     if (m_CurrentVideoIndex == -1) {
         FindTargetFrame(0);
@@ -1998,7 +2237,8 @@ void VideoComponent::OnFrame() {
         SetImageFromInputFrame(false);
     }
     if (ImGui::Begin(WindowName().c_str())) {
-        rgmui::Mat("screen", m_Image);
+        rgmui::Mat("screen", m_Image, m_ImageGeneration,
+                static_cast<float>(m_Config->ScreenMultiplier));
         if (ImGui::IsItemHovered()) {
             auto& io = ImGui::GetIO();
             int m = static_cast<int>(-io.MouseWheel);
@@ -2013,6 +2253,7 @@ void VideoComponent::OnFrame() {
                 }
 
                 if (v != m_CurrentVideoIndex) {
+                    UpdateScrubSpeed(v - static_cast<int>(m_CurrentVideoIndex));
                     SetVideoFrame(v);
                     int frameIndex = PTSToFrameIndex(m_PTS[v]);
                     m_EventQueue->PublishI(EventType::SET_INPUT_TARGET_TO, frameIndex);
@@ -2056,6 +2297,7 @@ void VideoComponent::OnFrame() {
 PlaybackComponent::PlaybackComponent(rgmui::EventQueue* queue)
     : m_EventQueue(queue)
     , m_PlaybackSpeed(1.0f)
+    , m_PublishedSpeed(0.0f)
     , m_IsPlaying(false)
     , m_LastTime(util::Now())
     , m_SuspendFrameAdvance(false)
@@ -2100,6 +2342,7 @@ void PlaybackComponent::TogglePlaying() {
 void PlaybackComponent::HandlePlaying() {
     util::mclock::time_point v = util::Now();
     if (m_IsPlaying && (m_PlaybackSpeed != 0.0f)) {
+        rgmui::RequestRedraw(); // keep the frames coming while playing
         m_Accumulator += (v - m_LastTime);
 
         float speed = std::pow(std::abs(m_PlaybackSpeed), 1.8);
@@ -2128,9 +2371,25 @@ void PlaybackComponent::HandlePlaying() {
     m_LastTime = v;
 }
 
+// So that the video buffer can decode ahead of (or behind) where playback is going
+void PlaybackComponent::PublishPlaybackSpeed() {
+    float speed = 0.0f;
+    if (m_IsPlaying) {
+        speed = std::pow(std::abs(m_PlaybackSpeed), 1.8f);
+        if (m_PlaybackSpeed < 0) {
+            speed *= -1;
+        }
+    }
+    if (speed != m_PublishedSpeed) {
+        m_PublishedSpeed = speed;
+        m_EventQueue->Publish(EventType::PLAYBACK_SPEED_SET_TO, std::make_shared<float>(speed));
+    }
+}
+
 void PlaybackComponent::OnFrame() {
     HandleHotkeys();
     HandlePlaying();
+    PublishPlaybackSpeed();
 
     if (ImGui::Begin(WindowName().c_str())) {
         rgmui::SliderFloatExt("Speed", &m_PlaybackSpeed, -7.0f, 7.0f);
@@ -2269,6 +2528,12 @@ OverlayComponent::OverlayComponent(rgms::rgmui::EventQueue* queue, OverlayConfig
     , m_Config(config)
     , m_NewVideoOverlay(false)
     , m_NewEmuOverlay(false)
+    , m_EmuFrameStale(false)
+    , m_HasEmuFrame(false)
+    , m_MatchStale(false)
+    , m_HasMatch(false)
+    , m_Match(0.0f)
+    , m_ConfidentMatch(0.0f)
 {
 }
 
@@ -2305,6 +2570,17 @@ void OverlayComponent::OnFrame() {
         if (rgmui::SliderFloatExt("edge max threshold", &m_Config->EdgeMaxThreshold, 0.0f, 300.0f)) {
             m_EventQueue->Publish(EventType::REFRESH_CONFIG);
         }
+
+        ImGui::Separator();
+        if (m_MatchStale) {
+            UpdateMatch();
+        }
+        if (m_HasMatch) {
+            ImGui::Text("video matches emu: %5.1f%% (%5.1f%% of clear pixels)",
+                    m_Match * 100.0f, m_ConfidentMatch * 100.0f);
+        } else {
+            ImGui::TextUnformatted("video matches emu: -");
+        }
     }
     ImGui::End();
 }
@@ -2315,63 +2591,187 @@ bool OverlayComponent::NewVideoOverlay() const {
 bool OverlayComponent::NewEmuOverlay() const {
     return m_NewEmuOverlay;
 }
+bool OverlayComponent::EmuOverlayActive() const {
+    return !m_VideoLayers.Frame.empty() &&
+        (m_Config->VideoOnEmu > 0.0f || m_Config->VideoEdgesOnEmu > 0.0f);
+}
 
-void OverlayComponent::SetNewEmuFrame(cv::Mat img) {
-    m_EmuFrame = img.clone();
+void OverlayComponent::SetNewEmuFrame(const nes::Frame& frame, const nes::Palette& palette) {
+    m_EmuFrame = frame;
+    m_EmuPalette = palette;
+    m_EmuFrameStale = true;
+    m_HasEmuFrame = true;
+    m_MatchStale = true;
     m_NewVideoOverlay = true;
 }
 
 void OverlayComponent::SetNewVideoFrame(cv::Mat img) {
-    m_VideoFrame = img.clone();
+    SetLayersFrame(&m_VideoLayers, img);
+    m_MatchStale = true;
     m_NewEmuOverlay = true;
 }
 
-void OverlayComponent::ApplyEmuOverlay(cv::Mat img, int screenMultiplier) {
-    DoOverlay(m_VideoFrame, m_Config->VideoOnEmu, m_Config->VideoEdgesOnEmu, img, screenMultiplier);
+void OverlayComponent::ApplyEmuOverlay(const cv::Mat& img, cv::Mat* out) {
+    DoOverlay(&m_VideoLayers, m_Config->VideoOnEmu, m_Config->VideoEdgesOnEmu, img, out);
     m_NewEmuOverlay = false;
 }
 
-void OverlayComponent::ApplyVideoOverlay(cv::Mat img, int screenMultiplier) {
-    DoOverlay(m_EmuFrame, m_Config->EmuOnVideo, m_Config->EmuEdgesOnVideo, img, screenMultiplier);
+void OverlayComponent::ApplyVideoOverlay(const cv::Mat& img, cv::Mat* out) {
+    if (m_EmuFrameStale && (m_Config->EmuOnVideo > 0.0f || m_Config->EmuEdgesOnVideo > 0.0f)) {
+        ExpandEmuFrame();
+    }
+    DoOverlay(&m_EmuLayers, m_Config->EmuOnVideo, m_Config->EmuEdgesOnVideo, img, out);
     m_NewVideoOverlay = false;
 }
 
-void OverlayComponent::DoOverlay(cv::Mat from, float fromOn, float edgeOn, cv::Mat img, int screenMultiplier) {
-    cv::Scalar edgeColor;
-    edgeColor[0] = static_cast<uint8_t>((m_Config->EdgeColor & 0x00ff0000) >> 16);
-    edgeColor[1] = static_cast<uint8_t>((m_Config->EdgeColor & 0x0000ff00) >>  8);
-    edgeColor[2] = static_cast<uint8_t>((m_Config->EdgeColor & 0x000000ff) >>  0);
+void OverlayComponent::SetLayersFrame(OverlayLayers* layers, const cv::Mat& img) {
+    img.copyTo(layers->Frame);
+    layers->EdgesValid = false;
+}
 
-    if (from.rows != 0) {
-        if (fromOn > 0.0f) {
-            cv::Mat m;
-            cv::resize(from, m, {}, screenMultiplier, screenMultiplier, cv::INTER_NEAREST);
-            cv::addWeighted(img, 1.0 - fromOn, m, fromOn, 0.0, img);
-        }
+void OverlayComponent::ExpandEmuFrame() {
+    cv::Mat& m = m_EmuLayers.Frame;
+    m.create(nes::FRAME_HEIGHT, nes::FRAME_WIDTH, CV_8UC3);
+    nes::ExpandPalette(m_EmuFrame.data(), nes::FRAME_WIDTH, nes::FRAME_HEIGHT,
+            m_EmuPalette, 1, 3, m.data, m.step[0]);
+    m_EmuLayers.EdgesValid = false;
+    m_EmuFrameStale = false;
+}
+
+// The video is put through the emu's palette and the two compared byte for
+// byte, the confidence only decides which pixels are clear enough to count
+// towards the second figure
+void OverlayComponent::UpdateMatch() {
+    m_MatchStale = false;
+    const cv::Mat& video = m_VideoLayers.Frame;
+    m_HasMatch = m_HasEmuFrame && video.type() == CV_8UC3 &&
+        video.cols == nes::FRAME_WIDTH && video.rows == nes::FRAME_HEIGHT &&
+        video.isContinuous();
+    if (!m_HasMatch) {
+        return;
+    }
+    if (!m_Quantizer || std::memcmp(m_Quantizer->Palette(), m_EmuPalette.data(), m_EmuPalette.size()) != 0) {
+        m_Quantizer = std::make_unique<video::PaletteQuantizer>(m_EmuPalette.data());
+    }
 
-        if (edgeOn > 0.0f) {
-            cv::Mat edges;
-            cv::Canny(from, edges, m_Config->EdgeMinThreshold, m_Config->EdgeMaxThreshold);
-            std::vector<std::vector<cv::Point>> contours;
-            std::vector<cv::Vec4i> hierarchy;
+    std::vector<uint8_t> videoIndices(nes::FRAME_SIZE);
+    std::vector<uint8_t> confidence(nes::FRAME_SIZE);
+    std::vector<uint8_t> emuIndices(nes::FRAME_SIZE);
+    m_Quantizer->QuantizeBGR(video.data, nes::FRAME_SIZE, videoIndices.data(), confidence.data());
+    m_Quantizer->CanonicalIndices(m_EmuFrame.data(), nes::FRAME_SIZE, emuIndices.data());
+
+    int matches = 0;
+    int confident = 0;
+    int confidentMatches = 0;
+    for (int i = 0; i < nes::FRAME_SIZE; i++) {
+        bool match = videoIndices[i] == emuIndices[i];
+        matches += match;
+        if (confidence[i] >= 2) {
+            confident++;
+            confidentMatches += match;
+        }
+    }
+    m_Match = static_cast<float>(matches) / static_cast<float>(nes::FRAME_SIZE);
+    m_ConfidentMatch = confident ? static_cast<float>(confidentMatches) / static_cast<float>(confident) : 0.0f;
+}
 
+void OverlayComponent::UpdateEdges(OverlayLayers* layers) {
+    if (layers->EdgesValid &&
+            layers->EdgeMinThreshold == m_Config->EdgeMinThreshold &&
+            layers->EdgeMaxThreshold == m_Config->EdgeMaxThreshold &&
+            layers->EdgeColorValue == m_Config->EdgeColor) {
+        return;
+    }
 
-            cv::findContours(edges, contours, hierarchy,
-                    cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+    cv::Mat edges;
+    cv::Canny(layers->Frame, edges, m_Config->EdgeMinThreshold, m_Config->EdgeMaxThreshold);
+    cv::cvtColor(edges, layers->EdgeMask, cv::COLOR_GRAY2BGR);
 
-            for (auto & cnt : contours) {
-                for (auto & pt : cnt) {
-                    pt.x *= screenMultiplier;
-                    pt.y *= screenMultiplier;
-                }
-            }
+    cv::Scalar edgeColor;
+    edgeColor[0] = static_cast<uint8_t>((m_Config->EdgeColor & 0x00ff0000) >> 16);
+    edgeColor[1] = static_cast<uint8_t>((m_Config->EdgeColor & 0x0000ff00) >>  8);
+    edgeColor[2] = static_cast<uint8_t>((m_Config->EdgeColor & 0x000000ff) >>  0);
+    layers->EdgeColor.create(layers->Frame.size(), CV_8UC3);
+    layers->EdgeColor.setTo(edgeColor);
+    cv::bitwise_and(layers->EdgeColor, layers->EdgeMask, layers->EdgeColor);
+
+    layers->EdgesValid = true;
+    layers->EdgeMinThreshold = m_Config->EdgeMinThreshold;
+    layers->EdgeMaxThreshold = m_Config->EdgeMaxThreshold;
+    layers->EdgeColorValue = m_Config->EdgeColor;
+}
+
+// out = lerp(img, from, fromWeight) and then lerp(out, edgeColor, edgeWeight)
+// where edgeMask is set, weights out of 256. Per byte, so any channel count.
+static void BlendOverlay(const uint8_t* img, const uint8_t* from, int fromWeight,
+        const uint8_t* edgeColor, const uint8_t* edgeMask, int edgeWeight,
+        uint8_t* out, size_t n) {
+    size_t i = 0;
+#ifdef RGMS_GRAPHITE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i fw = _mm_set1_epi16(static_cast<short>(fromWeight));
+    const __m128i iw = _mm_set1_epi16(static_cast<short>(256 - fromWeight));
+    const __m128i ew = _mm_set1_epi16(static_cast<short>(edgeWeight));
+    const __m128i full = _mm_set1_epi16(256);
+    auto lerp = [&](__m128i a, __m128i b, __m128i wa, __m128i wb) {
+        return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, wa), _mm_mullo_epi16(b, wb)), 8);
+    };
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(img + i));
+        __m128i lo = _mm_unpacklo_epi8(a, zero);
+        __m128i hi = _mm_unpackhi_epi8(a, zero);
+        if (from) {
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(from + i));
+            lo = lerp(lo, _mm_unpacklo_epi8(b, zero), iw, fw);
+            hi = lerp(hi, _mm_unpackhi_epi8(b, zero), iw, fw);
+        }
+        if (edgeColor) {
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(edgeColor + i));
+            __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(edgeMask + i));
+            // The mask is 0 or 0xff, as 16 bits that selects the weight
+            __m128i wlo = _mm_and_si128(_mm_unpacklo_epi8(m, m), ew);
+            __m128i whi = _mm_and_si128(_mm_unpackhi_epi8(m, m), ew);
+            lo = lerp(lo, _mm_unpacklo_epi8(c, zero), _mm_sub_epi16(full, wlo), wlo);
+            hi = lerp(hi, _mm_unpackhi_epi8(c, zero), _mm_sub_epi16(full, whi), whi);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        int v = img[i];
+        if (from) {
+            v = (v * (256 - fromWeight) + from[i] * fromWeight) >> 8;
+        }
+        if (edgeColor && edgeMask[i]) {
+            v = (v * (256 - edgeWeight) + edgeColor[i] * edgeWeight) >> 8;
+        }
+        out[i] = static_cast<uint8_t>(v);
+    }
+}
+
+void OverlayComponent::DoOverlay(OverlayLayers* from, float fromOn, float edgeOn,
+        const cv::Mat& img, cv::Mat* out) {
+    int fromWeight = static_cast<int>(std::lround(fromOn * 256.0f));
+    int edgeWeight = static_cast<int>(std::lround(edgeOn * 256.0f));
+    if (from->Frame.empty() || from->Frame.size() != img.size() ||
+            from->Frame.type() != img.type() || img.type() != CV_8UC3 ||
+            (fromWeight <= 0 && edgeWeight <= 0)) {
+        *out = img;
+        return;
+    }
+    if (edgeWeight > 0) {
+        UpdateEdges(from);
+    }
 
-            cv::Mat m = img.clone();
-            for (int i = 0; i < contours.size(); i++) {
-                cv::drawContours(m, contours, i, edgeColor, 1);
-            }
-            cv::addWeighted(img, 1.0 - edgeOn, m, edgeOn, 0.0, img);
-        }
+    if (out->data != img.data) {
+        out->create(img.size(), CV_8UC3);
+    }
+    for (int y = 0; y < img.rows; y++) {
+        BlendOverlay(img.ptr<uint8_t>(y),
+                fromWeight > 0 ? from->Frame.ptr<uint8_t>(y) : nullptr, fromWeight,
+                edgeWeight > 0 ? from->EdgeColor.ptr<uint8_t>(y) : nullptr,
+                edgeWeight > 0 ? from->EdgeMask.ptr<uint8_t>(y) : nullptr, edgeWeight,
+                out->ptr<uint8_t>(y), static_cast<size_t>(img.cols) * 3);
     }
 }
 
@@ -2382,9 +2782,15 @@ GraphiteCropApp::GraphiteCropApp(bool* wasExited, GraphiteConfig* config)
     , m_VideoFrame(0)
     , m_FrameMult(0.5)
 {
+    video::IVideoIndexerPtr indexer = video::OpenVideoIndexer(config->VideoPath);
     m_VideoThread = std::make_unique<video::StaticVideoThread>(
-                std::make_unique<video::CVVideoCaptureSource>(config->VideoPath),
-                config->VideoCfg.StaticVideoThreadCfg);
+                [config, indexer](){
+                    return video::OpenVideoFile(config->VideoPath,
+                            config->VideoCfg.StaticVideoThreadCfg,
+                            video::VideoCrop{util::Rect2F(0, 0, 0, 0), 0, 0}, indexer);
+                },
+                config->VideoCfg.StaticVideoThreadCfg,
+                rgmui::RequestRedraw);
 }
 
 GraphiteCropApp::~GraphiteCropApp()
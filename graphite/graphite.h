@@ -59,6 +59,7 @@ enum EventType : int {
     INPUT_TARGET_SET_TO,  // int
     SET_INPUT_TARGET_TO,  // int
     SCROLL_INPUT_TARGET,  // int (delta)
+    PLAYBACK_SPEED_SET_TO, // float (negative in reverse, 0 when paused)
 
     NES_FRAME_SET_TO, // int
     NES_STATE_SET_TO, // std::string
@@ -108,18 +109,39 @@ public:
     virtual void OnFrame() override;
     static std::string WindowName();
 
-    void SetNewEmuFrame(cv::Mat img);
+    // Only expanded to colors once ApplyVideoOverlay needs them
+    void SetNewEmuFrame(const rgms::nes::Frame& frame, const rgms::nes::Palette& palette);
     void SetNewVideoFrame(cv::Mat img);
 
-    void ApplyEmuOverlay(cv::Mat img, int screenMultiplier);
-    void ApplyVideoOverlay(cv::Mat img, int screenMultiplier);
+    // img is the native (256x240) frame, and out the same size. They can be
+    // the same Mat, out is just img when there is nothing to overlay. Scale
+    // afterwards
+    void ApplyEmuOverlay(const cv::Mat& img, cv::Mat* out);
+    void ApplyVideoOverlay(const cv::Mat& img, cv::Mat* out);
 
     bool NewVideoOverlay() const;
     bool NewEmuOverlay() const;
+    // Whether ApplyEmuOverlay would change anything at the moment
+    bool EmuOverlayActive() const;
 
 private:
-    void DoOverlay(cv::Mat from, float fromOn, float edgeOn,
-            cv::Mat img, int screenMultiplier);
+    // Everything about a source frame that doesn't depend on the sliders,
+    // computed once per frame (and edge setting) rather than per refresh
+    struct OverlayLayers {
+        cv::Mat Frame;
+        cv::Mat EdgeMask;   // CV_8UC3, 0xff in every channel of an edge pixel
+        cv::Mat EdgeColor;  // CV_8UC3, the edge color where EdgeMask is set
+        bool EdgesValid = false;
+        float EdgeMinThreshold = 0.0f;
+        float EdgeMaxThreshold = 0.0f;
+        ImU32 EdgeColorValue = 0;
+    };
+    void SetLayersFrame(OverlayLayers* layers, const cv::Mat& img);
+    void UpdateEdges(OverlayLayers* layers);
+    void ExpandEmuFrame();
+    void UpdateMatch();
+    void DoOverlay(OverlayLayers* from, float fromOn, float edgeOn,
+            const cv::Mat& img, cv::Mat* out);
 
 private:
     rgms::rgmui::EventQueue* m_EventQueue;
@@ -128,8 +150,21 @@ private:
     bool m_NewVideoOverlay;
     bool m_NewEmuOverlay;
 
-    cv::Mat m_EmuFrame;
-    cv::Mat m_VideoFrame;
+    OverlayLayers m_EmuLayers;
+    OverlayLayers m_VideoLayers;
+
+    rgms::nes::Frame m_EmuFrame;
+    rgms::nes::Palette m_EmuPalette;
+    bool m_EmuFrameStale; // m_EmuLayers.Frame is behind m_EmuFrame
+    bool m_HasEmuFrame;
+
+    // How much of the video frame quantizes to the emu frame, as shown in the
+    // window. Recomputed when either frame changes
+    std::unique_ptr<rgms::video::PaletteQuantizer> m_Quantizer; // of m_EmuPalette
+    bool m_MatchStale;
+    bool m_HasMatch;
+    float m_Match;
+    float m_ConfidentMatch;
 };
 
 struct EmuViewConfig;
@@ -255,28 +290,36 @@ public:
 
     // Undo / redoable action
     void ChangeInputTo(int frameIndex, rgms::nes::ControllerState newState);
+    // A single undo / redoable action over newStates.size() frames
+    void ChangeInputsTo(int frameIndex, const std::vector<rgms::nes::ControllerState>& newStates);
 
     void Undo();
     void Redo();
 
     void ConsolidateLast(int count);
 
+    // Every change (including undo / redo) is also recorded here, may be null
+    void SetJournal(rgms::nes::FM2Journal* journal);
+
 private:
-    void IntChangeInput(int frameIndex, rgms::nes::ControllerState newState);
+    void IntChangeInputs(int frameIndex, const std::vector<rgms::nes::ControllerState>& newStates);
 
 private:
     rgms::rgmui::EventQueue* m_EventQueue;
     std::vector<rgms::nes::ControllerState>* m_Inputs;
+    rgms::nes::FM2Journal* m_Journal;
 
     int m_ChangeIndex;
     std::vector<size_t> m_ChangeIndices;
     struct Change {
         int FrameIndex;
-        rgms::nes::ControllerState OldState;
-        rgms::nes::ControllerState NewState;
+        std::vector<rgms::nes::ControllerState> OldStates;
+        std::vector<rgms::nes::ControllerState> NewStates;
         bool Consolidated;
 
-        Change(int _frameIndex, rgms::nes::ControllerState _oldState, rgms::nes::ControllerState _newState);
+        Change(int _frameIndex,
+                std::vector<rgms::nes::ControllerState> _oldStates,
+                std::vector<rgms::nes::ControllerState> _newStates);
         Change();
     };
     std::vector<Change> m_Changes;
@@ -288,6 +331,7 @@ public:
     InputsComponent(
             rgms::rgmui::EventQueue* queue,
             const std::string& fm2Path,
+            const std::string& romChecksum,
             InputsConfig* config
             );
     ~InputsComponent();
@@ -378,17 +422,25 @@ private:
     void HandleHotkeys();
     std::pair<int, int> FindPreviousJump();
     void DoInputAction(InputAction actions);
+    // Runs transform on a copy of the inputs, then records [from, to) as one change
+    void TransformInputs(int from, int to,
+            std::function<void(std::vector<rgms::nes::ControllerState>* inputs)> transform);
+    void DoSearchMenu();
 
     void CheckLRUD(uint8_t button, uint8_t* input);
 
 private:
     std::string OffsetLine() const;
     void TryReadFM2();
+    void UpdateOffsetLine();
+    void SaveFM2();
     void WriteFM2();
 
     rgms::nes::FM2Header m_Header;
     std::string m_FM2Path;
+    std::string m_RomChecksum;
     int m_OffsetMillis;
+    std::unique_ptr<rgms::nes::FM2Journal> m_Journal;
 
 
 private:
@@ -411,6 +463,10 @@ private:
     int m_TargetIndex;
     int m_CurrentIndex;
     int m_MarkerIndex;
+
+    int m_SearchButtons;
+    int m_SearchMinHeld;
+    int m_ShiftFrames;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -466,7 +522,13 @@ private:
     std::shared_ptr<OverlayComponent> m_Overlay;
 
     rgms::nes::Frame m_Frame;
-    cv::Mat m_Image;
+    bool m_Blank;
+    uint64_t m_FrameGeneration;
+
+    // Only built when the screen can't be drawn straight from m_Frame
+    cv::Mat m_Image; // native size, scaled when drawn
+    uint64_t m_ImageGeneration;
+    bool m_ImageStale;
 };
 
 struct RAMWatchLine {
@@ -566,7 +628,8 @@ public:
     VideoComponent(rgms::rgmui::EventQueue* queue,
             const std::string& videoPath,
             VideoConfig* videoCfg,
-            std::shared_ptr<OverlayComponent> overlay);
+            std::shared_ptr<OverlayComponent> overlay,
+            const rgms::nes::Palette& palette); // for FrameCachePalette
     ~VideoComponent();
 
     virtual void OnFrame() override;
@@ -587,6 +650,10 @@ private:
     void SetImageFromInputFrame(bool triggerNewFrame = true);
 
     void HandleHotkeys();
+    // Scrubbing with the mouse wheel is a playback speed hint for the buffer
+    // until it stops, then it goes back to the playback component's speed
+    void UpdateScrubSpeed(int dx);
+    void EndScrub();
 
 
 private:
@@ -600,10 +667,15 @@ private:
     int64_t m_CurrentVideoIndex;
     int m_InputTarget;
 
+    float m_PlaybackSpeed;
+    float m_ScrubSpeed;
+    rgms::util::mclock::time_point m_LastScrubTime;
+
     std::vector<int64_t> m_PTS;
     rgms::video::LiveInputFramePtr m_LiveInputFrame;
     rgms::video::LiveInputFramePtr m_WaitingFrame;
-    cv::Mat m_Image;
+    cv::Mat m_Image; // native size, scaled when drawn
+    uint64_t m_ImageGeneration;
 };
 
 class PlaybackComponent : public rgms::rgmui::IApplicationComponent {
@@ -619,10 +691,12 @@ private:
     void HandleHotkeys();
     void HandlePlaying();
     void TogglePlaying();
+    void PublishPlaybackSpeed();
 
 private:
     rgms::rgmui::EventQueue* m_EventQueue;
     float m_PlaybackSpeed;
+    float m_PublishedSpeed;
     bool m_IsPlaying;
     bool m_SuspendFrameAdvance;
     rgms::util::mclock::time_point m_LastTime;
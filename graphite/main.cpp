@@ -24,6 +24,7 @@
 #include "rgmui/rgmuimain.h"
 #include "graphite/graphite.h"
 #include "rgmnes/nestopiaimpl.h"
+#include "rgmvideo/videofile.h"
 
 using namespace graphite;
 using namespace rgms;
@@ -76,7 +77,8 @@ static void do_graphite(int argc, char** argv) {
     bool wasExited = false;
     if (useConfigApp) {
         GraphiteConfigApp cfgApp(&wasExited, window.GetSDLWindow(), &config);
-        rgmui::WindowAppMainLoop(&window, &cfgApp, std::chrono::microseconds(10000));
+        rgmui::WindowAppMainLoop(&window, &cfgApp, std::chrono::microseconds(10000),
+            std::chrono::milliseconds(250));
     }
     if (wasExited) {
         return;
@@ -89,15 +91,18 @@ static void do_graphite(int argc, char** argv) {
 
     bool useCropApp = false;
     {
-        video::CVVideoCaptureSource video(config.VideoPath);
-        if (video.Width() != nes::FRAME_WIDTH || video.Height() != nes::FRAME_HEIGHT) {
+        int width = 0;
+        int height = 0;
+        video::ProbeVideoFile(config.VideoPath, &width, &height);
+        if (width != nes::FRAME_WIDTH || height != nes::FRAME_HEIGHT) {
             spdlog::warn("Video has incorrect size. Launching resize");
             useCropApp = true;
         }
     }
     if (useCropApp) {
         GraphiteCropApp cropApp(&wasExited, &config);
-        rgmui::WindowAppMainLoop(&window, &cropApp, std::chrono::microseconds(10000));
+        rgmui::WindowAppMainLoop(&window, &cropApp, std::chrono::microseconds(10000),
+            std::chrono::milliseconds(250));
     }
     if (wasExited) {
         return;
@@ -105,7 +110,8 @@ static void do_graphite(int argc, char** argv) {
 
     GraphiteApp app(&config);
     spdlog::info("main loop initiated");
-    rgmui::WindowAppMainLoop(&window, &app, std::chrono::microseconds(16333));
+    rgmui::WindowAppMainLoop(&window, &app, std::chrono::microseconds(16333),
+            std::chrono::milliseconds(250));
 
     if (config.SaveConfig) {
         config.ImguiIniSettings = std::string(ImGui::SaveIniSettingsToMemory());
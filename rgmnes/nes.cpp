@@ -24,8 +24,36 @@
 #include <fstream>
 #include <cassert>
 #include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RGMS_NES_SSE2
+#include <emmintrin.h>
+#endif
+// The SSSE3/AVX2 kernels are always built on x86 and picked at runtime, so
+// they are compiled per function for their instruction set rather than
+// relying on the flags of the whole build. msvc has every intrinsic anyway
+#if defined(__x86_64__) || defined(__i386__)
+#define RGMS_NES_X86
+#define RGMS_NES_TARGET(x) __attribute__((target(x)))
+#include <immintrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#define RGMS_NES_X86
+#define RGMS_NES_TARGET(x)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "rgmnes/nes.h"
+#include "rgmutil/util.h"
 
 using namespace rgms::nes;
 
@@ -69,6 +97,261 @@ const Palette& rgms::nes::DefaultPalette() {
     return p;
 }
 
+namespace {
+
+enum class ExpandKernel {
+    SCALAR,
+    SSSE3,
+    AVX2,
+};
+
+ExpandKernel DetectExpandKernel() {
+#if defined(RGMS_NES_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool ssse3 = (info[2] & (1 << 9)) != 0;
+    // avx also needs the os to save the ymm registers
+    bool avx = (info[2] & (1 << 28)) != 0 && (info[2] & (1 << 27)) != 0 &&
+        (_xgetbv(0) & 0x6) == 0x6;
+    bool avx2 = false;
+    if (avx && maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+    if (avx2) {
+        return ExpandKernel::AVX2;
+    }
+    if (ssse3) {
+        return ExpandKernel::SSSE3;
+    }
+#elif defined(RGMS_NES_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return ExpandKernel::AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return ExpandKernel::SSSE3;
+    }
+#endif
+    return ExpandKernel::SCALAR;
+}
+
+// Everything that doesn't depend on the pixels, built once per call
+struct PaletteExpander {
+    ExpandKernel Kernel;
+    int Scale;
+    int Channels;
+    uint8_t Colors[PALETTE_ENTRIES][4]; // b, g, r, 0xff
+#ifdef RGMS_NES_X86
+    // Each channel of the palette as four sixteen entry pshufb tables
+    __m128i Banks[3][4];
+    // Output is built sixteen bytes at a time from the b, g and r planes of
+    // sixteen pixels, Scale * Channels chunks in all
+    __m128i Shuffles[MAX_EXPAND_SCALE * 4][3];
+    __m128i Alpha[MAX_EXPAND_SCALE * 4];
+#endif
+
+    PaletteExpander(const Palette& palette, int scale, int channels, ExpandKernel kernel)
+        : Kernel(kernel)
+        , Scale(scale)
+        , Channels(channels)
+    {
+        for (int i = 0; i < PALETTE_ENTRIES; i++) {
+            Colors[i][0] = palette[i * 3 + 2];
+            Colors[i][1] = palette[i * 3 + 1];
+            Colors[i][2] = palette[i * 3 + 0];
+            Colors[i][3] = 0xff;
+        }
+#ifdef RGMS_NES_X86
+        if (Kernel != ExpandKernel::SCALAR) {
+            InitTables();
+        }
+#endif
+    }
+
+#ifdef RGMS_NES_X86
+    RGMS_NES_TARGET("ssse3")
+    void InitTables() {
+        alignas(16) uint8_t b[16];
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < 4; k++) {
+                for (int j = 0; j < 16; j++) {
+                    b[j] = Colors[k * 16 + j][c];
+                }
+                Banks[c][k] = _mm_load_si128(reinterpret_cast<const __m128i*>(b));
+            }
+        }
+        for (int q = 0; q < Scale * Channels; q++) {
+            for (int c = 0; c < 4; c++) {
+                for (int j = 0; j < 16; j++) {
+                    int o = q * 16 + j;
+                    bool here = (o % Channels) == c;
+                    if (c == 3) {
+                        b[j] = here ? 0xff : 0x00;
+                    } else {
+                        b[j] = here ? static_cast<uint8_t>(o / Channels / Scale) : 0x80;
+                    }
+                }
+                __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(b));
+                if (c == 3) {
+                    Alpha[q] = v;
+                } else {
+                    Shuffles[q][c] = v;
+                }
+            }
+        }
+    }
+
+    // pshufb only looks at the low nibble and gives zero when the high bit is
+    // set, so bank k wants index - 16k in the low nibble when that is in
+    // [0, 16) and the high bit set otherwise, which a saturating add does
+    RGMS_NES_TARGET("ssse3")
+    void Lookup16(const uint8_t* in, __m128i (&planes)[3]) const {
+        const __m128i sixteen = _mm_set1_epi8(16);
+        const __m128i bias = _mm_set1_epi8(0x70);
+        __m128i v = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)),
+                _mm_set1_epi8(0x3f));
+        __m128i x = _mm_adds_epu8(v, bias);
+        for (int c = 0; c < 3; c++) {
+            planes[c] = _mm_shuffle_epi8(Banks[c][0], x);
+        }
+        for (int k = 1; k < 4; k++) {
+            v = _mm_sub_epi8(v, sixteen);
+            x = _mm_adds_epu8(v, bias);
+            for (int c = 0; c < 3; c++) {
+                planes[c] = _mm_or_si128(planes[c], _mm_shuffle_epi8(Banks[c][k], x));
+            }
+        }
+    }
+
+    // Writes the Scale * Channels * 16 bytes for sixteen pixels
+    RGMS_NES_TARGET("ssse3")
+    void Interleave16(const __m128i (&planes)[3], uint8_t* out) const {
+        int chunks = Scale * Channels;
+        for (int q = 0; q < chunks; q++) {
+            __m128i o = _mm_or_si128(
+                    _mm_or_si128(
+                        _mm_shuffle_epi8(planes[0], Shuffles[q][0]),
+                        _mm_shuffle_epi8(planes[1], Shuffles[q][1])),
+                    _mm_shuffle_epi8(planes[2], Shuffles[q][2]));
+            if (Channels == 4) {
+                o = _mm_or_si128(o, Alpha[q]);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + q * 16), o);
+        }
+    }
+
+    // Returns how many pixels were done, the rest are left to RowScalar
+    RGMS_NES_TARGET("ssse3")
+    int RowSSSE3(const uint8_t* in, int width, uint8_t* out) const {
+        size_t pixelBytes = static_cast<size_t>(Scale * Channels);
+        int i = 0;
+        for (; i + 16 <= width; i += 16) {
+            __m128i planes[3];
+            Lookup16(in + i, planes);
+            Interleave16(planes, out + i * pixelBytes);
+        }
+        return i;
+    }
+
+    // The lookups are lane local so they widen to 32 pixels as is, the
+    // interleave is left to the 128 bit path as 3 byte pixels straddle lanes
+    RGMS_NES_TARGET("avx2")
+    int RowAVX2(const uint8_t* in, int width, uint8_t* out) const {
+        size_t pixelBytes = static_cast<size_t>(Scale * Channels);
+        int i = 0;
+        if (width >= 32) {
+            __m256i banks[3][4];
+            for (int c = 0; c < 3; c++) {
+                for (int k = 0; k < 4; k++) {
+                    banks[c][k] = _mm256_broadcastsi128_si256(Banks[c][k]);
+                }
+            }
+            const __m256i sixteen = _mm256_set1_epi8(16);
+            const __m256i bias = _mm256_set1_epi8(0x70);
+            for (; i + 32 <= width; i += 32) {
+                __m256i v = _mm256_and_si256(
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)),
+                        _mm256_set1_epi8(0x3f));
+                __m256i x = _mm256_adds_epu8(v, bias);
+                __m256i planes[3];
+                for (int c = 0; c < 3; c++) {
+                    planes[c] = _mm256_shuffle_epi8(banks[c][0], x);
+                }
+                for (int k = 1; k < 4; k++) {
+                    v = _mm256_sub_epi8(v, sixteen);
+                    x = _mm256_adds_epu8(v, bias);
+                    for (int c = 0; c < 3; c++) {
+                        planes[c] = _mm256_or_si256(planes[c], _mm256_shuffle_epi8(banks[c][k], x));
+                    }
+                }
+                __m128i lo[3], hi[3];
+                for (int c = 0; c < 3; c++) {
+                    lo[c] = _mm256_castsi256_si128(planes[c]);
+                    hi[c] = _mm256_extracti128_si256(planes[c], 1);
+                }
+                Interleave16(lo, out + i * pixelBytes);
+                Interleave16(hi, out + (i + 16) * pixelBytes);
+            }
+        }
+        return i + RowSSSE3(in + i, width - i, out + i * pixelBytes);
+    }
+#endif
+
+    template <int CHANNELS>
+    void RowScalar(const uint8_t* in, int n, uint8_t* out) const {
+        for (int i = 0; i < n; i++) {
+            const uint8_t* c = Colors[in[i] & 0x3f];
+            for (int s = 0; s < Scale; s++) {
+                std::memcpy(out, c, CHANNELS);
+                out += CHANNELS;
+            }
+        }
+    }
+
+    void Row(const uint8_t* in, int width, uint8_t* out) const {
+        int i = 0;
+        size_t pixelBytes = static_cast<size_t>(Scale * Channels);
+#ifdef RGMS_NES_X86
+        if (Kernel == ExpandKernel::AVX2) {
+            i = RowAVX2(in, width, out);
+        } else if (Kernel == ExpandKernel::SSSE3) {
+            i = RowSSSE3(in, width, out);
+        }
+#endif
+        if (Channels == 4) {
+            RowScalar<4>(in + i, width - i, out + i * pixelBytes);
+        } else {
+            RowScalar<3>(in + i, width - i, out + i * pixelBytes);
+        }
+    }
+};
+
+}
+
+void rgms::nes::ExpandPalette(const uint8_t* indices, int width, int height,
+        const Palette& palette, int scale, int channels,
+        uint8_t* out, size_t outStep) {
+    if (scale < 1 || scale > MAX_EXPAND_SCALE) {
+        throw std::invalid_argument("invalid expand scale");
+    }
+    if (channels != 3 && channels != 4) {
+        throw std::invalid_argument("invalid expand channels");
+    }
+
+    static const ExpandKernel kernel = DetectExpandKernel();
+    PaletteExpander expander(palette, scale, channels, kernel);
+    size_t rowBytes = static_cast<size_t>(width) * scale * channels;
+    for (int y = 0; y < height; y++) {
+        uint8_t* row = out + static_cast<size_t>(y) * scale * outStep;
+        expander.Row(indices + static_cast<size_t>(y) * width, width, row);
+        for (int s = 1; s < scale; s++) {
+            std::memcpy(row + s * outStep, row, rowBytes);
+        }
+    }
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -371,9 +654,11 @@ StateSequenceThreadConfig StateSequenceThreadConfig::Defaults() {
 
 StateSequenceThread::StateSequenceThread(StateSequenceThreadConfig cfg,
             std::unique_ptr<INESEmulator>&& emu,
-            const std::vector<ControllerState>& initialStates)
+            const std::vector<ControllerState>& initialStates,
+            std::function<void()> onNewState)
     : m_Config(cfg)
     , m_StateSequence(std::move(emu), m_Config.StateSequenceCfg, initialStates)
+    , m_OnNewState(onNewState)
     , m_TargetIndex(0)
     , m_LatestIndex(0)
     , m_OnNewStateIndex(-1)
@@ -459,6 +744,9 @@ void StateSequenceThread::SequenceThread() {
                     m_LatestIndex = m_StateSequence.GetCurrentIndex();
                     m_LatestState = m_StateSequence.GetCurrentStateString();
                 }
+                if (m_OnNewState) {
+                    m_OnNewState();
+                }
             }
         }
 
@@ -480,6 +768,9 @@ void StateSequenceThread::SequenceThread() {
                 m_LatestIndex = m_StateSequence.GetCurrentIndex();
                 m_LatestState = m_StateSequence.GetCurrentStateString();
             }
+            if (m_OnNewState) {
+                m_OnNewState();
+            }
             std::this_thread::sleep_for(std::chrono::milliseconds(m_Config.OnWorkDelayMillis));
         } else {
             std::this_thread::sleep_for(std::chrono::milliseconds(m_Config.NoWorkDelayMillis));
@@ -489,6 +780,188 @@ void StateSequenceThread::SequenceThread() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Bit i is set when p[i] matches, for sixteen frames
+static inline uint32_t MatchMask16(const uint8_t* p, uint8_t mask, uint8_t pattern) {
+#ifdef RGMS_NES_SSE2
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    v = _mm_and_si128(v, _mm_set1_epi8(static_cast<char>(mask)));
+    v = _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(pattern)));
+    return static_cast<uint32_t>(_mm_movemask_epi8(v));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < 16; i++) {
+        if ((p[i] & mask) == pattern) {
+            m |= (1u << i);
+        }
+    }
+    return m;
+#endif
+}
+
+static int FindNextMatch(const std::vector<ControllerState>& inputs, int from,
+        uint8_t mask, uint8_t pattern, bool invert) {
+    int n = static_cast<int>(inputs.size());
+    uint32_t flip = invert ? 0xffff : 0x0000;
+    int i = std::max(from, 0);
+    for (; i + 16 <= n; i += 16) {
+        uint32_t m = MatchMask16(inputs.data() + i, mask, pattern) ^ flip;
+        if (m) {
+            return i + std::countr_zero(m);
+        }
+    }
+    for (; i < n; i++) {
+        if (((inputs[i] & mask) == pattern) != invert) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int rgms::nes::FindNextInput(const std::vector<ControllerState>& inputs, int from,
+        ControllerState mask, ControllerState pattern) {
+    return FindNextMatch(inputs, from, mask, pattern, false);
+}
+
+int rgms::nes::FindPreviousInput(const std::vector<ControllerState>& inputs, int from,
+        ControllerState mask, ControllerState pattern) {
+    int i = std::min(from, static_cast<int>(inputs.size()) - 1);
+    for (; i >= 15; i -= 16) {
+        uint32_t m = MatchMask16(inputs.data() + i - 15, mask, pattern);
+        if (m) {
+            return i - 15 + (std::bit_width(m) - 1);
+        }
+    }
+    for (; i >= 0; i--) {
+        if ((inputs[i] & mask) == pattern) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Bit i is set when buttons are held on p[i] but not on p[i - 1]
+static inline uint32_t PressMask16(const uint8_t* p, uint8_t buttons) {
+    return MatchMask16(p, buttons, buttons) & ~MatchMask16(p - 1, buttons, buttons) & 0xffff;
+}
+
+static bool IsPress(const std::vector<ControllerState>& inputs, int i, uint8_t buttons) {
+    bool held = (inputs[i] & buttons) == buttons;
+    bool prevHeld = i > 0 && (inputs[i - 1] & buttons) == buttons;
+    return held && !prevHeld;
+}
+
+int rgms::nes::FindNextPress(const std::vector<ControllerState>& inputs, int from,
+        ControllerState buttons) {
+    int n = static_cast<int>(inputs.size());
+    int i = std::max(from, 0);
+    if (i == 0 && n > 0) {
+        if (IsPress(inputs, 0, buttons)) {
+            return 0;
+        }
+        i = 1;
+    }
+    for (; i + 16 <= n; i += 16) {
+        uint32_t m = PressMask16(inputs.data() + i, buttons);
+        if (m) {
+            return i + std::countr_zero(m);
+        }
+    }
+    for (; i < n; i++) {
+        if (IsPress(inputs, i, buttons)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int rgms::nes::FindPreviousPress(const std::vector<ControllerState>& inputs, int from,
+        ControllerState buttons) {
+    int i = std::min(from, static_cast<int>(inputs.size()) - 1);
+    for (; i >= 16; i -= 16) {
+        uint32_t m = PressMask16(inputs.data() + i - 15, buttons);
+        if (m) {
+            return i - 15 + (std::bit_width(m) - 1);
+        }
+    }
+    for (; i >= 0; i--) {
+        if (IsPress(inputs, i, buttons)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int rgms::nes::FindNextHeldRun(const std::vector<ControllerState>& inputs, int from,
+        ControllerState buttons, int minLength, int* end) {
+    int n = static_cast<int>(inputs.size());
+    int start = std::max(from, 0);
+    while (start < n) {
+        start = FindNextMatch(inputs, start, buttons, buttons, false);
+        if (start < 0) {
+            break;
+        }
+        int e = FindNextMatch(inputs, start, buttons, buttons, true);
+        if (e < 0) {
+            e = n;
+        }
+        if (e - start >= minLength) {
+            if (end) {
+                *end = e;
+            }
+            return start;
+        }
+        start = e;
+    }
+    return -1;
+}
+
+static void ClampRange(const std::vector<ControllerState>& inputs, int* from, int* to) {
+    *from = std::max(*from, 0);
+    *to = std::min(*to, static_cast<int>(inputs.size()));
+}
+
+void rgms::nes::ShiftButtons(std::vector<ControllerState>* inputs, int from, int to,
+        ControllerState buttons, int k) {
+    ClampRange(*inputs, &from, &to);
+    if (from >= to || k == 0) {
+        return;
+    }
+    std::vector<ControllerState> column(inputs->begin() + from, inputs->begin() + to);
+    ControllerState keep = static_cast<ControllerState>(~buttons);
+    ControllerState* p = inputs->data();
+    for (int i = from; i < to; i++) {
+        p[i] &= keep;
+    }
+    int s = std::max(from, from + k);
+    int e = std::min(to, to + k);
+    for (int i = s; i < e; i++) {
+        p[i] |= column[i - k - from] & buttons;
+    }
+}
+
+void rgms::nes::ClearButtons(std::vector<ControllerState>* inputs, int from, int to,
+        ControllerState buttons) {
+    ClampRange(*inputs, &from, &to);
+    ControllerState keep = static_cast<ControllerState>(~buttons);
+    ControllerState* p = inputs->data();
+    for (int i = from; i < to; i++) {
+        p[i] &= keep;
+    }
+}
+
+void rgms::nes::SetButtons(std::vector<ControllerState>* inputs, int from, int to,
+        ControllerState buttons) {
+    ClampRange(*inputs, &from, &to);
+    ControllerState* p = inputs->data();
+    for (int i = from; i < to; i++) {
+        p[i] |= buttons;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const std::string FM2_PLACEHOLDER_ROM_CHECKSUM = "base64:0000000000000/00000000==";
+
 FM2Header FM2Header::Defaults() {
     FM2Header h;
     h.version = 3;
@@ -496,7 +969,7 @@ FM2Header FM2Header::Defaults() {
     h.rerecordCount = 0;
     h.palFlag = false;
     h.romFilename = "rom";
-    h.romChecksum = "base64:0000000000000/00000000==";
+    h.romChecksum = FM2_PLACEHOLDER_ROM_CHECKSUM;
     h.guid = "00000000-0000-0000-0000-000000000000";
     h.fourscore = 0;
     h.microphone = 0;
@@ -515,98 +988,179 @@ static bool StringStartsWith(const std::string& str, const std::string& start) {
     return false;
 }
 
-static bool GetLine(std::istream& is, std::string& line) {
-    if (!std::getline(is, line)) {
-        return false;
+static void ParseFM2HeaderLine(const std::string& line, FM2Header* header) {
+    if (StringStartsWith(line, "emuVersion")) {
+        header->emuVersion = std::stoi(line.substr(11));
+    } else if (StringStartsWith(line, "rerecordCount")) {
+        header->rerecordCount = std::stoi(line.substr(14));
+    } else if (StringStartsWith(line, "palFlag")) {
+        header->palFlag = std::stoi(line.substr(8));
+    } else if (StringStartsWith(line, "romFilename")) {
+        header->romFilename = line.substr(12);
+    } else if (StringStartsWith(line, "romChecksum")) {
+        header->romChecksum = line.substr(12);
+    } else if (StringStartsWith(line, "guid")) {
+        header->guid = line.substr(5);
+    } else if (StringStartsWith(line, "fourscore")) {
+        header->fourscore = std::stoi(line.substr(10));
+    } else if (StringStartsWith(line, "microphone")) {
+        header->microphone = std::stoi(line.substr(11));
+    } else if (StringStartsWith(line, "port0")) {
+        header->port0 = std::stoi(line.substr(6));
+    } else if (StringStartsWith(line, "port1")) {
+        header->port1 = std::stoi(line.substr(6));
+    } else if (StringStartsWith(line, "port2")) {
+        header->port2 = std::stoi(line.substr(6));
+    } else if (StringStartsWith(line, "FDS")) {
+        header->FDS = std::stoi(line.substr(4));
+    } else if (StringStartsWith(line, "NewPPU")) {
+        header->NewPPU = std::stoi(line.substr(7));
+    } else {
+        header->additionalLines.push_back(line);
     }
-    if (line.length() > 1) {
-        if (line.back() == '\r') {
-            line.pop_back();
+}
+
+// The eight button characters of an input line, '|0|RLDUTSBA|||', start at
+// offset 3. Any character other than '.' is a pressed button, leftmost is the
+// highest bit. Done eight bytes at a time: flag every non '.' byte in its high
+// bit, then gather the high bits into one byte with a multiply.
+static uint8_t DecodeFM2Buttons(const char* buttons) {
+    if constexpr (std::endian::native == std::endian::little) {
+        uint64_t x;
+        std::memcpy(&x, buttons, sizeof(x));
+        x ^= 0x2e2e2e2e2e2e2e2eull;
+        uint64_t t = (((x & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | x)
+            & 0x8080808080808080ull;
+        return static_cast<uint8_t>(((t >> 7) * 0x8040201008040201ull) >> 56);
+    } else {
+        uint8_t cs = 0;
+        for (int button = 0; button < 8; button++) {
+            if (buttons[7 - button] != '.') {
+                cs |= (1 << button);
+            }
         }
+        return cs;
     }
+}
+
+// Whether any of the first 14 bytes is a '\n', without looping over them.
+static bool HasNewline14(const char* p) {
+    uint64_t a, b;
+    std::memcpy(&a, p, sizeof(a));
+    std::memcpy(&b, p + 6, sizeof(b));
+    a ^= 0x0a0a0a0a0a0a0a0aull;
+    b ^= 0x0a0a0a0a0a0a0a0aull;
+    uint64_t za = (a - 0x0101010101010101ull) & ~a;
+    uint64_t zb = (b - 0x0101010101010101ull) & ~b;
+    return ((za | zb) & 0x8080808080808080ull) != 0;
+}
 
+// Same line semantics as std::getline, with a trailing '\r' removed.
+static bool NextLine(const char** p, const char* end, const char** line, size_t* length) {
+    if (*p >= end) {
+        return false;
+    }
+    const char* s = *p;
+    const char* nl = static_cast<const char*>(std::memchr(s, '\n', end - s));
+    size_t n;
+    if (nl) {
+        n = nl - s;
+        *p = nl + 1;
+    } else {
+        n = end - s;
+        *p = end;
+    }
+    if (n > 1 && s[n - 1] == '\r') {
+        n--;
+    }
+    *line = s;
+    *length = n;
     return true;
 }
 
-void rgms::nes::ReadFM2File(std::istream& is,
+void rgms::nes::ReadFM2Buffer(const char* data, size_t size,
         std::vector<nes::ControllerState>* inputs,
         FM2Header* header) {
     if (header) {
         *header = FM2Header::Defaults();
     }
+    if (inputs) {
+        inputs->clear();
+    }
 
-    std::string line;
-    if (!GetLine(is, line) || line != "version 3") {
+    const char* p = data;
+    const char* end = data + size;
+    const char* line;
+    size_t length;
+    if (!NextLine(&p, end, &line, &length) || std::string(line, length) != "version 3") {
         throw std::invalid_argument("unsupported fm2 file");
     }
 
     int lineNumber = 1;
     bool readingInputs = false;
+    while (NextLine(&p, end, &line, &length)) {
+        if (length > 0 && line[0] == '|') {
+            readingInputs = true;
+            break;
+        }
+        if (header) {
+            ParseFM2HeaderLine(std::string(line, length), header);
+        }
+        lineNumber++;
+    }
+    if (!readingInputs) {
+        return;
+    }
+
+    // Nearly every input line is exactly "|0|........|||\n", so reserve for
+    // that and only search for the line ending when the fixed width misses.
     if (inputs) {
-        inputs->clear();
+        inputs->reserve(static_cast<size_t>(end - line) / 15 + 1);
     }
     bool firstInput = true;
-    while (GetLine(is, line)) {
-        if (!readingInputs) {
-            if (StringStartsWith(line, "|")) {
-                readingInputs = true;
-            } else if (header) {
-                if (StringStartsWith(line, "emuVersion")) {
-                    header->emuVersion = std::stoi(line.substr(11));
-                } else if (StringStartsWith(line, "rerecordCount")) {
-                    header->rerecordCount = std::stoi(line.substr(14));
-                } else if (StringStartsWith(line, "palFlag")) {
-                    header->palFlag = std::stoi(line.substr(8));
-                } else if (StringStartsWith(line, "romFilename")) {
-                    header->romFilename = line.substr(12);
-                } else if (StringStartsWith(line, "romChecksum")) {
-                    header->romChecksum = line.substr(12);
-                } else if (StringStartsWith(line, "guid")) {
-                    header->guid = line.substr(5);
-                } else if (StringStartsWith(line, "fourscore")) {
-                    header->fourscore = std::stoi(line.substr(10));
-                } else if (StringStartsWith(line, "microphone")) {
-                    header->microphone = std::stoi(line.substr(11));
-                } else if (StringStartsWith(line, "port0")) {
-                    header->port0 = std::stoi(line.substr(6));
-                } else if (StringStartsWith(line, "port1")) {
-                    header->port1 = std::stoi(line.substr(6));
-                } else if (StringStartsWith(line, "port2")) {
-                    header->port2 = std::stoi(line.substr(6));
-                } else if (StringStartsWith(line, "FDS")) {
-                    header->FDS = std::stoi(line.substr(4));
-                } else if (StringStartsWith(line, "NewPPU")) {
-                    header->NewPPU = std::stoi(line.substr(7));
-                } else {
-                    header->additionalLines.push_back(line);
-                }
-            }
+    for (;;) {
+        if (!(length == 14 || length == 22)) {
+            std::ostringstream os;
+            os << "invalid entry on line " << lineNumber << ": '"
+               << std::string(line, length) << "'";
+            throw std::invalid_argument(os.str());
         }
-
-        if (readingInputs) {
-            if (!(line.size() == 14 || line.size() == 22)) {
-                std::ostringstream os;
-                os << "invalid entry on line " << lineNumber << ": '" << line << "'";
-                throw std::invalid_argument(os.str());
-            } else {
-                uint8_t cs = 0;
-                for (int button = 0; button < 8; button++) {
-                    if (line[10 - button] != '.') {
-                        cs |= (1 << button);
-                    }
-                }
-
-                if (inputs) {
-                    if (!firstInput) {
-                        inputs->push_back(static_cast<nes::ControllerState>(cs));
-                    }
-                    firstInput = false;
-                }
+        if (inputs) {
+            if (!firstInput) {
+                inputs->push_back(DecodeFM2Buttons(line + 3));
             }
+            firstInput = false;
         }
         lineNumber++;
+
+        bool fixedWidth = (end - p >= 15) && !HasNewline14(p);
+        if (fixedWidth && p[14] == '\n') {
+            line = p;
+            length = (p[13] == '\r') ? 13 : 14;
+            p += 15;
+        } else if (fixedWidth && end - p >= 16 && p[14] == '\r' && p[15] == '\n') {
+            line = p;
+            length = 14;
+            p += 16;
+        } else if (!NextLine(&p, end, &line, &length)) {
+            break;
+        }
     }
+}
+
+void rgms::nes::ReadFM2File(std::istream& is,
+        std::vector<nes::ControllerState>* inputs,
+        FM2Header* header) {
+    std::string contents(std::istreambuf_iterator<char>(is), {});
+    ReadFM2Buffer(contents.data(), contents.size(), inputs, header);
+}
 
+void rgms::nes::ReadFM2File(const std::string& path,
+        std::vector<nes::ControllerState>* inputs,
+        FM2Header* header) {
+    util::MappedFile file(path);
+    ReadFM2Buffer(reinterpret_cast<const char*>(file.Data()), file.Size(),
+            inputs, header);
 }
 
 std::string rgms::nes::ControllerStateToFM2Line(const nes::ControllerState& state) {
@@ -625,36 +1179,588 @@ std::string rgms::nes::ControllerStateToFM2Line(const nes::ControllerState& stat
     return v;
 }
 
+static void AppendFM2Header(std::string* buffer, const FM2Header& header) {
+    std::string& b = *buffer;
+    auto AddLine = [&](const std::string& key, const std::string& value) {
+        b += key;
+        b += ' ';
+        b += value;
+        b += '\n';
+    };
+    AddLine("version", std::to_string(header.version));
+    AddLine("emuVersion", std::to_string(header.emuVersion));
+    AddLine("rerecordCount", std::to_string(header.rerecordCount));
+    AddLine("palFlag", std::to_string(static_cast<int>(header.palFlag)));
+    AddLine("romFilename", header.romFilename);
+    AddLine("romChecksum", header.romChecksum);
+    AddLine("guid", header.guid);
+    AddLine("fourscore", std::to_string(static_cast<int>(header.fourscore)));
+    AddLine("microphone", std::to_string(static_cast<int>(header.microphone)));
+    AddLine("port0", std::to_string(header.port0));
+    AddLine("port1", std::to_string(header.port1));
+    AddLine("port2", std::to_string(header.port2));
+    AddLine("FDS", std::to_string(static_cast<int>(header.FDS)));
+    AddLine("NewPPU", std::to_string(static_cast<int>(header.NewPPU)));
+    for (auto & line : header.additionalLines) {
+        b += line;
+        b += '\n';
+    }
+}
+
+void rgms::nes::WriteFM2Buffer(std::string* buffer,
+        const std::vector<ControllerState>& inputs,
+        const FM2Header& header) {
+    static const std::string INPUT_LINE = "|0|........|||\n";
+    static const std::array<uint64_t, 256> BUTTON_TABLE = [](){
+        std::array<uint64_t, 256> table;
+        for (int i = 0; i < 256; i++) {
+            std::string v = ControllerStateToFM2Line(static_cast<ControllerState>(i));
+            std::memcpy(&table[i], v.data() + 3, sizeof(uint64_t));
+        }
+        return table;
+    }();
+
+    std::string& b = *buffer;
+    b.clear();
+    AppendFM2Header(&b, header);
+
+    // One leading blank input line, then each input, all fixed width.
+    size_t offset = b.size();
+    size_t n = inputs.size() + 1;
+    b.resize(offset + n * INPUT_LINE.size());
+    char* out = b.data() + offset;
+    std::memcpy(out, INPUT_LINE.data(), INPUT_LINE.size());
+    out += INPUT_LINE.size();
+    for (auto & input : inputs) {
+        std::memcpy(out, INPUT_LINE.data(), INPUT_LINE.size());
+        std::memcpy(out + 3, &BUTTON_TABLE[static_cast<uint8_t>(input)], sizeof(uint64_t));
+        out += INPUT_LINE.size();
+    }
+}
+
 void rgms::nes::WriteFM2File(std::ostream& os,
         const std::vector<ControllerState>& inputs,
         const FM2Header& header) {
+    std::string buffer;
+    WriteFM2Buffer(&buffer, inputs, header);
+    os.write(buffer.data(), buffer.size());
+}
+
+void rgms::nes::WriteFM2File(const std::string& path,
+        const std::vector<ControllerState>& inputs,
+        const FM2Header& header) {
+    std::string buffer;
+    WriteFM2Buffer(&buffer, inputs, header);
+    std::ofstream ofs(path, std::ios::out | std::ios::binary);
+    if (!ofs.good()) {
+        throw std::invalid_argument("ofstream not good");
+    }
+    ofs.write(buffer.data(), buffer.size());
+}
 
+////////////////////////////////////////////////////////////////////////////////
 
-    os << "version " << header.version << "\n";
-    os << "emuVersion " << header.emuVersion << "\n";
-    os << "rerecordCount " << header.rerecordCount << "\n";
-    os << "palFlag " << static_cast<int>(header.palFlag) << "\n";
-    os << "romFilename " << header.romFilename << "\n";
-    os << "romChecksum " << header.romChecksum << "\n";
-    os << "guid " << header.guid << "\n";
-    os << "fourscore " << static_cast<int>(header.fourscore) << "\n";
-    os << "microphone " << static_cast<int>(header.microphone) << "\n";
-    os << "port0 " << header.port0 << "\n";
-    os << "port1 " << header.port1 << "\n";
-    os << "port2 " << header.port2 << "\n";
-    os << "FDS " << static_cast<int>(header.FDS) << "\n";
-    os << "NewPPU " << static_cast<int>(header.NewPPU) << "\n";
-    for (auto & line : header.additionalLines) {
-        os << line << "\n";
+// Journal layout, every integer a little endian uint32:
+//   header: "FM2J" version baseChecksum baseLength
+//   record: frameIndex count <count inputs> checksum
+static constexpr uint32_t FM2_JOURNAL_MAGIC = 0x4a324d46;
+static constexpr uint32_t FM2_JOURNAL_VERSION = 2;
+static constexpr size_t FM2_JOURNAL_HEADER_SIZE = 16;
+static constexpr size_t FM2_JOURNAL_RECORD_OVERHEAD = 12;
+
+// Record and file checksums, the low half of util::FNV1a
+static uint32_t Checksum32(const uint8_t* data, size_t size) {
+    return static_cast<uint32_t>(rgms::util::FNV1a(data, size));
+}
+
+static void PutU32(uint8_t* p, uint32_t v) {
+    p[0] = static_cast<uint8_t>(v);
+    p[1] = static_cast<uint8_t>(v >> 8);
+    p[2] = static_cast<uint8_t>(v >> 16);
+    p[3] = static_cast<uint8_t>(v >> 24);
+}
+
+static uint32_t GetU32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) |
+        (static_cast<uint32_t>(p[1]) << 8) |
+        (static_cast<uint32_t>(p[2]) << 16) |
+        (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Trailing empty inputs are padded and trimmed freely by the editor, so they do
+// not count towards identifying a movie.
+static size_t SignificantLength(const std::vector<ControllerState>& inputs) {
+    size_t n = inputs.size();
+    while (n > 0 && inputs[n - 1] == 0) {
+        n--;
+    }
+    return n;
+}
+
+static uint32_t InputsChecksum(const std::vector<ControllerState>& inputs) {
+    return Checksum32(inputs.data(), SignificantLength(inputs));
+}
+
+static bool SyncFile(FILE* f) {
+    if (std::fflush(f) != 0) {
+        return false;
     }
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// So that a rename within it survives a crash, which fsync of the file alone
+// doesn't promise. Nothing to do on windows
+static void SyncDirectory(const std::string& path) {
+#ifndef _WIN32
+    std::string dir = rgms::util::fs::path(path).parent_path().string();
+    if (dir.empty()) {
+        dir = ".";
+    }
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("unable to open '" + dir + "'");
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    if (!ok) {
+        throw std::runtime_error("unable to sync '" + dir + "'");
+    }
+#endif
+}
+
+FM2JournalConfig FM2JournalConfig::Defaults() {
+    FM2JournalConfig cfg;
+    cfg.FlushIntervalMillis = 1000;
+    cfg.CompactIntervalSeconds = 300;
+    cfg.CompactJournalBytes = 4 * 1024 * 1024;
+    return cfg;
+}
+
+FM2Journal::FM2Journal(const std::string& fm2Path,
+        std::vector<ControllerState>* inputs,
+        const FM2Header& header,
+        FM2JournalConfig config)
+    : m_Config(config)
+    , m_FM2Path(fm2Path)
+    , m_JournalPath(JournalPath(fm2Path))
+    , m_ReplayedRecords(0)
+    , m_File(nullptr)
+    , m_JournalSize(0)
+    , m_ResumeJournal(false)
+    , m_BaseChecksum(0)
+    , m_BaseLength(0)
+    , m_Header(header)
+    , m_HeaderChanged(false)
+    , m_LastCompaction(std::chrono::steady_clock::now())
+    , m_PendingFlush(false)
+    , m_ShouldStop(false)
+{
+    ReplayJournal(inputs);
+    m_Inputs = *inputs;
+    m_JournalThread = std::thread(&FM2Journal::JournalThread, this);
+}
+
+FM2Journal::~FM2Journal() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_ShouldStop = true;
+    }
+    m_WorkCV.notify_one();
+    m_JournalThread.join();
+    if (m_File) {
+        std::fclose(m_File);
+    }
+}
+
+std::string FM2Journal::JournalPath(const std::string& fm2Path) {
+    return fm2Path + ".journal";
+}
+
+int FM2Journal::ReplayedRecords() const {
+    return m_ReplayedRecords;
+}
 
+void FM2Journal::RecordEdit(int frameIndex, ControllerState newState) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_PendingEdits.emplace_back(frameIndex, newState);
+}
+
+void FM2Journal::SetHeader(const FM2Header& header) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_PendingHeader = std::make_unique<FM2Header>(header);
+}
+
+void FM2Journal::Flush() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_PendingFlush = true;
+    }
+    m_WorkCV.notify_one();
+}
+
+void FM2Journal::Compact(const std::vector<ControllerState>& inputs,
+        const FM2Header& header) {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_PendingEdits.clear();
+        m_PendingHeader.reset();
+        m_PendingFlush = false;
+        m_PendingCompaction = std::make_unique<Compaction>();
+        m_PendingCompaction->Inputs = inputs;
+        m_PendingCompaction->Header = header;
+    }
+    m_WorkCV.notify_one();
+}
 
-    auto WriteInputLine = [&](const nes::ControllerState& input){
-        os << ControllerStateToFM2Line(input) << "\n";
+bool FM2Journal::HasError(std::string* error) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_LastError.empty()) {
+        return false;
+    }
+    if (error) {
+        *error = m_LastError;
+    }
+    m_LastError.clear();
+    return true;
+}
+
+void FM2Journal::ReplayJournal(std::vector<ControllerState>* inputs) {
+    m_BaseChecksum = InputsChecksum(*inputs);
+    m_BaseLength = static_cast<uint32_t>(SignificantLength(*inputs));
+
+    if (util::FileExists(m_JournalPath)) {
+        std::vector<uint8_t> contents;
+        util::ReadFileToVector(m_JournalPath, &contents);
+        const uint8_t* p = contents.data();
+        size_t size = contents.size();
+
+        if (size >= FM2_JOURNAL_HEADER_SIZE &&
+                GetU32(p + 0) == FM2_JOURNAL_MAGIC &&
+                GetU32(p + 4) == FM2_JOURNAL_VERSION &&
+                GetU32(p + 8) == m_BaseChecksum &&
+                GetU32(p + 12) == m_BaseLength) {
+            size_t offset = FM2_JOURNAL_HEADER_SIZE;
+            while (size - offset >= FM2_JOURNAL_RECORD_OVERHEAD) {
+                size_t frameIndex = GetU32(p + offset);
+                size_t count = GetU32(p + offset + 4);
+                if (count > size - offset - FM2_JOURNAL_RECORD_OVERHEAD) {
+                    break;
+                }
+                const uint8_t* data = p + offset + 8;
+                if (Checksum32(p + offset, 8 + count) != GetU32(data + count)) {
+                    break;
+                }
+
+                if (inputs->size() < frameIndex + count) {
+                    inputs->resize(frameIndex + count, 0x00);
+                }
+                std::copy(data, data + count, inputs->begin() + frameIndex);
+                offset += FM2_JOURNAL_RECORD_OVERHEAD + count;
+                m_ReplayedRecords++;
+            }
+
+            // Appended to from the first edit on, and left alone until then
+            m_ResumeJournal = true;
+            m_JournalSize = offset;
+        }
+    }
+}
+
+void FM2Journal::EnsureJournalOpen() {
+    if (m_File) {
+        return;
+    }
+    if (m_ResumeJournal) {
+        // Anything past the last good record was torn by a crash
+        if (util::fs::file_size(m_JournalPath) != m_JournalSize) {
+            util::fs::resize_file(m_JournalPath, m_JournalSize);
+        }
+        m_File = std::fopen(m_JournalPath.c_str(), "ab");
+        if (!m_File) {
+            throw std::runtime_error("unable to open fm2 journal");
+        }
+        m_ResumeJournal = false;
+    } else {
+        OpenJournal(m_BaseChecksum, m_BaseLength);
+    }
+}
+
+void FM2Journal::OpenJournal(uint32_t baseChecksum, uint32_t baseLength) {
+    if (m_File) {
+        std::fclose(m_File);
+    }
+    m_File = std::fopen(m_JournalPath.c_str(), "wb");
+    if (!m_File) {
+        throw std::runtime_error("unable to open fm2 journal");
+    }
+
+    uint8_t header[FM2_JOURNAL_HEADER_SIZE];
+    PutU32(header + 0, FM2_JOURNAL_MAGIC);
+    PutU32(header + 4, FM2_JOURNAL_VERSION);
+    PutU32(header + 8, baseChecksum);
+    PutU32(header + 12, baseLength);
+    if (std::fwrite(header, 1, sizeof(header), m_File) != sizeof(header)) {
+        throw std::runtime_error("unable to write fm2 journal");
+    }
+    SyncJournal();
+    m_JournalSize = FM2_JOURNAL_HEADER_SIZE;
+}
+
+void FM2Journal::SyncJournal() {
+    if (!SyncFile(m_File)) {
+        throw std::runtime_error("unable to sync fm2 journal");
+    }
+}
+
+void FM2Journal::AppendEdits(const std::vector<std::pair<int, ControllerState>>& edits) {
+    EnsureJournalOpen();
+
+    std::vector<size_t> frames;
+    frames.reserve(edits.size());
+    for (auto & [frameIndex, state] : edits) {
+        if (frameIndex < 0) {
+            continue;
+        }
+        size_t i = static_cast<size_t>(frameIndex);
+        if (m_Inputs.size() <= i) {
+            m_Inputs.resize(i + 1, 0x00);
+        }
+        m_Inputs[i] = state;
+        frames.push_back(i);
+    }
+    std::sort(frames.begin(), frames.end());
+    frames.erase(std::unique(frames.begin(), frames.end()), frames.end());
+
+    // Records hold the current values over a range, so nearby edits are merged
+    // whenever the gap between them is cheaper than another record.
+    std::vector<uint8_t> buffer;
+    size_t i = 0;
+    while (i < frames.size()) {
+        size_t j = i + 1;
+        while (j < frames.size() &&
+                (frames[j] - frames[j - 1]) <= FM2_JOURNAL_RECORD_OVERHEAD) {
+            j++;
+        }
+        size_t frameIndex = frames[i];
+        size_t count = frames[j - 1] - frameIndex + 1;
+
+        size_t o = buffer.size();
+        buffer.resize(o + FM2_JOURNAL_RECORD_OVERHEAD + count);
+        PutU32(&buffer[o], static_cast<uint32_t>(frameIndex));
+        PutU32(&buffer[o + 4], static_cast<uint32_t>(count));
+        std::memcpy(&buffer[o + 8], m_Inputs.data() + frameIndex, count);
+        PutU32(&buffer[o + 8 + count], Checksum32(&buffer[o], 8 + count));
+        i = j;
+    }
+
+    if (std::fwrite(buffer.data(), 1, buffer.size(), m_File) != buffer.size()) {
+        throw std::runtime_error("unable to write fm2 journal");
+    }
+    SyncJournal();
+    m_JournalSize += buffer.size();
+}
+
+void FM2Journal::DoCompaction() {
+    m_LastCompaction = std::chrono::steady_clock::now();
+
+    std::string buffer;
+    WriteFM2Buffer(&buffer, m_Inputs, m_Header);
+
+    // Replace the fm2 file in one step so a crash leaves either version intact
+    std::string tmpPath = m_FM2Path + ".tmp";
+    FILE* f = std::fopen(tmpPath.c_str(), "wb");
+    if (!f) {
+        throw std::runtime_error("unable to open '" + tmpPath + "'");
+    }
+    bool ok = std::fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size();
+    ok = SyncFile(f) && ok;
+    std::fclose(f);
+    if (!ok) {
+        throw std::runtime_error("unable to write '" + tmpPath + "'");
+    }
+    util::fs::rename(tmpPath, m_FM2Path);
+    SyncDirectory(m_FM2Path);
+
+    // The old journal is folded in, the next edit starts a new one
+    if (m_File) {
+        std::fclose(m_File);
+        m_File = nullptr;
+    }
+    std::error_code ec;
+    util::fs::remove(m_JournalPath, ec);
+    m_ResumeJournal = false;
+    m_JournalSize = 0;
+    m_HeaderChanged = false;
+    m_BaseChecksum = InputsChecksum(m_Inputs);
+    m_BaseLength = static_cast<uint32_t>(SignificantLength(m_Inputs));
+}
+
+void FM2Journal::JournalThread() {
+    bool stop = false;
+    while (!stop) {
+        std::vector<std::pair<int, ControllerState>> edits;
+        std::unique_ptr<Compaction> compaction;
+        std::unique_ptr<FM2Header> header;
+        bool flush = false;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_WorkCV.wait_for(lock, std::chrono::milliseconds(m_Config.FlushIntervalMillis), [&](){
+                return m_ShouldStop || m_PendingCompaction || m_PendingFlush;
+            });
+            edits.swap(m_PendingEdits);
+            header = std::move(m_PendingHeader);
+            compaction = std::move(m_PendingCompaction);
+            flush = m_PendingFlush;
+            m_PendingFlush = false;
+            stop = m_ShouldStop;
+        }
+
+        try {
+            if (header) {
+                m_Header = std::move(*header);
+                m_HeaderChanged = true;
+            }
+            if (compaction) {
+                m_Inputs = std::move(compaction->Inputs);
+                m_Header = std::move(compaction->Header);
+                DoCompaction();
+            }
+            if (!edits.empty()) {
+                AppendEdits(edits);
+            }
+            if (flush && m_HeaderChanged) {
+                DoCompaction();
+            }
+
+            auto sinceCompaction = std::chrono::steady_clock::now() - m_LastCompaction;
+            if (m_JournalSize > m_Config.CompactJournalBytes ||
+                    (m_JournalSize > FM2_JOURNAL_HEADER_SIZE &&
+                     sinceCompaction >= std::chrono::seconds(m_Config.CompactIntervalSeconds))) {
+                DoCompaction();
+            }
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_LastError = e.what();
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static std::array<uint8_t, 16> MD5(const uint8_t* data, size_t size) {
+    static const uint32_t K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+        0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+        0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+        0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+        0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+        0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+        0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+        0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static const int R[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
     };
 
-    WriteInputLine(0);
-    for (auto & input : inputs) {
-        WriteInputLine(input);
+    std::vector<uint8_t> msg(data, data + size);
+    msg.push_back(0x80);
+    while (msg.size() % 64 != 56) {
+        msg.push_back(0x00);
     }
+    uint64_t bits = static_cast<uint64_t>(size) * 8;
+    for (int i = 0; i < 8; i++) {
+        msg.push_back(static_cast<uint8_t>(bits >> (8 * i)));
+    }
+
+    uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++) {
+            w[i] = GetU32(&msg[chunk + i * 4]);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for (int i = 0; i < 64; i++) {
+            uint32_t f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            f += a + K[i] + w[g];
+            a = d;
+            d = c;
+            c = b;
+            b += (f << R[i]) | (f >> (32 - R[i]));
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+
+    std::array<uint8_t, 16> digest;
+    for (int i = 0; i < 4; i++) {
+        PutU32(&digest[i * 4], h[i]);
+    }
+    return digest;
+}
+
+static std::string Base64Encode(const uint8_t* data, size_t size) {
+    static const char* CHARS =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((size + 2) / 3 * 4);
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t v = static_cast<uint32_t>(data[i]) << 16;
+        if (i + 1 < size) v |= static_cast<uint32_t>(data[i + 1]) << 8;
+        if (i + 2 < size) v |= static_cast<uint32_t>(data[i + 2]);
+
+        out += CHARS[(v >> 18) & 0x3f];
+        out += CHARS[(v >> 12) & 0x3f];
+        out += (i + 1 < size) ? CHARS[(v >> 6) & 0x3f] : '=';
+        out += (i + 2 < size) ? CHARS[v & 0x3f] : '=';
+    }
+    return out;
+}
+
+std::string rgms::nes::FM2RomChecksum(const std::string& inesContents) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(inesContents.data());
+    size_t size = inesContents.size();
+
+    size_t offset = 0;
+    if (size >= 16 && std::memcmp(data, "NES\x1a", 4) == 0) {
+        offset = 16;
+        if (data[6] & 0x04) {
+            offset += 512; // trainer
+        }
+    }
+    offset = std::min(offset, size);
+
+    auto digest = MD5(data + offset, size - offset);
+    return "base64:" + Base64Encode(digest.data(), digest.size());
 }
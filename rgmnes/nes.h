@@ -39,6 +39,9 @@
 #include <vector>
 #include <sstream>
 #include <functional>
+#include <chrono>
+#include <cstdio>
+#include <condition_variable>
 
 namespace rgms::nes {
 
@@ -61,6 +64,16 @@ inline constexpr uint8_t PALETTE_ENTRY_WHITE = 0x20;
 typedef std::array<uint8_t, PALETTE_SIZE> Palette; // RGB order!
 const Palette& DefaultPalette();
 
+// Expands palette indices (only the low 6 bits are looked at) to bgr
+// (channels 3) or opaque bgra (channels 4), writing each pixel as a
+// scale x scale block. width * height indices, tightly packed, and out is
+// height * scale rows that are outStep bytes apart. Done in one pass with
+// SSSE3/AVX2 shuffles when the cpu has them.
+inline constexpr int MAX_EXPAND_SCALE = 4;
+void ExpandPalette(const uint8_t* indices, int width, int height,
+        const Palette& palette, int scale, int channels,
+        uint8_t* out, size_t outStep);
+
 // Pattern tables (typically from chr data, controlled via a mapper)
 inline constexpr int PATTERNTABLE_SIZE = 0x1000;
 typedef std::array<uint8_t, PATTERNTABLE_SIZE> PatternTable;
@@ -287,11 +300,14 @@ NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(StateSequenceThreadConfig,
 );
 #endif
 
+// onNewState (if set) is invoked from the sequence thread whenever the latest
+// state changes, so the ui can redraw instead of polling HasNewState
 class StateSequenceThread {
 public:
     StateSequenceThread(StateSequenceThreadConfig cfg,
             std::unique_ptr<INESEmulator>&& emu,
-            const std::vector<ControllerState>& initialStates = std::vector<ControllerState>());
+            const std::vector<ControllerState>& initialStates = std::vector<ControllerState>(),
+            std::function<void()> onNewState = nullptr);
     ~StateSequenceThread();
 
     void InputChange(int frameIndex, ControllerState newInput);
@@ -312,6 +328,7 @@ private:
 private:
     StateSequenceThreadConfig m_Config;
     StateSequence m_StateSequence;
+    std::function<void()> m_OnNewState;
 
     std::atomic<int> m_OnNewStateIndex;
 
@@ -328,6 +345,36 @@ private:
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Queries over an input array, sixteen frames at a time where SSE2 is
+// available. A frame matches when (input & mask) == pattern, and a button set
+// is held when every button in it is pressed. Searches return -1 when nothing
+// is found.
+int FindNextInput(const std::vector<ControllerState>& inputs, int from,
+        ControllerState mask, ControllerState pattern);
+// Searches backwards starting at from
+int FindPreviousInput(const std::vector<ControllerState>& inputs, int from,
+        ControllerState mask, ControllerState pattern);
+// Frames where buttons go from not held to held
+int FindNextPress(const std::vector<ControllerState>& inputs, int from,
+        ControllerState buttons);
+int FindPreviousPress(const std::vector<ControllerState>& inputs, int from,
+        ControllerState buttons);
+// First run starting at or after from where buttons are held for at least
+// minLength frames, end is one past the last held frame
+int FindNextHeldRun(const std::vector<ControllerState>& inputs, int from,
+        ControllerState buttons, int minLength, int* end = nullptr);
+
+// Bulk transforms over [from, to). ShiftButtons moves the buttons column k
+// frames later (earlier if negative), whatever leaves the range is dropped.
+void ShiftButtons(std::vector<ControllerState>* inputs, int from, int to,
+        ControllerState buttons, int k);
+void ClearButtons(std::vector<ControllerState>* inputs, int from, int to,
+        ControllerState buttons);
+void SetButtons(std::vector<ControllerState>* inputs, int from, int to,
+        ControllerState buttons);
+
+////////////////////////////////////////////////////////////////////////////////
+
 struct FM2Header {
     int version;                // for now it is always 3
     int emuVersion;             // for now it is always 22020
@@ -351,11 +398,130 @@ struct FM2Header {
 void ReadFM2File(std::istream& is,
         std::vector<nes::ControllerState>* inputs,
         FM2Header* header);
+// Memory maps the file at path
+void ReadFM2File(const std::string& path,
+        std::vector<nes::ControllerState>* inputs,
+        FM2Header* header);
+void ReadFM2Buffer(const char* data, size_t size,
+        std::vector<nes::ControllerState>* inputs,
+        FM2Header* header);
 void WriteFM2File(std::ostream& os,
         const std::vector<nes::ControllerState>& inputs,
         const FM2Header& header);
+void WriteFM2File(const std::string& path,
+        const std::vector<nes::ControllerState>& inputs,
+        const FM2Header& header);
+// Formats the whole file into buffer, sized up front
+void WriteFM2Buffer(std::string* buffer,
+        const std::vector<nes::ControllerState>& inputs,
+        const FM2Header& header);
+
+// The checksum fceux records in the fm2 header, "base64:" followed by the md5
+// of the rom data (the ines file without its header / trainer).
+std::string FM2RomChecksum(const std::string& inesContents);
 std::string ControllerStateToFM2Line(const nes::ControllerState& state);
 
+////////////////////////////////////////////////////////////////////////////////
+
+// Append only log of input edits kept beside an fm2 file, so that saving costs
+// the size of the edit instead of the size of the movie. Records are range
+// edits with a checksum and are written to disk from a background thread. Every
+// so often (or on request) the edits are compacted into the fm2 file itself and
+// the journal starts over.
+//
+// The journal remembers a checksum of the fm2 inputs it was started against, so
+// a journal left behind by a crash is only replayed onto the same movie.
+struct FM2JournalConfig {
+    int FlushIntervalMillis;
+    int CompactIntervalSeconds;
+    size_t CompactJournalBytes;
+
+    static FM2JournalConfig Defaults();
+};
+#ifdef NLOHMANN_JSON_VERSION_MAJOR
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(FM2JournalConfig,
+    FlushIntervalMillis,
+    CompactIntervalSeconds,
+    CompactJournalBytes
+);
+#endif
+
+class FM2Journal {
+public:
+    // Replays any matching journal found beside fm2Path onto inputs, which
+    // should hold the inputs as read from fm2Path.
+    FM2Journal(const std::string& fm2Path,
+            std::vector<ControllerState>* inputs,
+            const FM2Header& header,
+            FM2JournalConfig config = FM2JournalConfig::Defaults());
+    // Writes out anything outstanding, including a pending compaction
+    ~FM2Journal();
+
+    static std::string JournalPath(const std::string& fm2Path);
+
+    int ReplayedRecords() const;
+
+    // Cheap, call from the ui thread whenever an input changes
+    void RecordEdit(int frameIndex, ControllerState newState);
+    // Header changes (such as the sync offset), used by the compactions the
+    // journal does on its own
+    void SetHeader(const FM2Header& header);
+    // An explicit save: writes and syncs the outstanding edits now rather
+    // than at the next flush interval, which costs as much as the edits do.
+    // Only compacts when the header changed, as the journal can't hold it
+    void Flush();
+    // Rewrites the fm2 file with these inputs and resets the journal. Edits
+    // recorded before this call are assumed to be included.
+    void Compact(const std::vector<ControllerState>& inputs,
+            const FM2Header& header);
+
+    // Errors from the background thread, cleared once returned
+    bool HasError(std::string* error);
+
+private:
+    struct Compaction {
+        std::vector<ControllerState> Inputs;
+        FM2Header Header;
+    };
+
+    void JournalThread();
+    void DoCompaction();
+    void AppendEdits(const std::vector<std::pair<int, ControllerState>>& edits);
+    void EnsureJournalOpen();
+    void OpenJournal(uint32_t baseChecksum, uint32_t baseLength);
+    void ReplayJournal(std::vector<ControllerState>* inputs);
+    void SyncJournal();
+
+private:
+    FM2JournalConfig m_Config;
+    std::string m_FM2Path;
+    std::string m_JournalPath;
+    int m_ReplayedRecords;
+
+    // Only touched by the journal thread once it is started
+    // The journal file isn't created (or a replayed one touched) until the
+    // first edit
+    FILE* m_File;
+    size_t m_JournalSize;
+    bool m_ResumeJournal;
+    uint32_t m_BaseChecksum;
+    uint32_t m_BaseLength;
+    std::vector<ControllerState> m_Inputs;
+    FM2Header m_Header;
+    bool m_HeaderChanged; // since the last compaction
+    std::chrono::steady_clock::time_point m_LastCompaction;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_WorkCV;
+    std::vector<std::pair<int, ControllerState>> m_PendingEdits;
+    std::unique_ptr<FM2Header> m_PendingHeader;
+    std::unique_ptr<Compaction> m_PendingCompaction;
+    bool m_PendingFlush;
+    std::string m_LastError;
+    bool m_ShouldStop;
+    std::thread m_JournalThread;
+};
+
 }
 
 #endif
@@ -0,0 +1,134 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021-2021 FlibidyDibidy
+//
+// This file is part of Graphite.
+//
+// Graphite is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// Graphite is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Graphite; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstring>
+
+#include "fmt/core.h"
+
+#include "rgmutil/util.h"
+#include "rgmnes/nes.h"
+
+using namespace rgms;
+
+// Micro-benchmark of the frame expansion that every cpu rendered view goes
+// through, against the two pass expand then upscale it replaced
+
+void Usage(std::ostream& os) {
+    os << "usage: nesbench [options]" << std::endl;
+    os << " --help                  : print usage and exit" << std::endl;
+    os << " --iterations n          : frames per measurement (default 2000)" << std::endl;
+}
+
+// Per pixel expansion, then a separate nearest neighbor upscale
+static void TwoPassExpand(const uint8_t* indices, const nes::Palette& palette,
+        int scale, int channels, std::vector<uint8_t>* native, uint8_t* out) {
+    uint8_t* o = native->data();
+    for (int k = 0; k < nes::FRAME_SIZE; k++) {
+        const uint8_t* p = palette.data() + (indices[k] & 0x3f) * 3;
+        o[0] = p[2];
+        o[1] = p[1];
+        o[2] = p[0];
+        if (channels == 4) {
+            o[3] = 0xff;
+        }
+        o += channels;
+    }
+
+    size_t rowBytes = static_cast<size_t>(nes::FRAME_WIDTH) * scale * channels;
+    for (int y = 0; y < nes::FRAME_HEIGHT * scale; y++) {
+        const uint8_t* in = native->data() + (y / scale) * nes::FRAME_WIDTH * channels;
+        uint8_t* row = out + y * rowBytes;
+        for (int x = 0; x < nes::FRAME_WIDTH * scale; x++) {
+            std::memcpy(row + x * channels, in + (x / scale) * channels, channels);
+        }
+    }
+}
+
+template <typename F>
+static double MicrosPerFrame(int iterations, F f) {
+    f(); // warm up
+    auto start = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        f();
+    }
+    std::chrono::duration<double, std::micro> elapsed = util::Now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char** argv) {
+    util::ArgNext(&argc, &argv); // Skip path argument
+
+    int iterations = 2000;
+
+    std::string arg;
+    while (util::ArgReadString(&argc, &argv, &arg)) {
+        if (arg == "--help") {
+            Usage(std::cout);
+            return 0;
+        } else if (arg == "--iterations") {
+            if (!util::ArgReadInt(&argc, &argv, &iterations) || iterations <= 0) {
+                Usage(std::cerr);
+                return 1;
+            }
+        } else {
+            Usage(std::cerr);
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(0);
+    nes::Frame frame;
+    for (auto& v : frame) {
+        v = static_cast<uint8_t>(rng() % nes::PALETTE_ENTRIES);
+    }
+    const nes::Palette& palette = nes::DefaultPalette();
+
+    fmt::print("{:>6} {:>8} {:>12} {:>12} {:>8}\n",
+            "scale", "format", "two pass us", "fused us", "speedup");
+    for (int channels : {3, 4}) {
+        for (int scale = 1; scale <= nes::MAX_EXPAND_SCALE; scale++) {
+            size_t outStep = static_cast<size_t>(nes::FRAME_WIDTH) * scale * channels;
+            std::vector<uint8_t> out(outStep * nes::FRAME_HEIGHT * scale);
+            std::vector<uint8_t> check(out.size());
+            std::vector<uint8_t> native(static_cast<size_t>(nes::FRAME_SIZE) * channels);
+
+            double twoPass = MicrosPerFrame(iterations, [&](){
+                TwoPassExpand(frame.data(), palette, scale, channels, &native, check.data());
+            });
+            double fused = MicrosPerFrame(iterations, [&](){
+                nes::ExpandPalette(frame.data(), nes::FRAME_WIDTH, nes::FRAME_HEIGHT,
+                        palette, scale, channels, out.data(), outStep);
+            });
+            if (out != check) {
+                std::cerr << "mismatch at scale " << scale << " channels " << channels << std::endl;
+                return 1;
+            }
+
+            fmt::print("{:>6} {:>8} {:>12.1f} {:>12.1f} {:>7.1f}x\n",
+                    scale, channels == 4 ? "bgra" : "bgr", twoPass, fused, twoPass / fused);
+        }
+    }
+    return 0;
+}
@@ -358,6 +358,7 @@ void EventQueue::PublishS(int etype, std::string dataStr) {
 
 void EventQueue::Publish(Event e) {
     m_PendingEvents.push_back(e);
+    RequestRedraw(); // so that it gets pumped
 }
 
 void EventQueue::Subscribe(int etype, EventCallback cback) {
@@ -511,35 +512,367 @@ bool rgms::rgmui::SliderFloatExt(const char* label, float* v, float min, float m
 }
 
 
+struct MatTexture {
+    GLuint Texture = 0;
+    int Width = 0;
+    int Height = 0;
+    uint64_t Generation = 0;
+    GLint Filter = 0;
+};
+
 void rgms::rgmui::Mat(const char* label, const cv::Mat& img) {
-    if (!img.isContinuous()) {
-        cv::Mat m = img.clone();
-        assert(m.isContinuous());
-        Mat(label, m);
+    Mat(label, img, 0, 1.0f);
+}
+
+void rgms::rgmui::Mat(const char* label, const cv::Mat& img, uint64_t generation, float scale) {
+    static std::unordered_map<ImGuiID, MatTexture> s_Textures;
+    MatTexture& t = s_Textures[ImGui::GetID(label)];
+
+    bool upload = generation == 0 || generation != t.Generation;
+    if (t.Texture == 0) {
+        glGenTextures(1, &t.Texture);
+        upload = true;
+    }
+    glBindTexture(GL_TEXTURE_2D, t.Texture);
+
+    GLint filter = (scale > 1.0f && scale == std::floor(scale)) ? GL_NEAREST : GL_LINEAR;
+    if (filter != t.Filter) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+        t.Filter = filter;
+    }
+
+    if (upload && !img.empty()) {
+        // Rows can be uploaded straight out of a submatrix as long as the
+        // step is a whole number of pixels
+        cv::Mat m = img;
+        if (m.step[0] % m.elemSize() != 0) {
+            m = img.clone();
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(m.step[0] / m.elemSize()));
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+        if (m.cols != t.Width || m.rows != t.Height) {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m.cols, m.rows, 0,
+                    GL_BGR, GL_UNSIGNED_BYTE, m.data);
+            t.Width = m.cols;
+            t.Height = m.rows;
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m.cols, m.rows,
+                    GL_BGR, GL_UNSIGNED_BYTE, m.data);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        t.Generation = generation;
+    }
+
+    ImGui::Image(t.Texture, ImVec2(static_cast<float>(img.cols) * scale,
+                static_cast<float>(img.rows) * scale));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The index lookup needs a shader, and gl 2.0+ entry points are not exported
+// by every platform's gl library so they are loaded through sdl once there is
+// a context
+#ifndef GL_FRAGMENT_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#endif
+#ifndef GL_VERTEX_SHADER
+#define GL_VERTEX_SHADER 0x8B31
+#endif
+#ifndef GL_COMPILE_STATUS
+#define GL_COMPILE_STATUS 0x8B81
+#endif
+#ifndef GL_LINK_STATUS
+#define GL_LINK_STATUS 0x8B82
+#endif
+#ifndef GL_CURRENT_PROGRAM
+#define GL_CURRENT_PROGRAM 0x8B8D
+#endif
+#ifndef GL_TEXTURE0
+#define GL_TEXTURE0 0x84C0
+#endif
+#ifndef GL_TEXTURE1
+#define GL_TEXTURE1 0x84C1
+#endif
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+#ifndef GL_R8
+#define GL_R8 0x8229
+#endif
+
+namespace {
+
+struct PaletteShader {
+    typedef GLuint (APIENTRY* CreateShaderFn)(GLenum);
+    typedef void (APIENTRY* ShaderSourceFn)(GLuint, GLsizei, const char* const*, const GLint*);
+    typedef void (APIENTRY* CompileShaderFn)(GLuint);
+    typedef void (APIENTRY* GetShaderivFn)(GLuint, GLenum, GLint*);
+    typedef void (APIENTRY* DeleteShaderFn)(GLuint);
+    typedef GLuint (APIENTRY* CreateProgramFn)(void);
+    typedef void (APIENTRY* AttachShaderFn)(GLuint, GLuint);
+    typedef void (APIENTRY* BindAttribLocationFn)(GLuint, GLuint, const char*);
+    typedef void (APIENTRY* LinkProgramFn)(GLuint);
+    typedef void (APIENTRY* GetProgramivFn)(GLuint, GLenum, GLint*);
+    typedef void (APIENTRY* DeleteProgramFn)(GLuint);
+    typedef void (APIENTRY* UseProgramFn)(GLuint);
+    typedef GLint (APIENTRY* GetUniformLocationFn)(GLuint, const char*);
+    typedef void (APIENTRY* GetUniformfvFn)(GLuint, GLint, GLfloat*);
+    typedef void (APIENTRY* Uniform1iFn)(GLint, GLint);
+    typedef void (APIENTRY* UniformMatrix4fvFn)(GLint, GLsizei, GLboolean, const GLfloat*);
+    typedef void (APIENTRY* ActiveTextureFn)(GLenum);
+    typedef void (APIENTRY* EnableVertexAttribArrayFn)(GLuint);
+    typedef void (APIENTRY* VertexAttribPointerFn)(GLuint, GLint, GLenum, GLboolean, GLsizei, const void*);
+
+    CreateShaderFn CreateShader = nullptr;
+    ShaderSourceFn ShaderSource = nullptr;
+    CompileShaderFn CompileShader = nullptr;
+    GetShaderivFn GetShaderiv = nullptr;
+    DeleteShaderFn DeleteShader = nullptr;
+    CreateProgramFn CreateProgram = nullptr;
+    AttachShaderFn AttachShader = nullptr;
+    BindAttribLocationFn BindAttribLocation = nullptr;
+    LinkProgramFn LinkProgram = nullptr;
+    GetProgramivFn GetProgramiv = nullptr;
+    DeleteProgramFn DeleteProgram = nullptr;
+    UseProgramFn UseProgram = nullptr;
+    GetUniformLocationFn GetUniformLocation = nullptr;
+    GetUniformfvFn GetUniformfv = nullptr;
+    Uniform1iFn Uniform1i = nullptr;
+    UniformMatrix4fvFn UniformMatrix4fv = nullptr;
+    ActiveTextureFn ActiveTexture = nullptr;
+    EnableVertexAttribArrayFn EnableVertexAttribArray = nullptr;
+    VertexAttribPointerFn VertexAttribPointer = nullptr;
+
+    bool Loaded = false;
+    bool Failed = false;
+
+    // The attributes are bound to fixed locations and pointed at the
+    // backend's vertex buffer when drawing, so that linking doesn't depend
+    // on the backend's program and can happen before anything is drawn
+    static constexpr GLuint POSITION = 0;
+    static constexpr GLuint UV = 1;
+    GLuint Program = 0;
+    GLint ProjMtx = -1;
+    GLint Indices = -1;
+    GLint Palette = -1;
+
+    template <typename T>
+    bool Load(T* fn, const char* name) {
+        *fn = reinterpret_cast<T>(SDL_GL_GetProcAddress(name));
+        return *fn != nullptr;
+    }
+
+    bool Available() {
+        if (!Loaded && !Failed) {
+            Loaded =
+                Load(&CreateShader, "glCreateShader") &&
+                Load(&ShaderSource, "glShaderSource") &&
+                Load(&CompileShader, "glCompileShader") &&
+                Load(&GetShaderiv, "glGetShaderiv") &&
+                Load(&DeleteShader, "glDeleteShader") &&
+                Load(&CreateProgram, "glCreateProgram") &&
+                Load(&AttachShader, "glAttachShader") &&
+                Load(&BindAttribLocation, "glBindAttribLocation") &&
+                Load(&LinkProgram, "glLinkProgram") &&
+                Load(&GetProgramiv, "glGetProgramiv") &&
+                Load(&DeleteProgram, "glDeleteProgram") &&
+                Load(&UseProgram, "glUseProgram") &&
+                Load(&GetUniformLocation, "glGetUniformLocation") &&
+                Load(&GetUniformfv, "glGetUniformfv") &&
+                Load(&Uniform1i, "glUniform1i") &&
+                Load(&UniformMatrix4fv, "glUniformMatrix4fv") &&
+                Load(&ActiveTexture, "glActiveTexture") &&
+                Load(&EnableVertexAttribArray, "glEnableVertexAttribArray") &&
+                Load(&VertexAttribPointer, "glVertexAttribPointer");
+            Failed = !Loaded;
+        }
+        return Loaded;
+    }
+
+    GLuint Compile(GLenum type, const char* source) {
+        GLuint shader = CreateShader(type);
+        ShaderSource(shader, 1, &source, nullptr);
+        CompileShader(shader);
+        GLint ok = 0;
+        GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if (!ok) {
+            DeleteShader(shader);
+            return 0;
+        }
+        return shader;
     }
-    static std::unordered_map<ImGuiID, GLuint> s_GLuints;
-    ImGuiID v = ImGui::GetID(label);
 
-    auto it = s_GLuints.find(v);
-    if (it != s_GLuints.end()) {
-        glDeleteTextures(1, &it->second);
+    // Loads, compiles and links on first use, true once the program is ready
+    bool Ready() {
+        if (Program != 0) {
+            return true;
+        }
+        if (!Available() || Failed) {
+            return false;
+        }
+
+        static const char* VERTEX =
+            "#version 330\n"
+            "uniform mat4 ProjMtx;\n"
+            "in vec2 Position;\n"
+            "in vec2 UV;\n"
+            "out vec2 Frag_UV;\n"
+            "void main() {\n"
+            "    Frag_UV = UV;\n"
+            "    gl_Position = ProjMtx * vec4(Position.xy, 0, 1);\n"
+            "}\n";
+        // texelFetch so that any scale comes out as exact nearest neighbor,
+        // the indices only ever have the low 6 bits set but mask anyway
+        static const char* FRAGMENT =
+            "#version 330\n"
+            "uniform sampler2D Indices;\n"
+            "uniform sampler2D Palette;\n"
+            "in vec2 Frag_UV;\n"
+            "out vec4 Out_Color;\n"
+            "void main() {\n"
+            "    ivec2 size = textureSize(Indices, 0);\n"
+            "    ivec2 p = clamp(ivec2(Frag_UV * vec2(size)), ivec2(0), size - 1);\n"
+            "    int i = int(texelFetch(Indices, p, 0).r * 255.0 + 0.5) & 63;\n"
+            "    Out_Color = vec4(texelFetch(Palette, ivec2(i, 0), 0).rgb, 1.0);\n"
+            "}\n";
+
+        GLuint vs = Compile(GL_VERTEX_SHADER, VERTEX);
+        GLuint fs = Compile(GL_FRAGMENT_SHADER, FRAGMENT);
+        if (vs == 0 || fs == 0) {
+            if (vs) DeleteShader(vs);
+            if (fs) DeleteShader(fs);
+            Failed = true;
+            return false;
+        }
+
+        GLuint program = CreateProgram();
+        AttachShader(program, vs);
+        AttachShader(program, fs);
+        BindAttribLocation(program, POSITION, "Position");
+        BindAttribLocation(program, UV, "UV");
+        LinkProgram(program);
+        DeleteShader(vs);
+        DeleteShader(fs);
+
+        GLint ok = 0;
+        GetProgramiv(program, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            DeleteProgram(program);
+            Failed = true;
+            return false;
+        }
+
+        Program = program;
+        ProjMtx = GetUniformLocation(Program, "ProjMtx");
+        Indices = GetUniformLocation(Program, "Indices");
+        Palette = GetUniformLocation(Program, "Palette");
+        return true;
+    }
+};
+
+PaletteShader s_PaletteShader;
+
+struct PaletteTexture {
+    GLuint Indices = 0;
+    GLuint Palette = 0;
+    int Width = 0;
+    int Height = 0;
+    uint64_t Generation = 0;
+    std::array<uint8_t, rgms::rgmui::PALETTE_MAT_ENTRIES * 3> Colors;
+    bool ColorsValid = false;
+};
+
+GLuint NewNearestTexture() {
+    GLuint tex = 0;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return tex;
+}
+
+// Runs during rendering, after the backend has set up its state (its program,
+// vertex array and the draw list's vertex buffer). Swaps in the palette
+// program with the backend's projection, the image quad that follows is then
+// drawn with the index texture on unit 0 as usual. ImDrawCallback_ResetRenderState
+// puts the backend's attributes back afterwards
+void UsePaletteShader(const ImDrawList*, const ImDrawCmd* cmd) {
+    const PaletteTexture* t = static_cast<const PaletteTexture*>(cmd->UserCallbackData);
+    PaletteShader& s = s_PaletteShader;
+
+    GLint backend = 0;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &backend);
+    GLfloat proj[16];
+    s.GetUniformfv(static_cast<GLuint>(backend),
+            s.GetUniformLocation(static_cast<GLuint>(backend), "ProjMtx"), proj);
+
+    s.UseProgram(s.Program);
+    s.EnableVertexAttribArray(PaletteShader::POSITION);
+    s.EnableVertexAttribArray(PaletteShader::UV);
+    s.VertexAttribPointer(PaletteShader::POSITION, 2, GL_FLOAT, GL_FALSE, sizeof(ImDrawVert),
+            reinterpret_cast<const void*>(offsetof(ImDrawVert, pos)));
+    s.VertexAttribPointer(PaletteShader::UV, 2, GL_FLOAT, GL_FALSE, sizeof(ImDrawVert),
+            reinterpret_cast<const void*>(offsetof(ImDrawVert, uv)));
+    s.UniformMatrix4fv(s.ProjMtx, 1, GL_FALSE, proj);
+    s.Uniform1i(s.Indices, 0);
+    s.Uniform1i(s.Palette, 1);
+    s.ActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, t->Palette);
+    s.ActiveTexture(GL_TEXTURE0);
+}
+
+}
+
+bool rgms::rgmui::PaletteMat(const char* label, const uint8_t* indices,
+        int width, int height, uint64_t generation,
+        const uint8_t* palette, float scale) {
+    if (!s_PaletteShader.Ready()) {
+        return false;
     }
 
-    GLuint q = 0;
-    glGenTextures(1, &q);
-    s_GLuints[v] = q;
-    glBindTexture(GL_TEXTURE_2D, q);
+    static std::unordered_map<ImGuiID, PaletteTexture> s_Textures;
+    PaletteTexture& t = s_Textures[ImGui::GetID(label)];
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    bool upload = generation == 0 || generation != t.Generation;
+    if (t.Indices == 0) {
+        t.Indices = NewNearestTexture();
+        t.Palette = NewNearestTexture();
+        upload = true;
+    }
 
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (!t.ColorsValid || !std::equal(t.Colors.begin(), t.Colors.end(), palette)) {
+        std::copy(palette, palette + t.Colors.size(), t.Colors.begin());
+        glBindTexture(GL_TEXTURE_2D, t.Palette);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, PALETTE_MAT_ENTRIES, 1, 0,
+                GL_RGB, GL_UNSIGNED_BYTE, t.Colors.data());
+        t.ColorsValid = true;
+    }
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img.cols, img.rows, 0,
-            GL_BGR, GL_UNSIGNED_BYTE, img.data);
+    if (upload) {
+        glBindTexture(GL_TEXTURE_2D, t.Indices);
+        if (width != t.Width || height != t.Height) {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0,
+                    GL_RED, GL_UNSIGNED_BYTE, indices);
+            t.Width = width;
+            t.Height = height;
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                    GL_RED, GL_UNSIGNED_BYTE, indices);
+        }
+        t.Generation = generation;
+    }
 
-    ImGui::Image(q, ImVec2(static_cast<float>(img.cols), static_cast<float>(img.rows)));
+    ImDrawList* list = ImGui::GetWindowDrawList();
+    list->AddCallback(UsePaletteShader, &t);
+    ImGui::Image(t.Indices, ImVec2(static_cast<float>(width) * scale,
+                static_cast<float>(height) * scale));
+    list->AddCallback(ImDrawCallback_ResetRenderState, nullptr);
+    return true;
 }
 
 
@@ -36,6 +36,7 @@
 #define RGMS_RGMUI_HEADER
 
 #include <thread>
+#include <array>
 #include <vector>
 #include <memory>
 #include <functional>
@@ -75,6 +76,13 @@ private:
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// WindowAppMainLoop only draws frames while something is happening. Call this
+// (from any thread) when something changed that was not an SDL event, like a
+// worker thread finishing, or an animation needing its next frame.
+void RequestRedraw();
+
+////////////////////////////////////////////////////////////////////////////////
+
 class IApplicationComponent;
 
 struct IApplicationConfig {
@@ -208,8 +216,24 @@ bool SliderFloatExt(const char* label, float* v, float min, float max,
         bool allowArrowKeys = true, bool allowMouseWheel = true,
         float singleMove = 0.10f, float shiftMult = 4.0f);
 
-// Display a cv mat
+// Display a cv mat (CV_8UC3). Each label keeps its texture, which is only
+// re-uploaded when generation changes (0 is always, for images that change
+// every frame anyway). Drawn at scale times the size of img, with nearest
+// filtering when scale is a whole number, so small images can be uploaded at
+// their native size and scaled by the gpu.
 void Mat(const char* label, const cv::Mat& img);
+void Mat(const char* label, const cv::Mat& img, uint64_t generation, float scale = 1.0f);
+// Display an image of palette indices (one byte per pixel, width * height
+// tightly packed) without expanding it on the cpu. The indices and the palette
+// (PALETTE_MAT_ENTRIES rgb triplets) are uploaded as textures and a shader does
+// the lookup. The indices are re-uploaded following the same generation rules
+// as Mat, the palette only when its contents change. Always nearest neighbor.
+// Returns false, drawing nothing, if the shader is not available (or doesn't
+// compile and link, which is checked before anything is queued) in which case
+// the caller should fall back to Mat.
+constexpr int PALETTE_MAT_ENTRIES = 64;
+bool PaletteMat(const char* label, const uint8_t* indices, int width, int height,
+        uint64_t generation, const uint8_t* palette, float scale = 1.0f);
 // Alternative mat api
 class MatAnnotator {
 public:
@@ -20,6 +20,9 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <atomic>
+#include <algorithm>
+
 #include "rgmui/rgmuimain.h"
 
 void rgms::rgmui::InitializeDefaultLogger(const std::string& name) {
@@ -62,19 +65,68 @@ void rgms::rgmui::LogAndDisplayException(const std::exception& e) {
     LogAndDisplayException(error);
 }
 
+// Frames to draw after an SDL event so that imgui can settle (hover states,
+// scrolling, windows resizing to their contents, etc)
+static constexpr int SETTLE_FRAMES = 3;
+
+static std::atomic<bool> s_RedrawRequested(false);
+static std::atomic<Uint32> s_RedrawEventType(0);
+
+void rgms::rgmui::RequestRedraw() {
+    if (!s_RedrawRequested.exchange(true)) {
+        Uint32 etype = s_RedrawEventType;
+        if (etype != 0) {
+            SDL_Event e;
+            SDL_zero(e);
+            e.type = etype;
+            SDL_PushEvent(&e); // wakes up SDL_WaitEventTimeout
+        }
+    }
+}
+
 void rgms::rgmui::WindowAppMainLoop(
         Window* window, IApplication* application,
-        util::mclock::duration minimumFrameDuration) {
+        util::mclock::duration minimumFrameDuration,
+        util::mclock::duration maximumIdleDuration) {
+    if (s_RedrawEventType == 0) {
+        Uint32 etype = SDL_RegisterEvents(1);
+        if (etype != static_cast<Uint32>(-1)) {
+            s_RedrawEventType = etype;
+        }
+    }
+
     SDL_Event e;
     bool running = true;
+    int framesToDraw = SETTLE_FRAMES;
+    auto onEvent = [&](const SDL_Event& ev) {
+        if (s_RedrawEventType != 0 && ev.type == s_RedrawEventType) {
+            return;
+        }
+        if (window) {
+            running &= window->OnSDLEvent(ev);
+        }
+        if (application) {
+            running &= application->OnSDLEventExternal(ev);
+        }
+        framesToDraw = SETTLE_FRAMES;
+    };
+
+    int idleMillis = static_cast<int>(util::ToMillis(maximumIdleDuration));
     while (running) {
-        while (SDL_PollEvent(&e) != 0) {
-            if (window) {
-                running &= window->OnSDLEvent(e);
-            }
-            if (application) {
-                running &= application->OnSDLEventExternal(e);
+        if (idleMillis > 0 && framesToDraw <= 0 && !s_RedrawRequested) {
+            if (SDL_WaitEventTimeout(&e, idleMillis) != 0) {
+                onEvent(e);
             }
+            framesToDraw = std::max(framesToDraw, 1);
+        }
+        while (SDL_PollEvent(&e) != 0) {
+            onEvent(e);
+        }
+        if (s_RedrawRequested.exchange(false)) {
+            framesToDraw = std::max(framesToDraw, 1);
+        }
+        if (!running) {
+            break;
         }
 
         auto start = util::Now();
@@ -88,6 +140,7 @@ void rgms::rgmui::WindowAppMainLoop(
             window->EndFrame();
         }
         auto end = util::Now();
+        framesToDraw--;
 
         auto elapsed = end - start;
         if (elapsed < minimumFrameDuration) {
@@ -45,9 +45,14 @@ void InitializeDefaultLogger(const std::string& name);
 void RedirectIO(); // only does stuff on windows
 void LogAndDisplayException(const std::string& s);
 void LogAndDisplayException(const std::exception& e);
+
+// When nothing is happening (no SDL events, no RequestRedraw) the loop sleeps
+// in SDL_WaitEventTimeout, drawing at least once per maximumIdleDuration.
+// A maximumIdleDuration of 0 draws continuously.
 void WindowAppMainLoop(
     Window* window, IApplication* application,
-    util::mclock::duration minimumFrameDuration = util::mclock::duration(0));
+    util::mclock::duration minimumFrameDuration = util::mclock::duration(0),
+    util::mclock::duration maximumIdleDuration = util::mclock::duration(0));
 
 
 
@@ -21,10 +21,22 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <cmath>
+#include <cstdlib>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
 
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "rgmutil/util.h"
 
 using namespace rgms::util;
@@ -251,10 +263,45 @@ void rgms::util::ForFileOfExtensionInDirectory(const std::string& directory,
     }
 }
 
+uint64_t rgms::util::FNV1a(const void* data, size_t size, uint64_t hash) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 bool rgms::util::FileExists(const std::string& path) {
     return fs::exists(path);
 }
 
+std::string rgms::util::UserCacheDirectory(const std::string& application) {
+    fs::path base;
+#ifdef _WIN32
+    if (const char* local = std::getenv("LOCALAPPDATA")) {
+        base = local;
+    }
+#else
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        base = xdg;
+    } else if (const char* home = std::getenv("HOME"); home && *home) {
+        base = fs::path(home) / ".cache";
+    }
+#endif
+    if (base.empty()) {
+        return "";
+    }
+
+    fs::path dir = base / application;
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        return "";
+    }
+    return dir.string();
+}
+
 int rgms::util::ReadFileToVector(const std::string& path, std::vector<uint8_t>* contents) {
     std::ifstream ifs(path, std::ios::in | std::ios::binary);
     if (!ifs.good()) {
@@ -282,6 +329,87 @@ std::string rgms::util::ReadFileToString(const std::string& path) {
     return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
 }
 
+MappedFile::MappedFile(const std::string& path, MappedFileAccess access)
+    : m_Data(nullptr)
+    , m_Size(0)
+    , m_Mapped(false)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, access == MappedFileAccess::RANDOM ?
+                FILE_FLAG_RANDOM_ACCESS : FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::invalid_argument("unable to open file");
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw std::invalid_argument("unable to stat file");
+    }
+    m_Size = static_cast<size_t>(size.QuadPart);
+    if (m_Size > 0) {
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr) {
+            void* p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (p != nullptr) {
+                m_Data = reinterpret_cast<const uint8_t*>(p);
+                m_Mapped = true;
+            }
+            CloseHandle(mapping); // the view keeps it open
+        }
+    }
+    CloseHandle(file);
+    if (m_Mapped || m_Size == 0) {
+        return;
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::invalid_argument("unable to open file");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::invalid_argument("unable to stat file");
+    }
+    m_Size = static_cast<size_t>(st.st_size);
+    if (m_Size > 0) {
+        void* p = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, m_Size, access == MappedFileAccess::RANDOM ?
+                    MADV_RANDOM : MADV_SEQUENTIAL);
+            m_Data = reinterpret_cast<const uint8_t*>(p);
+            m_Mapped = true;
+        }
+    }
+    close(fd);
+    if (m_Mapped || m_Size == 0) {
+        return;
+    }
+#endif
+    ReadFileToVector(path, &m_Buffer);
+    m_Data = m_Buffer.data();
+    m_Size = m_Buffer.size();
+}
+
+MappedFile::~MappedFile() {
+    if (m_Mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile(m_Data);
+#else
+        munmap(const_cast<uint8_t*>(m_Data), m_Size);
+#endif
+    }
+}
+
+const uint8_t* MappedFile::Data() const {
+    return m_Data;
+}
+
+size_t MappedFile::Size() const {
+    return m_Size;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 const std::vector<std::array<uint8_t, 3>>& rgms::util::GetColorMapColors(ColorMapType cmap) {
@@ -34,6 +34,7 @@
 #include <iostream>
 #include <string>
 #include <array>
+#include <vector>
 #include <cmath>
 #include <functional>
 #define _SILENCE_EXPERIMENTAL_FILESYSTEM_DEPRECATION_WARNING
@@ -671,6 +672,18 @@ inline std::istream& operator>>(std::istream& is, etype& e) {       \
     return is;                                                      \
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Hashing
+////////////////////////////////////////////////////////////////////////////////
+
+// 64 bit FNV-1a, for cache keys and such (not for anything adversarial)
+constexpr uint64_t FNV1A_OFFSET_BASIS = 14695981039346656037ULL;
+uint64_t FNV1a(const void* data, size_t size, uint64_t hash = FNV1A_OFFSET_BASIS);
+template <typename T>
+uint64_t FNV1aPOD(const T& v, uint64_t hash = FNV1A_OFFSET_BASIS) {
+    return FNV1a(&v, sizeof(T), hash);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // File system
 ////////////////////////////////////////////////////////////////////////////////
@@ -685,10 +698,40 @@ void ForFileOfExtensionInDirectory(const std::string& directory,
 
 bool FileExists(const std::string& path);
 
+// A per user directory for caches that can always be rebuilt, created if
+// necessary: $XDG_CACHE_HOME (or ~/.cache) or %LOCALAPPDATA%, then
+// application. Empty if there is no such place
+std::string UserCacheDirectory(const std::string& application);
+
 int ReadFileToVector(const std::string& path, std::vector<uint8_t>* contents);
 std::string ReadFileToString(const std::string& path);
 void WriteVectorToFile(const std::string& path, const std::vector<uint8_t>& contents);
 
+enum class MappedFileAccess {
+    SEQUENTIAL,
+    RANDOM,
+};
+
+// Read only view over the entire contents of a file. Memory mapped where the
+// platform allows, otherwise the file is read into an owned buffer. Access is
+// a hint for the kernel's readahead.
+class MappedFile {
+public:
+    MappedFile(const std::string& path, MappedFileAccess access = MappedFileAccess::SEQUENTIAL);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* Data() const;
+    size_t Size() const;
+
+private:
+    const uint8_t* m_Data;
+    size_t m_Size;
+    bool m_Mapped;
+    std::vector<uint8_t> m_Buffer;
+};
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
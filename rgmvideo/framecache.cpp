@@ -0,0 +1,379 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021-2021 FlibidyDibidy
+//
+// This file is part of Graphite.
+//
+// Graphite is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// Graphite is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Graphite; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+#include "fmt/core.h"
+
+#include "rgmvideo/framecache.h"
+
+using namespace rgms::video;
+
+static const char FRAME_CACHE_MAGIC[4] = {'G', 'F', 'C', 'H'};
+static const uint32_t FRAME_CACHE_VERSION = 3;
+
+// magic, version, width, height, jpeg quality, palette flag, number of frames,
+// offset of the frame table. Then the palette (if flagged), the frames, and
+// the table.
+static constexpr size_t FRAME_CACHE_HEADER_SIZE = 40;
+static constexpr size_t FRAME_CACHE_PALETTE_SIZE = QUANTIZE_PALETTE_ENTRIES * 3;
+
+std::string rgms::video::FrameCachePath(const std::string& videoPath,
+        const VideoCrop& crop, int jpegQuality, const PaletteQuantizer* quantizer) {
+    // Hashing all of a multi hour capture would take as long as decoding it,
+    // the size, write time and first megabyte are enough to notice a change
+    int64_t fileSize, fileWriteTime;
+    StatVideoFile(videoPath, &fileSize, &fileWriteTime);
+
+    uint64_t hash = util::FNV1aPOD(fileSize);
+    hash = util::FNV1aPOD(fileWriteTime, hash);
+
+    std::vector<char> head(1024 * 1024);
+    std::ifstream ifs(videoPath, std::ios::binary);
+    ifs.read(head.data(), head.size());
+    hash = util::FNV1a(head.data(), static_cast<size_t>(ifs.gcount()), hash);
+
+    hash = util::FNV1aPOD(crop.CropRect.X, hash);
+    hash = util::FNV1aPOD(crop.CropRect.Y, hash);
+    hash = util::FNV1aPOD(crop.CropRect.Width, hash);
+    hash = util::FNV1aPOD(crop.CropRect.Height, hash);
+    hash = util::FNV1aPOD(crop.OutWidth, hash);
+    hash = util::FNV1aPOD(crop.OutHeight, hash);
+    hash = util::FNV1aPOD(quantizer ? 0 : jpegQuality, hash);
+    if (quantizer) {
+        hash = util::FNV1a(quantizer->Palette(), FRAME_CACHE_PALETTE_SIZE, hash);
+    }
+
+    std::string dir = VideoCacheDirectory("framecache");
+    if (dir.empty()) {
+        return "";
+    }
+    // The name of the video is only there to make the directory browsable
+    std::string name = fmt::format("{}.{:016x}.gfc",
+            util::fs::path(videoPath).stem().string(), hash);
+    return (util::fs::path(dir) / name).string();
+}
+
+// A transcode writes continuously, so a temporary file this old belongs to one
+// that is no longer running (and not to another instance that still is)
+static constexpr std::chrono::minutes FRAME_CACHE_STALE_TEMP_AGE(10);
+
+void rgms::video::TrimFrameCacheDirectory(const std::string& directory,
+        uint64_t budgetBytes, const std::string& keepPath) {
+    struct CacheFile {
+        util::fs::path Path;
+        util::fs::file_time_type LastUsed;
+        uint64_t Size;
+    };
+    std::vector<CacheFile> caches;
+    uint64_t total = 0;
+    auto now = util::fs::file_time_type::clock::now();
+
+    std::error_code ec;
+    for (util::fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        const util::fs::path& p = it->path();
+        std::error_code fec;
+        if (!util::fs::is_regular_file(p, fec)) {
+            continue;
+        }
+        CacheFile f;
+        f.Path = p;
+        f.LastUsed = util::fs::last_write_time(p, fec);
+        f.Size = util::fs::file_size(p, fec);
+        if (fec) {
+            continue;
+        }
+        if (p.extension() == ".tmp") {
+            if (now - f.LastUsed > FRAME_CACHE_STALE_TEMP_AGE) {
+                util::fs::remove(p, fec);
+            }
+        } else if (p.extension() == ".gfc") {
+            total += f.Size;
+            if (p.string() != keepPath) {
+                caches.push_back(f);
+            }
+        }
+    }
+
+    std::sort(caches.begin(), caches.end(), [](const CacheFile& a, const CacheFile& b){
+        return a.LastUsed < b.LastUsed;
+    });
+    for (auto & f : caches) {
+        if (total <= budgetBytes) {
+            break;
+        }
+        std::error_code fec;
+        if (util::fs::remove(f.Path, fec)) {
+            total -= f.Size;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+static void WritePOD(std::ofstream& ofs, const T& v) {
+    ofs.write(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+FrameCacheWriter::FrameCacheWriter(const std::string& path, int width, int height,
+        int jpegQuality, const PaletteQuantizer* quantizer)
+    : m_Path(path)
+    , m_TempPath(path + ".tmp")
+    , m_Width(width)
+    , m_Height(height)
+    , m_JpegQuality(quantizer ? 0 : jpegQuality)
+    , m_Quantizer(quantizer)
+    , m_Finished(false)
+    , m_File(m_TempPath, std::ios::binary | std::ios::trunc)
+    , m_Offset(FRAME_CACHE_HEADER_SIZE)
+{
+    if (!m_File.good()) {
+        throw std::runtime_error(fmt::format("unable to write frame cache '{}'", m_TempPath));
+    }
+    if (m_Width <= 0 || m_Height <= 0) {
+        throw std::invalid_argument("invalid frame cache dimensions");
+    }
+    std::vector<char> header(FRAME_CACHE_HEADER_SIZE, 0); // filled in by Finish
+    m_File.write(header.data(), header.size());
+    if (m_Quantizer) {
+        m_File.write(reinterpret_cast<const char*>(m_Quantizer->Palette()), FRAME_CACHE_PALETTE_SIZE);
+        m_Offset += FRAME_CACHE_PALETTE_SIZE;
+    }
+}
+
+FrameCacheWriter::~FrameCacheWriter() {
+    if (!m_Finished) {
+        m_File.close();
+        std::error_code ec;
+        util::fs::remove(m_TempPath, ec);
+    }
+}
+
+void FrameCacheWriter::AddFrame(const uint8_t* bgr, int64_t ptsMilliseconds) {
+    Entry entry;
+    entry.PtsMilliseconds = ptsMilliseconds;
+    entry.Offset = m_Offset;
+    if (m_Quantizer) {
+        m_Encoded.resize(static_cast<size_t>(m_Width) * m_Height);
+        m_Quantizer->QuantizeBGR(bgr, m_Encoded.size(), m_Encoded.data());
+        m_File.write(reinterpret_cast<const char*>(m_Encoded.data()), m_Encoded.size());
+        entry.Size = m_Encoded.size();
+    } else if (m_JpegQuality > 0) {
+        cv::Mat m(m_Height, m_Width, CV_8UC3, const_cast<uint8_t*>(bgr));
+        cv::imencode(".jpg", m, m_Encoded, {cv::IMWRITE_JPEG_QUALITY, m_JpegQuality});
+        m_File.write(reinterpret_cast<const char*>(m_Encoded.data()), m_Encoded.size());
+        entry.Size = m_Encoded.size();
+    } else {
+        entry.Size = static_cast<uint64_t>(m_Width) * m_Height * 3;
+        m_File.write(reinterpret_cast<const char*>(bgr), entry.Size);
+    }
+    if (!m_File.good()) {
+        throw std::runtime_error(fmt::format("unable to write frame cache '{}'", m_TempPath));
+    }
+    m_Offset += entry.Size;
+    m_Entries.push_back(entry);
+}
+
+void FrameCacheWriter::Finish() {
+    for (auto & entry : m_Entries) {
+        WritePOD(m_File, entry.PtsMilliseconds);
+        WritePOD(m_File, entry.Offset);
+        WritePOD(m_File, entry.Size);
+    }
+
+    m_File.seekp(0);
+    m_File.write(FRAME_CACHE_MAGIC, sizeof(FRAME_CACHE_MAGIC));
+    WritePOD(m_File, FRAME_CACHE_VERSION);
+    WritePOD(m_File, static_cast<int32_t>(m_Width));
+    WritePOD(m_File, static_cast<int32_t>(m_Height));
+    WritePOD(m_File, static_cast<int32_t>(m_JpegQuality));
+    WritePOD(m_File, static_cast<uint32_t>(m_Quantizer ? 1 : 0));
+    WritePOD(m_File, static_cast<uint64_t>(m_Entries.size()));
+    WritePOD(m_File, m_Offset);
+    m_File.close();
+    if (m_File.fail()) {
+        throw std::runtime_error(fmt::format("unable to write frame cache '{}'", m_TempPath));
+    }
+
+    util::fs::rename(m_TempPath, m_Path);
+    m_Finished = true;
+}
+
+uint64_t FrameCacheWriter::BytesWritten() const {
+    return m_Offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+static T ReadPOD(const uint8_t* data) {
+    T v;
+    std::memcpy(&v, data, sizeof(T));
+    return v;
+}
+
+static constexpr size_t FRAME_CACHE_ENTRY_SIZE = 24;
+
+std::shared_ptr<FrameCache> FrameCache::Open(const std::string& path) {
+    if (!util::FileExists(path)) {
+        return nullptr;
+    }
+    std::shared_ptr<FrameCache> cache;
+    try {
+        cache = std::shared_ptr<FrameCache>(new FrameCache(path));
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+    // Write time rather than access time, which is often not kept
+    std::error_code ec;
+    util::fs::last_write_time(path, util::fs::file_time_type::clock::now(), ec);
+    return cache;
+}
+
+FrameCache::FrameCache(const std::string& path)
+    : m_File(path, util::MappedFileAccess::RANDOM)
+    , m_Width(0)
+    , m_Height(0)
+    , m_JpegQuality(0)
+    , m_NumFrames(0)
+    , m_TableOffset(0)
+{
+    const uint8_t* d = m_File.Data();
+    size_t size = m_File.Size();
+    if (size < FRAME_CACHE_HEADER_SIZE ||
+            std::memcmp(d, FRAME_CACHE_MAGIC, sizeof(FRAME_CACHE_MAGIC)) != 0 ||
+            ReadPOD<uint32_t>(d + 4) != FRAME_CACHE_VERSION) {
+        throw std::runtime_error("not a frame cache");
+    }
+    m_Width = ReadPOD<int32_t>(d + 8);
+    m_Height = ReadPOD<int32_t>(d + 12);
+    m_JpegQuality = ReadPOD<int32_t>(d + 16);
+    bool hasPalette = ReadPOD<uint32_t>(d + 20) != 0;
+    uint64_t numFrames = ReadPOD<uint64_t>(d + 24);
+    m_TableOffset = ReadPOD<uint64_t>(d + 32);
+    size_t framesOffset = FRAME_CACHE_HEADER_SIZE + (hasPalette ? FRAME_CACHE_PALETTE_SIZE : 0);
+    if (m_Width <= 0 || m_Height <= 0 || m_TableOffset < framesOffset ||
+            m_TableOffset > size ||
+            numFrames != (size - m_TableOffset) / FRAME_CACHE_ENTRY_SIZE ||
+            (size - m_TableOffset) % FRAME_CACHE_ENTRY_SIZE != 0) {
+        throw std::runtime_error("damaged frame cache");
+    }
+    m_NumFrames = static_cast<int64_t>(numFrames);
+    if (hasPalette) {
+        m_Quantizer = std::make_unique<PaletteQuantizer>(d + FRAME_CACHE_HEADER_SIZE);
+    }
+
+    uint64_t frameSize = static_cast<uint64_t>(m_Width) * m_Height * (hasPalette ? 1 : 3);
+    for (int64_t i = 0; i < m_NumFrames; i++) {
+        Entry entry;
+        GetEntry(i, &entry);
+        if (entry.Offset < framesOffset || entry.Offset > m_TableOffset ||
+                entry.Size > m_TableOffset - entry.Offset ||
+                ((hasPalette || m_JpegQuality <= 0) && entry.Size != frameSize)) {
+            throw std::runtime_error("damaged frame cache");
+        }
+    }
+}
+
+FrameCache::~FrameCache() {
+}
+
+int FrameCache::Width() const {
+    return m_Width;
+}
+
+int FrameCache::Height() const {
+    return m_Height;
+}
+
+int64_t FrameCache::NumFrames() const {
+    return m_NumFrames;
+}
+
+bool FrameCache::GetEntry(int64_t frameIndex, Entry* entry) const {
+    if (frameIndex < 0 || frameIndex >= m_NumFrames) {
+        return false;
+    }
+    const uint8_t* p = m_File.Data() + m_TableOffset + frameIndex * FRAME_CACHE_ENTRY_SIZE;
+    entry->PtsMilliseconds = ReadPOD<int64_t>(p);
+    entry->Offset = ReadPOD<uint64_t>(p + 8);
+    entry->Size = ReadPOD<uint64_t>(p + 16);
+    return true;
+}
+
+int64_t FrameCache::PtsMilliseconds(int64_t frameIndex) const {
+    Entry entry;
+    if (!GetEntry(frameIndex, &entry)) {
+        return 0;
+    }
+    return entry.PtsMilliseconds;
+}
+
+const uint8_t* FrameCache::RawFrame(int64_t frameIndex) const {
+    Entry entry;
+    if (m_Quantizer || m_JpegQuality > 0 || !GetEntry(frameIndex, &entry)) {
+        return nullptr;
+    }
+    return m_File.Data() + entry.Offset;
+}
+
+const PaletteQuantizer* FrameCache::Quantizer() const {
+    return m_Quantizer.get();
+}
+
+const uint8_t* FrameCache::PaletteFrame(int64_t frameIndex) const {
+    Entry entry;
+    if (!m_Quantizer || !GetEntry(frameIndex, &entry)) {
+        return nullptr;
+    }
+    return m_File.Data() + entry.Offset;
+}
+
+bool FrameCache::DecodeFrame(int64_t frameIndex, uint8_t* buffer) const {
+    Entry entry;
+    if (!GetEntry(frameIndex, &entry)) {
+        return false;
+    }
+    const uint8_t* data = m_File.Data() + entry.Offset;
+    if (m_Quantizer) {
+        m_Quantizer->ExpandBGR(data, entry.Size, buffer);
+        return true;
+    }
+    if (m_JpegQuality <= 0) {
+        std::memcpy(buffer, data, entry.Size);
+        return true;
+    }
+
+    cv::Mat encoded(1, static_cast<int>(entry.Size), CV_8UC1, const_cast<uint8_t*>(data));
+    cv::Mat dst(m_Height, m_Width, CV_8UC3, buffer);
+    cv::imdecode(encoded, cv::IMREAD_COLOR, &dst);
+    if (dst.rows != m_Height || dst.cols != m_Width || dst.type() != CV_8UC3) {
+        return false;
+    }
+    if (dst.data != buffer) {
+        std::memcpy(buffer, dst.data, static_cast<size_t>(m_Width) * m_Height * 3);
+    }
+    return true;
+}
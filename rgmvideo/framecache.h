@@ -0,0 +1,137 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021-2021 FlibidyDibidy
+//
+// This file is part of Graphite.
+//
+// Graphite is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// Graphite is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Graphite; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RGMS_FRAMECACHE_HEADER
+#define RGMS_FRAMECACHE_HEADER
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <vector>
+#include <fstream>
+
+#include "rgmutil/util.h"
+#include "rgmvideo/video.h"
+#include "rgmvideo/quantize.h"
+
+namespace rgms::video {
+
+// The frames of a video exactly as the ui uses them (already cropped and
+// scaled) along with their timestamps, transcoded once in the background and
+// then read through a memory map. Any frame is then a page fault away rather
+// than a seek and a GOP of decoding.
+//
+// Frames are stored raw, or given a PaletteQuantizer as one byte per pixel of
+// NES palette index (see quantize.h) which is a third of the size of raw and
+// can be compared directly against emulator frames. Jpegs are much smaller
+// still but lossy, and only used when a quality is explicitly given.
+
+// In the "framecache" directory of util::UserCacheDirectory, keyed by a hash
+// of the video file and the crop settings. Empty if there is no such directory
+std::string FrameCachePath(const std::string& videoPath, const VideoCrop& crop, int jpegQuality,
+        const PaletteQuantizer* quantizer = nullptr);
+
+// Keeps the caches in directory (see FrameCachePath) within budgetBytes by
+// removing the least recently used ones, never keepPath. Temporary files left
+// by a transcode that was killed or crashed are removed as well.
+void TrimFrameCacheDirectory(const std::string& directory, uint64_t budgetBytes,
+        const std::string& keepPath = "");
+
+// Written to path + ".tmp" which is moved into place by Finish, so that an
+// interrupted transcode is never mistaken for a complete one
+class FrameCacheWriter {
+public:
+    // quantizer (if given) must outlive the writer, and jpegQuality is ignored
+    FrameCacheWriter(const std::string& path, int width, int height, int jpegQuality,
+            const PaletteQuantizer* quantizer = nullptr);
+    ~FrameCacheWriter();
+
+    void AddFrame(const uint8_t* bgr, int64_t ptsMilliseconds);
+    void Finish();
+
+    uint64_t BytesWritten() const;
+
+private:
+    struct Entry {
+        int64_t PtsMilliseconds;
+        uint64_t Offset;
+        uint64_t Size;
+    };
+
+    std::string m_Path;
+    std::string m_TempPath;
+    int m_Width;
+    int m_Height;
+    int m_JpegQuality;
+    const PaletteQuantizer* m_Quantizer;
+    bool m_Finished;
+
+    std::ofstream m_File;
+    uint64_t m_Offset;
+    std::vector<Entry> m_Entries;
+    std::vector<uint8_t> m_Encoded;
+};
+
+class FrameCache {
+public:
+    // nullptr if the cache is missing or damaged. Marks the cache as recently
+    // used for TrimFrameCacheDirectory
+    static std::shared_ptr<FrameCache> Open(const std::string& path);
+    ~FrameCache();
+
+    int Width() const;
+    int Height() const;
+    int64_t NumFrames() const;
+    int64_t PtsMilliseconds(int64_t frameIndex) const;
+
+    // Points into the mapping, nullptr unless frames are stored raw
+    const uint8_t* RawFrame(int64_t frameIndex) const;
+    // Points into the mapping, nullptr unless frames are stored as palette
+    // indices. Width() * Height() bytes as PaletteQuantizer produces them
+    const uint8_t* PaletteFrame(int64_t frameIndex) const;
+    const PaletteQuantizer* Quantizer() const; // of the stored palette, or nullptr
+    // buffer must be Width() * Height() * 3
+    bool DecodeFrame(int64_t frameIndex, uint8_t* buffer) const;
+
+private:
+    FrameCache(const std::string& path);
+
+    struct Entry {
+        int64_t PtsMilliseconds;
+        uint64_t Offset;
+        uint64_t Size;
+    };
+    bool GetEntry(int64_t frameIndex, Entry* entry) const;
+
+private:
+    util::MappedFile m_File;
+    int m_Width;
+    int m_Height;
+    int m_JpegQuality;
+    std::unique_ptr<PaletteQuantizer> m_Quantizer; // when stored as palette indices
+    int64_t m_NumFrames;
+    uint64_t m_TableOffset;
+};
+
+}
+
+#endif
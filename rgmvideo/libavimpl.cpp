@@ -22,6 +22,8 @@
 
 #include <sstream>
 #include <cassert>
+#include <algorithm>
+#include <cstring>
 
 #include "fmt/core.h"
 
@@ -37,22 +39,187 @@ std::string rgms::video::AVStringError(int retcode) {
 }
 
 LibAVVideoSource::LibAVVideoSource(const std::string& input)
+    : LibAVVideoSource(input, VideoCrop{util::Rect2F(0, 0, 0, 0), 0, 0})
+{
+}
+
+LibAVVideoSource::LibAVVideoSource(const std::string& input, const VideoCrop& crop,
+        int decoderThreads, IVideoIndexerPtr indexer)
     : m_Input(input) 
     , m_AVFormatContext(nullptr)
     , m_AVCodecContext(nullptr)
     , m_SwsContext(nullptr)
     , m_Picture(nullptr)
-    , m_BGRPicture(nullptr)
-    , m_Buffer(nullptr) 
-    , m_InputIndex(-1) {
+    , m_Packet(nullptr)
+    , m_InputIndex(-1)
+    , m_DecoderThreads(decoderThreads)
+    , m_HasCrop(crop.OutWidth > 0 && crop.OutHeight > 0)
+    , m_Crop(crop)
+    , m_CropVisible(false)
+    , m_SkipBeforeTimestamp(AV_NOPTS_VALUE)
+    , m_Indexer(indexer) {
     av_log_set_level(AV_LOG_ERROR);
     Open();
+
+    if (!m_Indexer && util::fs::is_regular_file(m_Input)) {
+        m_Indexer = std::make_shared<LibAVVideoIndexer>(m_Input);
+    }
 }
 
 LibAVVideoSource::~LibAVVideoSource() {
     Close();
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+LibAVVideoIndexer::LibAVVideoIndexer(const std::string& input)
+    : m_Input(input)
+    , m_IndexShouldStop(false)
+{
+    VideoIndex index;
+    if (ReadVideoIndexFile(m_Input, &index)) {
+        m_Index = std::make_shared<const VideoIndex>(std::move(index));
+    } else {
+        m_IndexThread = std::thread(&LibAVVideoIndexer::IndexThread, this);
+    }
+}
+
+LibAVVideoIndexer::~LibAVVideoIndexer() {
+    m_IndexShouldStop = true;
+    if (m_IndexThread.joinable()) {
+        m_IndexThread.join();
+    }
+}
+
+static int IndexInterruptCallback(void* opaque) {
+    return *reinterpret_cast<std::atomic<bool>*>(opaque) ? 1 : 0;
+}
+
+// Only demuxes (no decoding) so this is quick compared to reading the video.
+// Every packet is a frame, so sorting the packet timestamps gives the same
+// order that frames are returned from Get.
+void LibAVVideoIndexer::IndexThread() {
+    AVFormatContext* ctx = avformat_alloc_context();
+    if (!ctx) {
+        return;
+    }
+    ctx->interrupt_callback.callback = IndexInterruptCallback;
+    ctx->interrupt_callback.opaque = &m_IndexShouldStop;
+    if (avformat_open_input(&ctx, m_Input.c_str(), nullptr, nullptr) != 0) {
+        return; // ctx is freed on failure
+    }
+
+    int streamIndex = -1;
+    AVRational timeBase{0, 1};
+    if (avformat_find_stream_info(ctx, nullptr) >= 0) {
+        for (int i = 0; i < ctx->nb_streams; i++) {
+            if (streamIndex == -1 && ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+                streamIndex = i;
+                timeBase = ctx->streams[i]->time_base;
+            } else {
+                ctx->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+    }
+
+    std::vector<std::pair<int64_t, bool>> frames;
+    bool ok = streamIndex >= 0 && timeBase.num > 0 && timeBase.den > 0;
+    AVPacket* packet = av_packet_alloc();
+    while (ok && !m_IndexShouldStop) {
+        int ret = av_read_frame(ctx, packet);
+        if (ret == AVERROR(EAGAIN)) {
+            continue;
+        } else if (ret == AVERROR_EOF) {
+            break;
+        } else if (ret != 0) {
+            ok = false;
+        } else if (packet->stream_index == streamIndex) {
+            if (packet->pts == AV_NOPTS_VALUE) {
+                ok = false; // can not seek by timestamp
+            } else {
+                frames.emplace_back(packet->pts, (packet->flags & AV_PKT_FLAG_KEY) != 0);
+            }
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&ctx);
+
+    if (!ok || m_IndexShouldStop || frames.empty()) {
+        return;
+    }
+
+    std::sort(frames.begin(), frames.end());
+    VideoIndex index;
+    StatVideoFile(m_Input, &index.FileSize, &index.FileWriteTime);
+    index.TimeBaseNumerator = timeBase.num;
+    index.TimeBaseDenominator = timeBase.den;
+    index.Timestamps.reserve(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+        index.Timestamps.push_back(frames[i].first);
+        if (frames[i].second) {
+            index.Keyframes.push_back(static_cast<int64_t>(i));
+        }
+    }
+
+    try {
+        WriteVideoIndexFile(m_Input, index);
+    } catch (const std::exception&) {
+        // Read only directory or similar, still useful for this session
+    }
+
+    std::lock_guard<std::mutex> lock(m_IndexMutex);
+    m_Index = std::make_shared<const VideoIndex>(std::move(index));
+}
+
+std::shared_ptr<const VideoIndex> LibAVVideoIndexer::GetIndex() {
+    std::lock_guard<std::mutex> lock(m_IndexMutex);
+    return m_Index;
+}
+
+bool rgms::video::LibAVProbeVideoFile(const std::string& input, int* width, int* height) {
+    av_log_set_level(AV_LOG_ERROR);
+    AVFormatContext* ctx = nullptr;
+    if (avformat_open_input(&ctx, input.c_str(), nullptr, nullptr) != 0) {
+        return false;
+    }
+    bool found = false;
+    if (avformat_find_stream_info(ctx, nullptr) >= 0) {
+        for (unsigned int i = 0; i < ctx->nb_streams && !found; i++) {
+            const AVCodecParameters* par = ctx->streams[i]->codecpar;
+            if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+                *width = par->width;
+                *height = par->height;
+                found = true;
+            }
+        }
+    }
+    avformat_close_input(&ctx);
+    return found;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<const VideoIndex> LibAVVideoSource::GetIndex() {
+    return m_Indexer ? m_Indexer->GetIndex() : nullptr;
+}
+
+bool LibAVVideoSource::SeekToKeyframe(int64_t keyframeIndex) {
+    std::shared_ptr<const VideoIndex> index = GetIndex();
+    if (!index || m_AVFormatContext == nullptr || m_AVCodecContext == nullptr ||
+        keyframeIndex < 0 || keyframeIndex >= static_cast<int64_t>(index->Timestamps.size())) {
+        return false;
+    }
+    int64_t ts = index->Timestamps[keyframeIndex];
+    int ret = av_seek_frame(m_AVFormatContext, m_InputIndex, ts, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        return false;
+    }
+    avcodec_flush_buffers(m_AVCodecContext);
+    m_SkipBeforeTimestamp = ts;
+    return true;
+}
+
 static int InterruptCallback(void* opaque) {
     return 0;
 }
@@ -101,6 +268,10 @@ void LibAVVideoSource::Open() {
 
         const AVCodec* codec = avcodec_find_decoder(avctx->codec_id);
         if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (m_DecoderThreads != 1) {
+                avctx->thread_count = std::max(m_DecoderThreads, 0);
+                avctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            }
             ret = avcodec_open2(avctx, codec, nullptr);
             if (ret != 0) return ReportError("avcodec_open2", ret, ErrorState::CAN_NOT_OPEN_SOURCE);
 
@@ -110,18 +281,25 @@ void LibAVVideoSource::Open() {
             uint32_t width = avctx->width;
             uint32_t height = avctx->height;
 
+            m_Picture = av_frame_alloc();
+            m_Packet = av_packet_alloc();
+            if (m_HasCrop) {
+                // Only the visible part of the crop is scaled, into its spot
+                // in the otherwise zeroed output
+                m_CropVisible = CropGeometry(width, height, m_Crop, &m_CropSrc, &m_CropDst);
+                m_NumBytes = av_image_get_buffer_size(AV_PIX_FMT_BGR24, m_Crop.OutWidth, m_Crop.OutHeight, 1);
+                if (m_CropVisible) {
+                    m_SwsContext = sws_getContext(m_CropSrc.width, m_CropSrc.height, m_AVCodecContext->pix_fmt,
+                            m_CropDst.width, m_CropDst.height, AV_PIX_FMT_BGR24,
+                            SWS_AREA, NULL, NULL, NULL);
+                }
+                break;
+            }
+
             m_SwsContext = sws_getContext(width, height, m_AVCodecContext->pix_fmt,
                     width, height, AV_PIX_FMT_BGR24,
                     SWS_BICUBIC, NULL, NULL, NULL);
-
-            m_Picture = av_frame_alloc();
-            m_BGRPicture = av_frame_alloc();
             m_NumBytes = av_image_get_buffer_size(AV_PIX_FMT_BGR24, width, height, 1);
-            m_Buffer = (uint8_t *) av_malloc(m_NumBytes * sizeof(uint8_t));
-
-            av_image_fill_arrays(
-                    m_BGRPicture->data, m_BGRPicture->linesize,
-                    m_Buffer, AV_PIX_FMT_BGR24, width, height, 1);
             break;
         } else {
             avcodec_free_context(&avctx);
@@ -135,6 +313,13 @@ void LibAVVideoSource::Open() {
 
     m_Information = fmt::format("LibAVInput: {}\n{}x{}", m_Input,
             Width(), Height());
+    if (m_HasCrop && m_AVCodecContext) {
+        m_Information += fmt::format("\ncropped from {}x{}",
+                m_AVCodecContext->width, m_AVCodecContext->height);
+    }
+    if (m_AVCodecContext && m_AVCodecContext->thread_count != 1) {
+        m_Information += fmt::format("\ndecoder threads: {}", m_AVCodecContext->thread_count);
+    }
 }
 
 void LibAVVideoSource::Close() {
@@ -155,19 +340,17 @@ void LibAVVideoSource::Close() {
         av_frame_free(&m_Picture);
         m_Picture = nullptr;
     }
-    if (m_BGRPicture) {
-        av_frame_unref(m_BGRPicture);
-        av_frame_free(&m_BGRPicture);
-        m_BGRPicture = nullptr;
-    }
-    if (m_Buffer) {
-        av_free(m_Buffer);
-        m_Buffer = nullptr;
+    if (m_Packet) {
+        av_packet_free(&m_Packet);
+        m_Packet = nullptr;
     }
     m_InputIndex = -1;
 }
 
 int LibAVVideoSource::Width() const {
+    if (m_HasCrop) {
+        return m_Crop.OutWidth;
+    }
     if (m_AVCodecContext) {
         return m_AVCodecContext->width;
     }
@@ -175,6 +358,9 @@ int LibAVVideoSource::Width() const {
 }
 
 int LibAVVideoSource::Height() const {
+    if (m_HasCrop) {
+        return m_Crop.OutHeight;
+    }
     if (m_AVCodecContext) {
         return m_AVCodecContext->height;
     }
@@ -184,7 +370,8 @@ int LibAVVideoSource::Height() const {
 GetResult LibAVVideoSource::Get(uint8_t* buffer, int64_t* ptsMilliseconds) {
     if (m_AVFormatContext == nullptr ||
         m_AVCodecContext == nullptr ||
-        m_SwsContext == nullptr ||
+        m_Picture == nullptr ||
+        (m_SwsContext == nullptr && (!m_HasCrop || m_CropVisible)) ||
         m_InputIndex < 0) {
         if (m_LastError == "") {
             m_LastError = "[ERROR] in LibAVVideoSource::Get\n  Input is not open?";
@@ -196,46 +383,81 @@ GetResult LibAVVideoSource::Get(uint8_t* buffer, int64_t* ptsMilliseconds) {
         return GetResult::FAILURE;
     }
 
-    AVPacket* packet = av_packet_alloc();
-    double pts = 0;
+    // A threaded decoder holds on to several packets before producing frames,
+    // so feed it until a frame comes out, and drain it at the end of the input
+    AVPacket* packet = m_Packet;
+    int ret = 0;
+    while (true) {
+        ret = avcodec_receive_frame(m_AVCodecContext, m_Picture);
+        if (ret == 0) {
+            if (m_SkipBeforeTimestamp != AV_NOPTS_VALUE) {
+                if (m_Picture->pts != AV_NOPTS_VALUE && m_Picture->pts < m_SkipBeforeTimestamp) {
+                    continue; // a leading frame from before the keyframe
+                }
+                m_SkipBeforeTimestamp = AV_NOPTS_VALUE;
+            }
+            break;
+        } else if (ret == AVERROR_EOF) {
+            ReportError("avcodec_receive_frame", ret, ErrorState::INPUT_EXHAUSTED);
+            return GetResult::FAILURE;
+        } else if (ret != AVERROR(EAGAIN)) {
+            ReportError("avcodec_receive_frame", ret, ErrorState::OTHER_ERROR);
+            return GetResult::FAILURE;
+        }
 
-    int gotFrame = 0;
-    int ret = av_read_frame(m_AVFormatContext, packet);
-    if (ret == AVERROR(EAGAIN)) return GetResult::AGAIN;
-    if (ret != 0) {
-        ErrorState es = ErrorState::OTHER_ERROR;
+        ret = av_read_frame(m_AVFormatContext, packet);
+        if (ret == AVERROR(EAGAIN)) return GetResult::AGAIN;
         if (ret == AVERROR_EOF) {
-            es = ErrorState::INPUT_EXHAUSTED;
+            avcodec_send_packet(m_AVCodecContext, nullptr); // start draining
+            continue;
         }
-        ReportError("av_read_frame", ret, es);
-        return GetResult::FAILURE;
+        if (ret != 0) {
+            ReportError("av_read_frame", ret, ErrorState::OTHER_ERROR);
+            return GetResult::FAILURE;
+        }
+        if (packet->stream_index == m_InputIndex) {
+            avcodec_send_packet(m_AVCodecContext, packet);
+        }
+        av_packet_unref(packet);
     }
 
-    if (packet->stream_index == m_InputIndex) {
-        ret = avcodec_send_packet(m_AVCodecContext, packet);
-
-        ret = avcodec_receive_frame(m_AVCodecContext, m_Picture);
-        if (ret == 0) {
-            pts = m_Picture->pts * av_q2d(m_AVFormatContext->streams[m_InputIndex]->time_base);
-            *ptsMilliseconds = static_cast<int64_t>(std::round(pts * 1000));
-
-            sws_scale(m_SwsContext, (const uint8_t* const *) m_Picture->data,
-                    m_Picture->linesize, 0, Height(), m_BGRPicture->data,
-                    m_BGRPicture->linesize);
-
-            memcpy(buffer, m_Buffer, m_NumBytes);
-            gotFrame = 1;
+    double pts = m_Picture->pts * av_q2d(m_AVFormatContext->streams[m_InputIndex]->time_base);
+    *ptsMilliseconds = static_cast<int64_t>(std::round(pts * 1000));
+
+    // Scale straight into the callers buffer
+    uint8_t* dstData[4];
+    int dstLinesize[4];
+    av_image_fill_arrays(dstData, dstLinesize, buffer, AV_PIX_FMT_BGR24,
+            Width(), Height(), 1);
+
+    if (!m_HasCrop) {
+        sws_scale(m_SwsContext, (const uint8_t* const *) m_Picture->data,
+                m_Picture->linesize, 0, Height(), dstData, dstLinesize);
+    } else if (m_CropVisible &&
+            m_Picture->width >= m_CropSrc.x + m_CropSrc.width &&
+            m_Picture->height >= m_CropSrc.y + m_CropSrc.height) {
+        if (m_CropDst.width != m_Crop.OutWidth || m_CropDst.height != m_Crop.OutHeight) {
+            std::memset(buffer, 0, m_NumBytes);
         }
+        dstData[0] += m_CropDst.y * dstLinesize[0] + m_CropDst.x * 3;
+
+        m_Picture->crop_left = m_CropSrc.x;
+        m_Picture->crop_top = m_CropSrc.y;
+        m_Picture->crop_right = m_Picture->width - m_CropSrc.x - m_CropSrc.width;
+        m_Picture->crop_bottom = m_Picture->height - m_CropSrc.y - m_CropSrc.height;
+        av_frame_apply_cropping(m_Picture, AV_FRAME_CROP_UNALIGNED);
+        sws_scale(m_SwsContext, (const uint8_t* const *) m_Picture->data,
+                m_Picture->linesize, 0, m_Picture->height, dstData, dstLinesize);
+    } else {
+        std::memset(buffer, 0, m_NumBytes);
     }
-    av_packet_unref(packet);
-
-    av_packet_free(&packet);
-    if (gotFrame) return GetResult::SUCCESS;
-    return GetResult::AGAIN;
+    return GetResult::SUCCESS;
 }
+
 void LibAVVideoSource::Reopen() {
     Close();
     Open();
+    m_SkipBeforeTimestamp = AV_NOPTS_VALUE;
 }
 
 void LibAVVideoSource::ClearError() {
@@ -40,13 +40,45 @@ namespace rgms::video {
 std::string AVStringError(int retcode);
 
 
-class LibAVVideoSource : public IVideoSource {
+// Loads the index from VideoIndexPath(input), or builds it by demuxing the file
+// in the background and saves it there.
+class LibAVVideoIndexer : public IVideoIndexer {
+public:
+    LibAVVideoIndexer(const std::string& input);
+    ~LibAVVideoIndexer();
+
+    std::shared_ptr<const VideoIndex> GetIndex() override final;
+
+private:
+    void IndexThread();
+
+private:
+    std::string m_Input;
+    std::mutex m_IndexMutex;
+    std::shared_ptr<const VideoIndex> m_Index; // set once
+    std::atomic<bool> m_IndexShouldStop;
+    std::thread m_IndexThread;
+};
+
+// Only what avformat_find_stream_info reports for the first video stream, no
+// decoder or index. False if the file can't be opened.
+bool LibAVProbeVideoFile(const std::string& input, int* width, int* height);
+
+// For regular files the index of indexer (or a new LibAVVideoIndexer when
+// that is nullptr) makes the source seekable. Pass the same indexer to every
+// source on a file so that it is only built once.
+class LibAVVideoSource : public ISeekableVideoSource {
 public:
     // As: "https://blahblahblah.m3u8"
     // or: "http://127.0.0.1:34613/" (remember:
     //  streamlink --twitch-disable-ads --twitch-low-latency twitch.tv/blah 720p60 
     //      --player-external-http)
     LibAVVideoSource(const std::string& input); 
+    // Frames are cropped and scaled by swscale, and are OutWidth x OutHeight.
+    // decoderThreads other than 1 enables frame and slice threading (0 is one
+    // per core), which adds latency so is meant for files rather than streams
+    LibAVVideoSource(const std::string& input, const VideoCrop& crop,
+            int decoderThreads = 1, IVideoIndexerPtr indexer = nullptr);
     ~LibAVVideoSource();
 
     int Width() const override final;
@@ -59,6 +91,9 @@ public:
     std::string GetLastError() override final;
     std::string GetInformation() override final;
 
+    std::shared_ptr<const VideoIndex> GetIndex() override final;
+    bool SeekToKeyframe(int64_t keyframeIndex) override final;
+
 private:
     void Open();
     void Close();
@@ -75,9 +110,19 @@ private:
     int m_InputIndex;
 
     AVFrame* m_Picture;
-    AVFrame* m_BGRPicture;
+    AVPacket* m_Packet; // reused for every read
     int m_NumBytes;
-    uint8_t* m_Buffer;
+
+    int m_DecoderThreads;
+    bool m_HasCrop;
+    VideoCrop m_Crop;
+    bool m_CropVisible;
+    cv::Rect m_CropSrc;
+    cv::Rect m_CropDst;
+
+    int64_t m_SkipBeforeTimestamp; // after seeking, drop leading frames
+
+    IVideoIndexerPtr m_Indexer; // nullptr for streams
 };
 
 }
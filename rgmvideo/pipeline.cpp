@@ -0,0 +1,299 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021-2021 FlibidyDibidy
+//
+// This file is part of Graphite.
+//
+// Graphite is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// Graphite is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Graphite; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+
+#include "fmt/core.h"
+
+#include "rgmvideo/pipeline.h"
+
+using namespace rgms::video;
+using namespace rgms::util;
+
+namespace {
+
+// Slot indices handed from one stage to the next. Close lets the consumers
+// drain what is left, Abort (an error somewhere) stops them straight away.
+class SlotQueue {
+public:
+    SlotQueue()
+        : m_Closed(false)
+        , m_Aborted(false)
+    {
+    }
+
+    void Push(int slot) {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Slots.push_back(slot);
+        }
+        m_CV.notify_one();
+    }
+
+    bool Pop(int* slot) {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_CV.wait(lock, [&]{ return m_Aborted || m_Closed || !m_Slots.empty(); });
+        if (m_Aborted || m_Slots.empty()) {
+            return false;
+        }
+        *slot = m_Slots.front();
+        m_Slots.pop_front();
+        return true;
+    }
+
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Closed = true;
+        }
+        m_CV.notify_all();
+    }
+
+    void Abort() {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Aborted = true;
+        }
+        m_CV.notify_all();
+    }
+
+private:
+    std::mutex m_Mutex;
+    std::condition_variable m_CV;
+    std::deque<int> m_Slots;
+    bool m_Closed;
+    bool m_Aborted;
+};
+
+struct PipelineSlot {
+    int64_t Index;
+    int64_t PtsMilliseconds;
+    cv::Mat In;
+    cv::Mat Out;
+};
+
+}
+
+static double SecondsSince(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+FrameReader rgms::video::VideoSourceReader(IVideoSource* source) {
+    return [source](cv::Mat* frame, int64_t* ptsMilliseconds) {
+        frame->create(source->Height(), source->Width(), CV_8UC3);
+        while (true) {
+            // AGAIN is libav wanting another packet, there is no waiting involved
+            GetResult res = source->Get(frame->data, ptsMilliseconds);
+            if (res == GetResult::SUCCESS) {
+                return true;
+            } else if (res == GetResult::FAILURE) {
+                if (source->GetErrorState() == ErrorState::INPUT_EXHAUSTED) {
+                    return false;
+                }
+                throw std::runtime_error(source->GetLastError());
+            }
+        }
+    };
+}
+
+FramePipelineConfig FramePipelineConfig::Defaults() {
+    FramePipelineConfig cfg;
+    cfg.Workers = 0;
+    cfg.FramesInFlight = 0;
+    return cfg;
+}
+
+FramePipelineStats rgms::video::RunFramePipeline(const FrameReader& reader,
+        const FrameTransform& transform, const FrameWriter& writer,
+        const FramePipelineConfig& config) {
+    int workers = config.Workers;
+    if (workers <= 0) {
+        workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+    int framesInFlight = config.FramesInFlight;
+    if (framesInFlight <= 0) {
+        framesInFlight = workers * 3;
+    }
+
+    std::vector<PipelineSlot> slots(framesInFlight);
+    SlotQueue freeSlots, readSlots, doneSlots;
+    for (int i = 0; i < framesInFlight; i++) {
+        freeSlots.Push(i);
+    }
+
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error) {
+                error = e;
+            }
+        }
+        freeSlots.Abort();
+        readSlots.Abort();
+        doneSlots.Abort();
+    };
+
+    FramePipelineStats stats;
+    stats.Frames = 0;
+    stats.ReadSeconds = 0.0;
+    stats.TransformSeconds = 0.0;
+    stats.WriteSeconds = 0.0;
+    stats.Workers = workers;
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread readThread([&](){
+        try {
+            int64_t index = 0;
+            int s;
+            while (freeSlots.Pop(&s)) {
+                PipelineSlot& slot = slots[s];
+                auto t = std::chrono::steady_clock::now();
+                bool more = reader(&slot.In, &slot.PtsMilliseconds);
+                stats.ReadSeconds += SecondsSince(t);
+                if (!more) {
+                    break;
+                }
+                slot.Index = index++;
+                readSlots.Push(s);
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        readSlots.Close();
+    });
+
+    std::atomic<int> running(workers);
+    std::vector<double> transformSeconds(workers, 0.0);
+    std::vector<std::thread> pool;
+    for (int w = 0; w < workers; w++) {
+        pool.emplace_back([&, w](){
+            try {
+                int s;
+                while (readSlots.Pop(&s)) {
+                    PipelineSlot& slot = slots[s];
+                    auto t = std::chrono::steady_clock::now();
+                    transform(slot.In, &slot.Out);
+                    transformSeconds[w] += SecondsSince(t);
+                    doneSlots.Push(s);
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+            if (--running == 0) {
+                doneSlots.Close();
+            }
+        });
+    }
+
+    // Workers finish out of order, hold on to frames until their turn
+    std::map<int64_t, int> pending;
+    try {
+        int s;
+        while (doneSlots.Pop(&s)) {
+            pending.emplace(slots[s].Index, s);
+            auto it = pending.begin();
+            while (it != pending.end() && it->first == stats.Frames) {
+                PipelineSlot& slot = slots[it->second];
+                auto t = std::chrono::steady_clock::now();
+                writer(slot.Index, slot.PtsMilliseconds, slot.Out);
+                stats.WriteSeconds += SecondsSince(t);
+                stats.Frames++;
+                freeSlots.Push(it->second);
+                it = pending.erase(it);
+            }
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+
+    readThread.join();
+    for (auto& t : pool) {
+        t.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    for (auto& t : transformSeconds) {
+        stats.TransformSeconds += t;
+    }
+    stats.Seconds = SecondsSince(start);
+    return stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+FrameSink::FrameSink(const std::string& path, int width, int height, double fps)
+    : m_Width(width)
+    , m_Height(height)
+{
+    std::string ext = fs::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+            [](unsigned char c){ return static_cast<char>(std::tolower(c)); });
+
+    if (ext == ".gfc") {
+        m_Cache = std::make_unique<FrameCacheWriter>(path, width, height, 0);
+    } else {
+        int fourcc = cv::VideoWriter::fourcc('m', 'p', '4', 'v');
+        if (ext == ".mkv" || ext == ".avi") {
+            fourcc = cv::VideoWriter::fourcc('F', 'F', 'V', '1');
+        }
+        m_Video = std::make_unique<cv::VideoWriter>(path, fourcc, fps, cv::Size(width, height));
+        if (!m_Video->isOpened()) {
+            throw std::runtime_error(fmt::format("unable to open '{}' for writing", path));
+        }
+    }
+}
+
+FrameSink::~FrameSink() {
+}
+
+void FrameSink::Write(const cv::Mat& frame, int64_t ptsMilliseconds) {
+    if (frame.cols != m_Width || frame.rows != m_Height || frame.type() != CV_8UC3) {
+        throw std::invalid_argument(fmt::format("frame is {}x{}, expected {}x{}",
+                    frame.cols, frame.rows, m_Width, m_Height));
+    }
+    if (m_Cache) {
+        if (frame.isContinuous()) {
+            m_Cache->AddFrame(frame.data, ptsMilliseconds);
+        } else {
+            m_Cache->AddFrame(frame.clone().data, ptsMilliseconds);
+        }
+    } else {
+        m_Video->write(frame);
+    }
+}
+
+void FrameSink::Finish() {
+    if (m_Cache) {
+        m_Cache->Finish();
+    } else {
+        m_Video->release();
+    }
+}
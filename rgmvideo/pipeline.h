@@ -0,0 +1,95 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021-2021 FlibidyDibidy
+//
+// This file is part of Graphite.
+//
+// Graphite is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// Graphite is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Graphite; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RGMS_PIPELINE_HEADER
+#define RGMS_PIPELINE_HEADER
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <functional>
+
+#include "opencv2/opencv.hpp"
+
+#include "rgmvideo/video.h"
+#include "rgmvideo/framecache.h"
+
+namespace rgms::video {
+
+// Whole-video batch processing: one thread reads frames, a pool of workers
+// transforms them, and the calling thread writes the results in order. The
+// frames in flight are a fixed pool of buffers that are handed from stage to
+// stage and reused, so memory is bounded however far the reader gets ahead.
+
+// Fills *frame (which is reused, so may already be allocated) and false at the
+// end of the input. Called from the reader thread only
+typedef std::function<bool(cv::Mat* frame, int64_t* ptsMilliseconds)> FrameReader;
+// Called from many workers at once
+typedef std::function<void(const cv::Mat& in, cv::Mat* out)> FrameTransform;
+// Called on the thread that runs the pipeline, in frame order
+typedef std::function<void(int64_t frameIndex, int64_t ptsMilliseconds, const cv::Mat& out)> FrameWriter;
+
+// Reads every frame of source, throwing on errors other than running out
+FrameReader VideoSourceReader(IVideoSource* source);
+
+struct FramePipelineConfig {
+    int Workers;        // 0 for one per core
+    int FramesInFlight; // 0 for a few per worker
+
+    static FramePipelineConfig Defaults();
+};
+
+struct FramePipelineStats {
+    int64_t Frames;
+    double Seconds;          // wall time
+    double ReadSeconds;      // summed over the time spent in each stage
+    double TransformSeconds;
+    double WriteSeconds;
+    int Workers;
+};
+
+// An exception from any stage stops the others and is rethrown here
+FramePipelineStats RunFramePipeline(const FrameReader& reader, const FrameTransform& transform,
+        const FrameWriter& writer, const FramePipelineConfig& config = FramePipelineConfig::Defaults());
+
+// Writes frames to a raw frame cache (see framecache.h) when path ends in
+// ".gfc", otherwise encodes them with cv::VideoWriter. ".mkv" and ".avi" are
+// lossless (FFV1), anything else is mp4v.
+class FrameSink {
+public:
+    FrameSink(const std::string& path, int width, int height, double fps);
+    ~FrameSink();
+
+    // frame is width x height CV_8UC3
+    void Write(const cv::Mat& frame, int64_t ptsMilliseconds);
+    void Finish();
+
+private:
+    int m_Width;
+    int m_Height;
+    std::unique_ptr<FrameCacheWriter> m_Cache;
+    std::unique_ptr<cv::VideoWriter> m_Video;
+};
+
+}
+
+#endif
@@ -0,0 +1,175 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021-2021 FlibidyDibidy
+//
+// This file is part of Graphite.
+//
+// Graphite is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// Graphite is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Graphite; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+#include "rgmvideo/quantize.h"
+
+using namespace rgms::video;
+
+static constexpr int QUANTIZE_TABLE_BITS = 5;
+static constexpr int QUANTIZE_TABLE_SHIFT = 8 - QUANTIZE_TABLE_BITS;
+static constexpr int QUANTIZE_TABLE_SIDE = 1 << QUANTIZE_TABLE_BITS;
+// The table keeps the confidence above the index, they are split on the way out
+static constexpr int QUANTIZE_CONFIDENCE_SHIFT = 6;
+
+static inline int TableIndex(uint8_t b, uint8_t g, uint8_t r) {
+    return ((r >> QUANTIZE_TABLE_SHIFT) << (2 * QUANTIZE_TABLE_BITS)) |
+           ((g >> QUANTIZE_TABLE_SHIFT) << QUANTIZE_TABLE_BITS) |
+            (b >> QUANTIZE_TABLE_SHIFT);
+}
+
+PaletteQuantizer::PaletteQuantizer(const uint8_t* palette)
+    : m_Table(QUANTIZE_TABLE_SIDE * QUANTIZE_TABLE_SIDE * QUANTIZE_TABLE_SIDE)
+{
+    std::memcpy(m_Palette.data(), palette, m_Palette.size());
+
+    // The first entry of each color stands in for the rest
+    for (int i = 0; i < QUANTIZE_PALETTE_ENTRIES; i++) {
+        m_Canonical[i] = static_cast<uint8_t>(i);
+        for (int j = 0; j < i; j++) {
+            if (std::memcmp(&m_Palette[i * 3], &m_Palette[j * 3], 3) == 0) {
+                m_Canonical[i] = static_cast<uint8_t>(j);
+                break;
+            }
+        }
+    }
+
+    // Judged from the center of each cell
+    int half = (1 << QUANTIZE_TABLE_SHIFT) / 2;
+    for (int r = 0; r < QUANTIZE_TABLE_SIDE; r++) {
+        for (int g = 0; g < QUANTIZE_TABLE_SIDE; g++) {
+            for (int b = 0; b < QUANTIZE_TABLE_SIDE; b++) {
+                int cr = (r << QUANTIZE_TABLE_SHIFT) + half;
+                int cg = (g << QUANTIZE_TABLE_SHIFT) + half;
+                int cb = (b << QUANTIZE_TABLE_SHIFT) + half;
+
+                int best = 0;
+                int bestDistance = std::numeric_limits<int>::max();
+                int secondDistance = std::numeric_limits<int>::max();
+                for (int i = 0; i < QUANTIZE_PALETTE_ENTRIES; i++) {
+                    if (m_Canonical[i] != i) {
+                        continue;
+                    }
+                    int dr = cr - m_Palette[i * 3 + 0];
+                    int dg = cg - m_Palette[i * 3 + 1];
+                    int db = cb - m_Palette[i * 3 + 2];
+                    int d = dr * dr + dg * dg + db * db;
+                    if (d < bestDistance) {
+                        secondDistance = bestDistance;
+                        bestDistance = d;
+                        best = i;
+                    } else if (d < secondDistance) {
+                        secondDistance = d;
+                    }
+                }
+
+                int confidence = QUANTIZE_CONFIDENCE_MAX;
+                if (secondDistance != std::numeric_limits<int>::max() && secondDistance > 0) {
+                    double c = 1.0 - std::sqrt(static_cast<double>(bestDistance) /
+                            static_cast<double>(secondDistance));
+                    confidence = std::min(static_cast<int>(c * 4), static_cast<int>(QUANTIZE_CONFIDENCE_MAX));
+                }
+                m_Table[(r << (2 * QUANTIZE_TABLE_BITS)) | (g << QUANTIZE_TABLE_BITS) | b] =
+                    static_cast<uint8_t>(best | (confidence << QUANTIZE_CONFIDENCE_SHIFT));
+            }
+        }
+    }
+
+    // The center of a cell can be far from a palette color inside it, which
+    // is exactly the color that most needs to come out right. Such cells are
+    // that color, unless two colors share the cell which really is a toss up
+    std::vector<int> entriesInCell(m_Table.size(), 0);
+    std::vector<int> entryOfCell(m_Table.size(), 0);
+    for (int i = 0; i < QUANTIZE_PALETTE_ENTRIES; i++) {
+        if (m_Canonical[i] != i) {
+            continue;
+        }
+        int cell = TableIndex(m_Palette[i * 3 + 2], m_Palette[i * 3 + 1], m_Palette[i * 3 + 0]);
+        entriesInCell[cell]++;
+        entryOfCell[cell] = i;
+    }
+    for (size_t cell = 0; cell < m_Table.size(); cell++) {
+        if (entriesInCell[cell] == 1) {
+            m_Table[cell] = static_cast<uint8_t>(entryOfCell[cell] |
+                    (QUANTIZE_CONFIDENCE_MAX << QUANTIZE_CONFIDENCE_SHIFT));
+        } else if (entriesInCell[cell] > 1) {
+            m_Table[cell] &= QUANTIZE_INDEX_MASK;
+        }
+    }
+}
+
+PaletteQuantizer::~PaletteQuantizer() {
+}
+
+const uint8_t* PaletteQuantizer::Palette() const {
+    return m_Palette.data();
+}
+
+uint8_t PaletteQuantizer::CanonicalIndex(uint8_t index) const {
+    return m_Canonical[index & QUANTIZE_INDEX_MASK];
+}
+
+void PaletteQuantizer::CanonicalIndices(const uint8_t* indices, size_t numPixels, uint8_t* out) const {
+    for (size_t i = 0; i < numPixels; i++) {
+        out[i] = m_Canonical[indices[i] & QUANTIZE_INDEX_MASK];
+    }
+}
+
+uint8_t PaletteQuantizer::Quantize(uint8_t b, uint8_t g, uint8_t r, uint8_t* confidence) const {
+    uint8_t v = m_Table[TableIndex(b, g, r)];
+    if (confidence) {
+        *confidence = v >> QUANTIZE_CONFIDENCE_SHIFT;
+    }
+    return v & QUANTIZE_INDEX_MASK;
+}
+
+void PaletteQuantizer::QuantizeBGR(const uint8_t* bgr, size_t numPixels, uint8_t* out,
+        uint8_t* confidence) const {
+    const uint8_t* table = m_Table.data();
+    if (confidence) {
+        for (size_t i = 0; i < numPixels; i++) {
+            uint8_t v = table[TableIndex(bgr[0], bgr[1], bgr[2])];
+            out[i] = v & QUANTIZE_INDEX_MASK;
+            confidence[i] = v >> QUANTIZE_CONFIDENCE_SHIFT;
+            bgr += 3;
+        }
+    } else {
+        for (size_t i = 0; i < numPixels; i++) {
+            out[i] = table[TableIndex(bgr[0], bgr[1], bgr[2])] & QUANTIZE_INDEX_MASK;
+            bgr += 3;
+        }
+    }
+}
+
+void PaletteQuantizer::ExpandBGR(const uint8_t* quantized, size_t numPixels, uint8_t* bgr) const {
+    for (size_t i = 0; i < numPixels; i++) {
+        const uint8_t* c = &m_Palette[(quantized[i] & QUANTIZE_INDEX_MASK) * 3];
+        bgr[0] = c[2];
+        bgr[1] = c[1];
+        bgr[2] = c[0];
+        bgr += 3;
+    }
+}
@@ -0,0 +1,72 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021-2021 FlibidyDibidy
+//
+// This file is part of Graphite.
+//
+// Graphite is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// Graphite is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Graphite; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RGMS_QUANTIZE_HEADER
+#define RGMS_QUANTIZE_HEADER
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+
+namespace rgms::video {
+
+inline constexpr int QUANTIZE_PALETTE_ENTRIES = 64;
+inline constexpr uint8_t QUANTIZE_INDEX_MASK = 0x3f;
+inline constexpr uint8_t QUANTIZE_CONFIDENCE_MAX = 3;
+
+// Maps colors to the nearest entry of a 64 color NES palette (rgb order, as
+// nes::Palette) through a 32x32x32 lookup table, so a 256x240 frame is a
+// table lookup per pixel. Each result is one byte of 6 bit palette index.
+//
+// Optionally a separate plane of confidence is produced, 0 (a toss up) to
+// QUANTIZE_CONFIDENCE_MAX, which is how the distance to the nearest entry
+// compares to the distance to the next nearest. Colors of the palette itself
+// always get QUANTIZE_CONFIDENCE_MAX unless another entry shares their cell.
+//
+// Palettes repeat some colors (there are several blacks), those all map to one
+// index. Put emulator frames through CanonicalIndices and the two compare byte
+// for byte.
+class PaletteQuantizer {
+public:
+    PaletteQuantizer(const uint8_t* palette);
+    ~PaletteQuantizer();
+
+    const uint8_t* Palette() const; // 64 rgb entries
+    uint8_t CanonicalIndex(uint8_t index) const;
+    void CanonicalIndices(const uint8_t* indices, size_t numPixels, uint8_t* out) const;
+
+    uint8_t Quantize(uint8_t b, uint8_t g, uint8_t r, uint8_t* confidence = nullptr) const;
+    // confidence (if given) is numPixels as well
+    void QuantizeBGR(const uint8_t* bgr, size_t numPixels, uint8_t* out,
+            uint8_t* confidence = nullptr) const;
+    void ExpandBGR(const uint8_t* quantized, size_t numPixels, uint8_t* bgr) const;
+
+private:
+    std::array<uint8_t, QUANTIZE_PALETTE_ENTRIES * 3> m_Palette;
+    std::array<uint8_t, QUANTIZE_PALETTE_ENTRIES> m_Canonical;
+    std::vector<uint8_t> m_Table;
+};
+
+}
+
+#endif
@@ -20,57 +20,139 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RGMS_UNCRT_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "fmt/core.h"
+
 #include "rgmvideo/uncrt.h"
 
 using namespace rgms::video;
 using namespace rgms::util;
 
 
-static bool PointInFour(const Vector2F& pt, const std::array<Vector2F, 5>& poly) {
-    int wn = 0;
-    for (int i = 0; i < 4; i++) {
-        if (poly[i].y <= pt.y) {
-            if (poly[i+1].y > pt.y) {
-                if (IsLeft(poly[i], poly[i+1], pt)) {
-                    wn++;
-                }
-            }
-        } else {
-            if (poly[i+1].y <= pt.y) {
-                if (IsRight(poly[i], poly[i+1], pt)) {
-                    wn--;
-                }
-            }
+// A quad clipped by three axis aligned lines, room for when it isn't convex
+struct ClipPolygon {
+    std::array<Vector2F, 16> Points;
+    int Count = 0;
+};
+
+// Keeps the part of poly with p[axis] <= value (or >= value if !below)
+static ClipPolygon ClipAxis(const ClipPolygon& poly, int axis, float value, bool below) {
+    ClipPolygon out;
+    for (int i = 0; i < poly.Count; i++) {
+        const Vector2F& a = poly.Points[i];
+        const Vector2F& b = poly.Points[(i + 1) % poly.Count];
+        float da = below ? value - a[axis] : a[axis] - value;
+        float db = below ? value - b[axis] : b[axis] - value;
+        if (da >= 0.0f) {
+            out.Points[out.Count++] = a;
+        }
+        if ((da >= 0.0f) != (db >= 0.0f) && out.Count < static_cast<int>(out.Points.size())) {
+            out.Points[out.Count++] = a + (b - a) * (da / (da - db));
+        }
+        if (out.Count >= static_cast<int>(out.Points.size())) {
+            break;
         }
     }
-    return wn != 0;
+    return out;
+}
+
+static float PolygonArea(const ClipPolygon& poly) {
+    float a = 0.0f;
+    for (int i = 0; i < poly.Count; i++) {
+        const Vector2F& p = poly.Points[i];
+        const Vector2F& q = poly.Points[(i + 1) % poly.Count];
+        a += p.x * q.y - q.x * p.y;
+    }
+    return std::abs(a) * 0.5f;
 }
 
-static float PolyPixOver(int x, int y, const std::array<Vector2F, 5>& poly) {
-    // could change to 5 and
-    // -0.4, -0.2, 0, 0.2, 0.4
-    int n = 3;
-    std::array<float, 3> d {-0.33333333333f, 0.0f, 0.33333333333f};
+// Input pixel (x, y) covers [x - 0.5, x + 0.5] x [y - 0.5, y + 0.5]. For each
+// row of pixels the quad is clipped to that strip, after which the coverage
+// of a pixel is the strip's area left of its right edge minus that left of
+// its left edge.
+static void QuadCoverage(const std::array<Vector2F, 4>& quad, int rows, int cols,
+        std::vector<std::pair<uint32_t, float>>* amts, float* total) {
+    amts->clear();
+    *total = 0.0f;
 
-    float xf = static_cast<float>(x);
-    float yf = static_cast<float>(y);
+    ClipPolygon poly;
+    float miny = quad[0].y, maxy = quad[0].y;
+    for (auto& p : quad) {
+        poly.Points[poly.Count++] = p;
+        miny = std::min(miny, p.y);
+        maxy = std::max(maxy, p.y);
+    }
+
+    int sy = std::max(static_cast<int>(std::floor(miny + 0.5f)), 0);
+    int ey = std::min(static_cast<int>(std::floor(maxy + 0.5f)), rows - 1);
+    for (int iny = sy; iny <= ey; iny++) {
+        float fy = static_cast<float>(iny);
+        ClipPolygon strip = ClipAxis(ClipAxis(poly, 1, fy - 0.5f, false), 1, fy + 0.5f, true);
+        if (strip.Count < 3) {
+            continue;
+        }
 
-    int cnt = 0;
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            Vector2F p(xf + d[j], yf + d[i]);
-            if (PointInFour(p, poly)) {
-                cnt++;
+        float minx = strip.Points[0].x, maxx = strip.Points[0].x;
+        for (int i = 1; i < strip.Count; i++) {
+            minx = std::min(minx, strip.Points[i].x);
+            maxx = std::max(maxx, strip.Points[i].x);
+        }
+        int sx = std::max(static_cast<int>(std::floor(minx + 0.5f)), 0);
+        int ex = std::min(static_cast<int>(std::floor(maxx + 0.5f)), cols - 1);
+
+        float leftArea = PolygonArea(ClipAxis(strip, 0, static_cast<float>(sx) - 0.5f, true));
+        for (int inx = sx; inx <= ex; inx++) {
+            float rightArea = PolygonArea(ClipAxis(strip, 0, static_cast<float>(inx) + 0.5f, true));
+            float amt = rightArea - leftArea;
+            leftArea = rightArea;
+            if (amt > 1e-6f) {
+                *total += amt;
+                amts->emplace_back(static_cast<uint32_t>((iny * cols) + inx) * 3, amt);
             }
         }
     }
+}
 
-    return static_cast<float>(cnt) / static_cast<float>(n * n);
+bool PixelContributions::empty() const {
+    return RowStart.empty();
 }
 
-void rgms::video::ComputePixelContributions(int rows, int cols,
-        const BezierPatch& patch, PixelContributions* contrib, int outx, int outy) {
+// Quantizes one output pixel's weights (amt / area) so they sum to exactly
+// total / area, the rounding error goes to the largest weight
+static void AppendContributions(const std::vector<std::pair<uint32_t, float>>& amts,
+        float total, float area, PixelContributions* contrib) {
+    const int one = 1 << CONTRIBUTION_WEIGHT_BITS;
+    int target = std::min(static_cast<int>(std::lround(total / area * one)), one);
+    int sum = 0;
+    size_t largest = contrib->Weight.size();
+    for (auto& [offset, amt] : amts) {
+        int w = static_cast<int>(std::lround(amt / area * one));
+        if (w <= 0) {
+            continue;
+        }
+        if (largest == contrib->Weight.size() || w > contrib->Weight[largest]) {
+            largest = contrib->Weight.size();
+        }
+        contrib->Offset.push_back(offset);
+        contrib->Weight.push_back(static_cast<uint16_t>(w));
+        sum += w;
+    }
+    if (largest < contrib->Weight.size()) {
+        contrib->Weight[largest] = static_cast<uint16_t>(std::max(contrib->Weight[largest] + target - sum, 0));
+    }
+    contrib->RowStart.push_back(static_cast<uint32_t>(contrib->Offset.size()));
+}
 
+std::vector<Vector2F> rgms::video::PixelContributionsMesh(const BezierPatch& patch,
+        int outx, int outy) {
     auto ac = [&](float t){
         return EvaluateBezier(t, patch[ 0], patch[ 4], patch[ 8], patch[12]);
     };
@@ -97,77 +179,335 @@ void rgms::video::ComputePixelContributions(int rows, int cols,
             i++;
         }
     }
+    return coords;
+}
 
-    contrib->resize(outy * outx);
-    i = 0;
-    for (int y = 0; y < outy; y++) {
-        for (int x = 0; x < outx; x++) {
-            std::vector<std::pair<size_t, float>>& thisAmts = (*contrib)[i++];
-            thisAmts.clear();
+// Rows are independent so they are done in parallel and then concatenated
+static bool ComputeContributions(int rows, int cols, const std::vector<Vector2F>& coords,
+        int outx, int outy, bool zeroOutside, PixelContributions* contrib,
+        const std::atomic<bool>* cancel) {
+    std::vector<PixelContributions> rowContribs(outy);
+    std::atomic<bool> cancelled = false;
+    cv::parallel_for_(cv::Range(0, outy), [&](const cv::Range& range) {
+        std::vector<std::pair<uint32_t, float>> thisAmts;
+        for (int y = range.start; y < range.end; y++) {
+            if (cancelled || (cancel && *cancel)) {
+                cancelled = true;
+                return;
+            }
 
-            int q = y * (outx + 1) + x;
-            int j = (y + 1) * (outx + 1) + x;
-            const Vector2F& a = coords[q];
-            const Vector2F& b = coords[q+1];
-            const Vector2F& c = coords[j+1];
-            const Vector2F& d = coords[j];
-            std::array<Vector2F, 5> poly {a, b, c, d, a};
-
-            // a b
-            // d c
-
-            int sy = static_cast<int>(std::min(a.y, b.y));
-            sy = std::max(sy, 0);
-            int ey = static_cast<int>(std::max(c.y, d.y)) + 2;
-            ey = std::min(ey, rows - 1);
-            int sx = static_cast<int>(std::min(a.x, d.x));
-            sx = std::max(sx, 0);
-            int ex = static_cast<int>(std::max(b.x, c.x)) + 2;
-            ex = std::min(ex, cols - 1);
-
-            float total = 0.0f;
-            for (int iny = sy; iny < ey; iny++) {
-                for (int inx = sx; inx < ex; inx++) {
-                    size_t origIndex = (iny * cols) + inx;
-
-                    float amt = PolyPixOver(inx, iny, poly);
-                    if (amt > 0.0f) {
-                        total += amt;
-                        thisAmts.emplace_back(origIndex, amt);
+            PixelContributions& rc = rowContribs[y];
+            rc.RowStart.assign(1, 0);
+            for (int x = 0; x < outx; x++) {
+                int q = y * (outx + 1) + x;
+                int j = (y + 1) * (outx + 1) + x;
+
+                // a b
+                // d c
+                std::array<Vector2F, 4> quad {coords[q], coords[q+1], coords[j+1], coords[j]};
+
+                float total;
+                QuadCoverage(quad, rows, cols, &thisAmts, &total);
+                float area = total;
+                if (zeroOutside) {
+                    ClipPolygon poly;
+                    for (auto& p : quad) {
+                        poly.Points[poly.Count++] = p;
                     }
+                    area = std::max(PolygonArea(poly), total);
                 }
+                AppendContributions(thisAmts, total, area, &rc);
             }
-            if (total > 0) {
-                for (auto & v : thisAmts) {
-                    v.second /= total;
-                }
-            }
+        }
+    });
+    if (cancelled) {
+        return false;
+    }
+
+    PixelContributions out;
+    out.InRows = rows;
+    out.InCols = cols;
+    out.OutX = outx;
+    out.OutY = outy;
+    out.ZeroOutside = zeroOutside;
+    out.RowStart.reserve(outy * outx + 1);
+    out.RowStart.push_back(0);
+    for (auto& rc : rowContribs) {
+        uint32_t base = static_cast<uint32_t>(out.Offset.size());
+        out.Offset.insert(out.Offset.end(), rc.Offset.begin(), rc.Offset.end());
+        out.Weight.insert(out.Weight.end(), rc.Weight.begin(), rc.Weight.end());
+        for (size_t i = 1; i < rc.RowStart.size(); i++) {
+            out.RowStart.push_back(base + rc.RowStart[i]);
         }
     }
+    *contrib = std::move(out);
+    return true;
 }
 
-cv::Mat rgms::video::RemoveCRT(const cv::Mat& frame, const PixelContributions& contrib, int outx, int outy) {
-    cv::Mat result(outy, outx, CV_32FC3);
-    float* resPtr = reinterpret_cast<float*>(result.data);
-    uint8_t* frPtr = reinterpret_cast<uint8_t*>(frame.data);
+bool rgms::video::ComputePixelContributions(int rows, int cols,
+        const BezierPatch& patch, PixelContributions* contrib, int outx, int outy,
+        const std::atomic<bool>* cancel) {
+    return ComputeContributions(rows, cols, PixelContributionsMesh(patch, outx, outy),
+            outx, outy, false, contrib, cancel);
+}
 
-    size_t l = 0;
+bool rgms::video::ComputeMeshContributions(int rows, int cols, const std::vector<Vector2F>& mesh,
+        int outx, int outy, bool zeroOutside, PixelContributions* contrib,
+        const std::atomic<bool>* cancel) {
+    if (mesh.size() != static_cast<size_t>(outx + 1) * (outy + 1)) {
+        throw std::invalid_argument("mesh must be (outx + 1) x (outy + 1)");
+    }
+    return ComputeContributions(rows, cols, mesh, outx, outy, zeroOutside,
+            contrib, cancel);
+}
+
+cv::Mat rgms::video::RemoveCRTPreview(const cv::Mat& frame, const std::vector<Vector2F>& mesh,
+        int outx, int outy) {
+    cv::Mat mapx(outy, outx, CV_32FC1);
+    cv::Mat mapy(outy, outx, CV_32FC1);
     for (int y = 0; y < outy; y++) {
+        float* mx = mapx.ptr<float>(y);
+        float* my = mapy.ptr<float>(y);
         for (int x = 0; x < outx; x++) {
-            resPtr[0] = 0.0f;
-            resPtr[1] = 0.0f;
-            resPtr[2] = 0.0f;
-            for (auto & [q, a] : contrib.at(l++)) {
-                uint8_t* tpix = frPtr + (q * 3);
-                for (int i = 0; i < 3; i++) {
-                    *(resPtr + i) += a * static_cast<float>(*(tpix + i));
-                }
+            int q = y * (outx + 1) + x;
+            int j = (y + 1) * (outx + 1) + x;
+            Vector2F c = (mesh[q] + mesh[q+1] + mesh[j] + mesh[j+1]) * 0.25f;
+            mx[x] = c.x;
+            my[x] = c.y;
+        }
+    }
+
+    cv::Mat out;
+    cv::remap(frame, out, mapx, mapy, cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+    return out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const char CONTRIBUTIONS_MAGIC[4] = {'G', 'P', 'C', 'S'};
+// Bump when ComputePixelContributions changes, old files are then just ignored
+static const uint32_t CONTRIBUTIONS_VERSION = 2;
+
+std::string rgms::video::PixelContributionsCacheDirectory() {
+    std::string dir = UserCacheDirectory("graphite");
+    if (dir.empty()) {
+        return "";
+    }
+    fs::path p = fs::path(dir) / "uncrt";
+    std::error_code ec;
+    fs::create_directories(p, ec);
+    return ec ? "" : p.string();
+}
+
+std::string rgms::video::PixelContributionsCachePath(const std::string& directory,
+        int rows, int cols, const BezierPatch& patch, int outx, int outy) {
+    uint64_t hash = FNV1aPOD(CONTRIBUTIONS_VERSION);
+    hash = FNV1aPOD(rows, hash);
+    hash = FNV1aPOD(cols, hash);
+    hash = FNV1aPOD(outx, hash);
+    hash = FNV1aPOD(outy, hash);
+    for (auto& p : patch) {
+        hash = FNV1aPOD(p.x, hash);
+        hash = FNV1aPOD(p.y, hash);
+    }
+    return (fs::path(directory) / fmt::format("{:016x}.gpc", hash)).string();
+}
+
+template <typename T>
+static void AppendPOD(std::vector<uint8_t>* data, const T* v, size_t n = 1) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(v);
+    data->insert(data->end(), p, p + sizeof(T) * n);
+}
+
+template <typename T>
+static bool ReadPOD(const std::vector<uint8_t>& data, size_t* offset, T* v, size_t n = 1) {
+    if (*offset + sizeof(T) * n > data.size()) {
+        return false;
+    }
+    std::memcpy(v, data.data() + *offset, sizeof(T) * n);
+    *offset += sizeof(T) * n;
+    return true;
+}
+
+void rgms::video::SavePixelContributions(const std::string& path, const PixelContributions& contrib) {
+    std::vector<uint8_t> data;
+    uint64_t nnz = contrib.Offset.size();
+    uint32_t zeroOutside = contrib.ZeroOutside ? 1 : 0;
+    AppendPOD(&data, CONTRIBUTIONS_MAGIC, 4);
+    AppendPOD(&data, &CONTRIBUTIONS_VERSION);
+    AppendPOD(&data, &contrib.InRows);
+    AppendPOD(&data, &contrib.InCols);
+    AppendPOD(&data, &contrib.OutX);
+    AppendPOD(&data, &contrib.OutY);
+    AppendPOD(&data, &zeroOutside);
+    AppendPOD(&data, &nnz);
+    AppendPOD(&data, contrib.RowStart.data(), contrib.RowStart.size());
+    AppendPOD(&data, contrib.Offset.data(), contrib.Offset.size());
+    AppendPOD(&data, contrib.Weight.data(), contrib.Weight.size());
+
+    // Moved into place so that an interrupted write is never read
+    std::string tmp = path + ".tmp";
+    WriteVectorToFile(tmp, data);
+    fs::rename(tmp, path);
+}
+
+bool rgms::video::LoadPixelContributions(const std::string& path, PixelContributions* contrib) {
+    if (!FileExists(path)) {
+        return false;
+    }
+    std::vector<uint8_t> data;
+    try {
+        ReadFileToVector(path, &data);
+    } catch (const std::exception&) {
+        return false;
+    }
+
+    size_t offset = 0;
+    char magic[4];
+    uint32_t version;
+    PixelContributions c;
+    uint32_t zeroOutside;
+    uint64_t nnz;
+    if (!ReadPOD(data, &offset, magic, 4) || std::memcmp(magic, CONTRIBUTIONS_MAGIC, 4) != 0 ||
+        !ReadPOD(data, &offset, &version) || version != CONTRIBUTIONS_VERSION ||
+        !ReadPOD(data, &offset, &c.InRows) || !ReadPOD(data, &offset, &c.InCols) ||
+        !ReadPOD(data, &offset, &c.OutX) || !ReadPOD(data, &offset, &c.OutY) ||
+        !ReadPOD(data, &offset, &zeroOutside) || !ReadPOD(data, &offset, &nnz)) {
+        return false;
+    }
+    c.ZeroOutside = zeroOutside != 0;
+    size_t numPixels = static_cast<size_t>(c.OutX) * c.OutY;
+    if (c.OutX <= 0 || c.OutY <= 0 ||
+        data.size() - offset != (numPixels + 1) * sizeof(uint32_t) + nnz * (sizeof(uint32_t) + sizeof(uint16_t))) {
+        return false;
+    }
+
+    c.RowStart.resize(numPixels + 1);
+    c.Offset.resize(nnz);
+    c.Weight.resize(nnz);
+    ReadPOD(data, &offset, c.RowStart.data(), c.RowStart.size());
+    ReadPOD(data, &offset, c.Offset.data(), c.Offset.size());
+    ReadPOD(data, &offset, c.Weight.data(), c.Weight.size());
+
+    // RemoveCRT trusts these, so make sure they stay inside the frame
+    if (c.RowStart.front() != 0 || c.RowStart.back() != nnz ||
+        !std::is_sorted(c.RowStart.begin(), c.RowStart.end())) {
+        return false;
+    }
+    uint64_t frameBytes = static_cast<uint64_t>(c.InRows) * c.InCols * 3;
+    for (uint32_t o : c.Offset) {
+        if (o + 3 > frameBytes) {
+            return false;
+        }
+    }
+
+    *contrib = std::move(c);
+    return true;
+}
+
+void rgms::video::CachedPixelContributions(const std::string& directory, int rows, int cols,
+        const BezierPatch& patch, PixelContributions* contrib, int outx, int outy) {
+    if (directory.empty()) {
+        ComputePixelContributions(rows, cols, patch, contrib, outx, outy);
+        return;
+    }
+
+    std::string path = PixelContributionsCachePath(directory, rows, cols, patch, outx, outy);
+    if (LoadPixelContributions(path, contrib)) {
+        return;
+    }
+    ComputePixelContributions(rows, cols, patch, contrib, outx, outy);
+    try {
+        SavePixelContributions(path, *contrib);
+    } catch (const std::exception&) {
+        // The cache is only an optimization
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// B G R in the low bytes, the high byte is whatever follows the pixel unless
+// that would be past the end of the frame. A single 4 byte load is much
+// faster than assembling 3 bytes.
+static inline uint32_t LoadBGR(const uint8_t* p, const uint8_t* end) {
+    uint32_t v = 0;
+    if (p + 4 <= end) {
+        std::memcpy(&v, p, 4);
+    } else {
+        std::memcpy(&v, p, 3);
+    }
+    return v;
+}
+
+static void RemoveCRTRows(const uint8_t* src, const uint8_t* srcEnd,
+        const PixelContributions& contrib, cv::Mat* out, int y0, int y1) {
+    const uint32_t* rowStart = contrib.RowStart.data();
+    const uint32_t* offset = contrib.Offset.data();
+    const uint16_t* weight = contrib.Weight.data();
+    const int half = 1 << (CONTRIBUTION_WEIGHT_BITS - 1);
+
+    for (int y = y0; y < y1; y++) {
+        uint8_t* o = out->ptr<uint8_t>(y);
+        const uint32_t* rs = rowStart + static_cast<size_t>(y) * contrib.OutX;
+        for (int x = 0; x < contrib.OutX; x++) {
+            uint32_t k = rs[x];
+            uint32_t end = rs[x + 1];
+            int b = 0, g = 0, r = 0;
+
+#ifdef RGMS_UNCRT_SSE2
+            // Two input pixels at a time, interleaved as 16 bit a.b b.b a.g
+            // b.g a.r b.r (and the ignored 4th bytes) so that one madd
+            // weighs and sums both per channel
+            __m128i acc = _mm_setzero_si128();
+            for (; k + 2 <= end; k += 2) {
+                __m128i pa = _mm_cvtsi32_si128(static_cast<int>(LoadBGR(src + offset[k], srcEnd)));
+                __m128i pb = _mm_cvtsi32_si128(static_cast<int>(LoadBGR(src + offset[k + 1], srcEnd)));
+                __m128i ab = _mm_unpacklo_epi8(_mm_unpacklo_epi8(pa, pb), _mm_setzero_si128());
+                __m128i w = _mm_set1_epi32(static_cast<int>(weight[k] | (static_cast<uint32_t>(weight[k + 1]) << 16)));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(ab, w));
+            }
+            alignas(16) int32_t sums[4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(sums), acc);
+            b = sums[0];
+            g = sums[1];
+            r = sums[2];
+#endif
+            for (; k < end; k++) {
+                const uint8_t* p = src + offset[k];
+                int w = weight[k];
+                b += p[0] * w;
+                g += p[1] * w;
+                r += p[2] * w;
             }
-            resPtr += 3;
+
+            // Weights sum to one, so no clamping needed
+            o[0] = static_cast<uint8_t>((b + half) >> CONTRIBUTION_WEIGHT_BITS);
+            o[1] = static_cast<uint8_t>((g + half) >> CONTRIBUTION_WEIGHT_BITS);
+            o[2] = static_cast<uint8_t>((r + half) >> CONTRIBUTION_WEIGHT_BITS);
+            o += 3;
         }
     }
+}
+
+void rgms::video::RemoveCRT(const cv::Mat& frame, const PixelContributions& contrib, cv::Mat* out) {
+    if (frame.type() != CV_8UC3 || frame.rows != contrib.InRows || frame.cols != contrib.InCols) {
+        throw std::runtime_error("RemoveCRT frame does not match the pixel contributions");
+    }
+    cv::Mat in = frame;
+    if (!in.isContinuous()) {
+        in = frame.clone();
+    }
+    out->create(contrib.OutY, contrib.OutX, CV_8UC3);
+
+    const uint8_t* src = in.data;
+    const uint8_t* srcEnd = src + in.total() * 3;
+    cv::parallel_for_(cv::Range(0, contrib.OutY), [&](const cv::Range& range) {
+        RemoveCRTRows(src, srcEnd, contrib, out, range.start, range.end);
+    });
+}
 
+cv::Mat rgms::video::RemoveCRT(const cv::Mat& frame, const PixelContributions& contrib) {
     cv::Mat img;
-    result.convertTo(img, CV_8UC3);
+    RemoveCRT(frame, contrib, &img);
     return img;
 }
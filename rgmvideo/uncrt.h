@@ -23,18 +23,77 @@
 #ifndef RGMS_UNCRT_HEADER
 #define RGMS_UNCRT_HEADER
 
+#include <atomic>
+#include <vector>
+
 #include "opencv2/opencv.hpp"
 
 #include "rgmutil/util.h"
 
 namespace rgms::video {
 
-typedef std::vector<std::vector<std::pair<size_t, float>>> PixelContributions;
+// Weights of an output pixel sum to exactly 1 << CONTRIBUTION_WEIGHT_BITS
+constexpr int CONTRIBUTION_WEIGHT_BITS = 14;
+
+// The uncrt transform as a sparse matrix in compressed sparse row form. Row i
+// is output pixel i (row major), and its input pixels are
+// Offset[RowStart[i]] to Offset[RowStart[i + 1]] (exclusive).
+struct PixelContributions {
+    int InRows = 0, InCols = 0;
+    int OutX = 0, OutY = 0;
+    bool ZeroOutside = false; // see ComputeMeshContributions
+
+    std::vector<uint32_t> RowStart; // OutX * OutY + 1 entries
+    std::vector<uint32_t> Offset;   // byte offset of the input pixel in a continuous CV_8UC3 frame
+    std::vector<uint16_t> Weight;   // fixed point, see CONTRIBUTION_WEIGHT_BITS
+
+    bool empty() const;
+};
+
+// The (outx + 1) x (outy + 1) grid of quad corners (in input pixels) that
+// the patch is divided into, output pixel (x, y) is the quad with top left
+// corner (x, y)
+std::vector<util::Vector2F> PixelContributionsMesh(const util::BezierPatch& patch,
+        int outx, int outy);
+
+// Each output pixel is a quad of the mesh, its contributions are the exact
+// areas of the input pixels that it covers. False, with contrib untouched, if
+// cancel was set part way through
+bool ComputePixelContributions(int rows, int cols, const util::BezierPatch& patch,
+    PixelContributions* contrib, int outx, int outy,
+    const std::atomic<bool>* cancel = nullptr);
+
+// The same for any mesh of (outx + 1) x (outy + 1) corners, which makes any
+// resampling (a crop and scale, a perspective warp) a PixelContributions. The
+// parts of a quad outside the frame are ignored, or with zeroOutside count as
+// black like a crop that is padded.
+bool ComputeMeshContributions(int rows, int cols, const std::vector<util::Vector2F>& mesh,
+    int outx, int outy, bool zeroOutside, PixelContributions* contrib,
+    const std::atomic<bool>* cancel = nullptr);
+
+// Cached contributions are keyed by the patch and sizes, so a cached file is
+// never stale. The directory defaults to "uncrt" in util::UserCacheDirectory
+std::string PixelContributionsCacheDirectory();
+std::string PixelContributionsCachePath(const std::string& directory, int rows, int cols,
+        const util::BezierPatch& patch, int outx, int outy);
+bool LoadPixelContributions(const std::string& path, PixelContributions* contrib);
+void SavePixelContributions(const std::string& path, const PixelContributions& contrib);
+
+// Loads the contributions from the cache directory, or computes and then
+// saves them there. An empty directory is the same as not caching
+void CachedPixelContributions(const std::string& directory, int rows, int cols,
+    const util::BezierPatch& patch, PixelContributions* contrib, int outx, int outy);
 
-void ComputePixelContributions(int rows, int cols, const util::BezierPatch& patch,
-    PixelContributions* contrib, int outx, int outy);
+// frame must be CV_8UC3 and InRows x InCols, the result is OutY x OutX.
+// Output rows are split across OpenCV's thread pool.
+cv::Mat RemoveCRT(const cv::Mat& frame, const PixelContributions& contrib);
+// Same, but into out (reallocated only if it isn't OutY x OutX CV_8UC3) so
+// that per frame use doesn't allocate
+void RemoveCRT(const cv::Mat& frame, const PixelContributions& contrib, cv::Mat* out);
 
-cv::Mat RemoveCRT(const cv::Mat& frame, const PixelContributions& contrib, 
+// A quick approximation that needs no contributions, each output pixel is
+// bilinearly sampled at the center of its quad. For while they are computed
+cv::Mat RemoveCRTPreview(const cv::Mat& frame, const std::vector<util::Vector2F>& mesh,
         int outx, int outy);
 
 }
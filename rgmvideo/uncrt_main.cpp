@@ -20,18 +20,26 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-//#include "fmt/core.h"
+#include "fmt/core.h"
 
 #include "rgmutil/util.h"
 #include "rgmvideo/uncrt.h"
+#include "rgmvideo/pipeline.h"
+#include "rgmvideo/videofile.h"
 
 using namespace rgms;
 
 void Usage(std::ostream& os) {
-    os << "usage: uncrt [options] [--directory dir] [image.png ...]" << std::endl;
+    os << "usage: uncrt [options] --mesh mesh_points --input video --output out" << std::endl;
+    os << "   or: uncrt [options] --mesh mesh_points (--inplace | --output dir/) [--directory dir] [image.png ...]" << std::endl;
     os << " --help                  : print usage and exit" << std::endl;
     os << " --mesh mesh_points      : the 16 point bezier mesh" << std::endl;
     os << "     mesh_points as      : x0:y0:x1:y1:...:x15:y15" << std::endl;
+    os << " --input video           : a video to process instead of images" << std::endl;
+    os << " --output out            : for a video, a .gfc raw frame cache or a video" << std::endl;
+    os << "                           (.mkv/.avi are lossless), for images a directory" << std::endl;
+    os << " --fps fps               : frame rate of an output video (default 60)" << std::endl;
+    os << " --threads n             : unCRT workers (default one per core)" << std::endl;
     os << " --inplace               : process the images in place overwriting them" << std::endl;
     os << " --directory directory/  : optional directories to process" << std::endl;
 }
@@ -55,6 +63,106 @@ bool ParsePatch(const std::string& meshPoints, util::BezierPatch* patch) {
     return patchIndex == 32;
 }
 
+static void PrintStats(const video::FramePipelineStats& stats) {
+    double fps = stats.Seconds > 0.0 ? stats.Frames / stats.Seconds : 0.0;
+    fmt::print("{} frames in {:.1f}s ({:.1f} fps) with {} workers\n",
+            stats.Frames, stats.Seconds, fps, stats.Workers);
+    fmt::print("busy: read {:.1f}s, uncrt {:.1f}s, write {:.1f}s\n",
+            stats.ReadSeconds, stats.TransformSeconds, stats.WriteSeconds);
+}
+
+static int ProcessVideo(const std::string& input, const std::string& output, double fps,
+        const util::BezierPatch& bp, int outx, int outy,
+        const video::FramePipelineConfig& pipelineConfig) {
+    video::StaticVideoThreadConfig cfg = video::StaticVideoThreadConfig::Defaults();
+    cfg.DecoderThreads = 0;
+    video::IVideoSourcePtr source = video::OpenVideoFile(input, cfg);
+    if (source->GetErrorState() != video::ErrorState::NO_ERROR) {
+        std::cerr << "Unable to open " << input << ": " << source->GetLastError() << std::endl;
+        return 1;
+    }
+
+    std::cout << "computing pixel contributions: " << source->Height() << "x" << source->Width() << std::endl;
+    video::PixelContributions contrib;
+    video::CachedPixelContributions(video::PixelContributionsCacheDirectory(),
+            source->Height(), source->Width(), bp, &contrib, outx, outy);
+
+    video::FrameSink sink(output, outx, outy, fps);
+    video::FramePipelineStats stats = video::RunFramePipeline(
+        video::VideoSourceReader(source.get()),
+        [&](const cv::Mat& in, cv::Mat* out){
+            video::RemoveCRT(in, contrib, out);
+        },
+        [&](int64_t frameIndex, int64_t ptsMilliseconds, const cv::Mat& out){
+            sink.Write(out, ptsMilliseconds);
+            if (frameIndex % 64 == 0) {
+                fmt::print(" {:9d} frames {:9.1f}s \r", frameIndex, ptsMilliseconds / 1000.0);
+                std::cout << std::flush;
+            }
+        },
+        pipelineConfig);
+    sink.Finish();
+
+    std::cout << std::endl;
+    PrintStats(stats);
+    return 0;
+}
+
+static int ProcessImages(const std::vector<std::string>& images, const std::string& outputDirectory,
+        const util::BezierPatch& bp, int outx, int outy,
+        const video::FramePipelineConfig& pipelineConfig) {
+    // Images can be any size, contributions are computed the first time one
+    // is seen
+    std::mutex contribMutex;
+    std::map<std::pair<int, int>, video::PixelContributions> pcontrib;
+
+    size_t next = 0;
+    video::FramePipelineStats stats = video::RunFramePipeline(
+        [&](cv::Mat* frame, int64_t* ptsMilliseconds){
+            if (next >= images.size()) {
+                return false;
+            }
+            *frame = cv::imread(images[next]);
+            if (frame->empty() || frame->rows == 0 || frame->cols == 0) {
+                throw std::runtime_error("Invalid imgpath: " + images[next]);
+            }
+            *ptsMilliseconds = 0;
+            next++;
+            return true;
+        },
+        [&](const cv::Mat& in, cv::Mat* out){
+            const video::PixelContributions* contrib;
+            {
+                std::lock_guard<std::mutex> lock(contribMutex);
+                auto key = std::make_pair(in.rows, in.cols);
+                auto it = pcontrib.find(key);
+                if (it == pcontrib.end()) {
+                    std::cout << "computing pixel contributions: " << in.rows << "x" << in.cols << std::endl;
+                    it = pcontrib.emplace(key, video::PixelContributions()).first;
+                    video::CachedPixelContributions(video::PixelContributionsCacheDirectory(),
+                            in.rows, in.cols, bp, &it->second, outx, outy);
+                }
+                contrib = &it->second;
+            }
+            video::RemoveCRT(in, *contrib, out);
+        },
+        [&](int64_t frameIndex, int64_t ptsMilliseconds, const cv::Mat& out){
+            std::string path = images[frameIndex];
+            if (!outputDirectory.empty()) {
+                path = (util::fs::path(outputDirectory) / util::fs::path(path).filename()).string();
+            }
+            if (!cv::imwrite(path, out)) {
+                throw std::runtime_error("Unable to write: " + path);
+            }
+            std::cout << frameIndex + 1 << " " << images.size() << "\r" << std::flush;
+        },
+        pipelineConfig);
+
+    std::cout << std::endl;
+    PrintStats(stats);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     util::ArgNext(&argc, &argv); // Skip path argument
 
@@ -64,6 +172,10 @@ int main(int argc, char** argv) {
     }
 
     std::vector<std::string> images;
+    std::string input;
+    std::string output;
+    double fps = 60.0;
+    video::FramePipelineConfig pipelineConfig = video::FramePipelineConfig::Defaults();
 
     bool inplace = false;
     bool readingImages = false;
@@ -88,6 +200,30 @@ int main(int argc, char** argv) {
                     return 1;
                 }
                 patchInitialized = true;
+            } else if (arg == "--input") {
+                if (!util::ArgReadString(&argc, &argv, &input)) {
+                    std::cerr << "Failure reading input" << std::endl << std::endl;
+                    Usage(std::cerr);
+                    return 1;
+                }
+            } else if (arg == "--output") {
+                if (!util::ArgReadString(&argc, &argv, &output)) {
+                    std::cerr << "Failure reading output" << std::endl << std::endl;
+                    Usage(std::cerr);
+                    return 1;
+                }
+            } else if (arg == "--fps") {
+                if (!util::ArgReadDouble(&argc, &argv, &fps) || fps <= 0.0) {
+                    std::cerr << "Failure reading fps" << std::endl << std::endl;
+                    Usage(std::cerr);
+                    return 1;
+                }
+            } else if (arg == "--threads") {
+                if (!util::ArgReadInt(&argc, &argv, &pipelineConfig.Workers)) {
+                    std::cerr << "Failure reading threads" << std::endl << std::endl;
+                    Usage(std::cerr);
+                    return 1;
+                }
             } else if (arg == "--inplace") {
                 inplace = true;
             } else if (arg == "--directory") {
@@ -115,45 +251,31 @@ int main(int argc, char** argv) {
         Usage(std::cerr);
         return 1;
     }
-    if (!inplace) {
-        std::cerr << "Must be inplace for now because I haven't written the rest >_>" << std::endl << std::endl;
-        return 1;
-    }
 
-    if (images.empty()) {
-        return 0;
-    }
-
-    std::unordered_map<int, std::unordered_map<int, video::PixelContributions>> pcontrib;
+    try {
+        if (!input.empty()) {
+            if (output.empty() || !images.empty()) {
+                std::cerr << "A video needs an --output, and no images" << std::endl << std::endl;
+                Usage(std::cerr);
+                return 1;
+            }
+            return ProcessVideo(input, output, fps, bp, outx, outy, pipelineConfig);
+        }
 
-    size_t i = 0;
-    for (auto & imgPath : images) {
-        cv::Mat m = cv::imread(imgPath);
-        if (m.empty() || m.rows == 0 || m.cols == 0) {
-            std::cerr << "Invalid imgpath: " << imgPath << std::endl;
+        if (inplace == !output.empty()) {
+            std::cerr << "Images need one of --inplace or --output" << std::endl << std::endl;
+            Usage(std::cerr);
             return 1;
         }
-
-        auto& pmap = pcontrib[m.cols];
-        auto it = pmap.find(m.rows);
-        video::PixelContributions* thisContrib;
-
-        if (it == pmap.end()) {
-            std::cout << "computing pixel contributions: " << m.rows << "x" << m.cols << std::endl;
-            thisContrib = &pmap[m.rows];
-            video::ComputePixelContributions(m.rows, m.cols, bp, 
-                    thisContrib, outx, outy);
-        } else {
-            thisContrib = &it->second;
+        if (images.empty()) {
+            return 0;
         }
-
-        cv::Mat u = video::RemoveCRT(m, *thisContrib, outx, outy);
-        cv::imwrite(imgPath, u);
-        i++;
-        std::cout << i << " " << images.size() << "\r" << std::flush;
-        //fmt::print(" {:7d} / {:7d} \r", i, images.size());
+        if (!output.empty()) {
+            util::fs::create_directories(output);
+        }
+        return ProcessImages(images, output, bp, outx, outy, pipelineConfig);
+    } catch (const std::exception& e) {
+        std::cerr << std::endl << e.what() << std::endl;
+        return 1;
     }
-    std::cout << std::endl;
-
-    return 0;
 }
@@ -21,6 +21,9 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -34,11 +37,109 @@ using namespace rgms::video;
 
 ////////////////////////////////////////////////////////////////////////////////
 
-V4L2VideoSource::V4L2VideoSource(const std::string& input)
+V4L2VideoSourceConfig V4L2VideoSourceConfig::Defaults() {
+    V4L2VideoSourceConfig cfg;
+    cfg.PixelFormat = V4L2PixelFormat::AUTO;
+    cfg.Memory = V4L2Memory::MMAP;
+    cfg.NumBuffers = 6;
+    cfg.ExportDmabuf = false;
+    cfg.Crop = VideoCrop{util::Rect2F(0, 0, 0, 0), 0, 0};
+    return cfg;
+}
+
+// In order of preference for AUTO
+static const V4L2PixelFormat CONVERTIBLE_FORMATS[] = {
+    V4L2PixelFormat::YUYV,
+    V4L2PixelFormat::NV12,
+    V4L2PixelFormat::MJPEG,
+    V4L2PixelFormat::BGR24,
+};
+
+static uint32_t FourCC(V4L2PixelFormat format) {
+    switch (format) {
+        case V4L2PixelFormat::YUYV: return V4L2_PIX_FMT_YUYV;
+        case V4L2PixelFormat::NV12: return V4L2_PIX_FMT_NV12;
+        case V4L2PixelFormat::MJPEG: return V4L2_PIX_FMT_MJPEG;
+        case V4L2PixelFormat::BGR24: return V4L2_PIX_FMT_BGR24;
+        default: break;
+    }
+    return 0;
+}
+
+static bool IsJPEG(uint32_t fcc) {
+    return fcc == V4L2_PIX_FMT_MJPEG || fcc == V4L2_PIX_FMT_JPEG;
+}
+
+static bool CanConvert(uint32_t fcc) {
+    for (auto& format : CONVERTIBLE_FORMATS) {
+        if (FourCC(format) == fcc) {
+            return true;
+        }
+    }
+    return fcc == V4L2_PIX_FMT_JPEG;
+}
+
+static std::string FourCCString(uint32_t fcc) {
+    std::string s;
+    for (int i = 0; i < 4; i++) {
+        s.push_back(static_cast<char>((fcc >> (i * 8)) & 0x7f));
+    }
+    return s;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Owns the capture buffers, which have to outlive every V4L2RawFrame handed
+// out even across a Reopen. FileDescriptor is -1 once the source has closed
+// the device, after which released frames are no longer requeued.
+struct V4L2VideoSource::Buffers {
+    std::mutex Mutex;
+    int FileDescriptor = -1;
+    int QueueErrno = 0;
+    V4L2Memory Memory = V4L2Memory::MMAP;
+    std::vector<v4l2_buffer> Infos;
+    std::vector<uint8_t*> Data;
+    std::vector<size_t> Lengths;
+    std::vector<int> DmabufFds;
+
+    ~Buffers() {
+        for (size_t i = 0; i < Data.size(); i++) {
+            if (!Data[i]) {
+                continue;
+            }
+            if (Memory == V4L2Memory::MMAP) {
+                munmap(Data[i], Lengths[i]);
+            } else {
+                std::free(Data[i]);
+            }
+        }
+        for (int fd : DmabufFds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    void Requeue(int index) {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if (FileDescriptor >= 0 && v4l2_ioctl(FileDescriptor, VIDIOC_QBUF, &Infos[index]) < 0) {
+            QueueErrno = errno;
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+V4L2VideoSource::V4L2VideoSource(const std::string& input, const V4L2VideoSourceConfig& config)
     : m_Input(input) 
+    , m_Config(config)
+    , m_ErrorState(ErrorState::NO_ERROR)
     , m_FileDescriptor(-1)
+    , m_Width(0)
+    , m_Height(0)
+    , m_BytesPerLine(0)
+    , m_PixelFormat(0)
     , m_Streamon(false)
-    , m_ErrorState(ErrorState::NO_ERROR)
 {
     Open();
 }
@@ -47,22 +148,23 @@ V4L2VideoSource::~V4L2VideoSource() {
     Close();
 }
 
+void V4L2VideoSource::SetError(const char* what, int err, ErrorState state) {
+    std::ostringstream os;
+    os << what << ": " << strerror(err);
+    m_LastError = os.str();
+    m_ErrorState = state;
+}
+
 void V4L2VideoSource::Open() {
     m_FileDescriptor = open(m_Input.c_str(), O_RDWR | O_NONBLOCK);
     if (m_FileDescriptor < 0) {
-        std::ostringstream os;
-        os << "Failed opening video stream: " << strerror(errno);
-        m_LastError = os.str();
-        m_ErrorState = ErrorState::CAN_NOT_OPEN_SOURCE;
+        SetError("Failed opening video stream", errno, ErrorState::CAN_NOT_OPEN_SOURCE);
         return;
     }
 
     v4l2_capability cap;
     if (v4l2_ioctl(m_FileDescriptor, VIDIOC_QUERYCAP, &cap) < 0) {
-        std::ostringstream os;
-        os << "Failed querying video capabilities: " << strerror(errno);
-        m_LastError = os.str();
-        m_ErrorState = ErrorState::OTHER_ERROR;
+        SetError("Failed querying video capabilities", errno);
         return;
     }
 
@@ -77,104 +179,175 @@ void V4L2VideoSource::Open() {
         m_ErrorState = ErrorState::OTHER_ERROR;
         return;
     }
-
-    v4l2_format format = {};
-    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(m_FileDescriptor, VIDIOC_G_FMT, &format) < 0) {
-        std::ostringstream os;
-        os << "VIDIOC_G_FMT failed: " << strerror(errno);
-        m_LastError = os.str();
+    if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+        m_LastError = "Streaming i/o not supported";
         m_ErrorState = ErrorState::OTHER_ERROR;
         return;
     }
 
+    v4l2_format format = {};
+    if (!NegotiateFormat(&format)) {
+        return;
+    }
     m_Width = format.fmt.pix.width;
     m_Height = format.fmt.pix.height;
-    format.fmt.pix.pixelformat = V4L2_PIX_FMT_BGR24;
-    if (ioctl(m_FileDescriptor, VIDIOC_S_FMT, &format) < 0) {
-        std::ostringstream os;
-        os << "VIDIOC_S_FMT failed: " << strerror(errno);
-        m_LastError = os.str();
-        m_ErrorState = ErrorState::OTHER_ERROR;
+    m_BytesPerLine = format.fmt.pix.bytesperline;
+    m_PixelFormat = format.fmt.pix.pixelformat;
+
+    if (!SetupBuffers(format)) {
         return;
     }
+    m_Streamon = false;
 
-    info << "[" << m_Width << "x" << m_Height << "] : BGR24" << std::endl;
+    info << "[" << m_Width << "x" << m_Height << "] : " << FourCCString(m_PixelFormat)
+         << " " << m_Buffers->Infos.size()
+         << (m_Config.Memory == V4L2Memory::MMAP ? " mmap" : " userptr") << " buffers";
+    if (m_Config.Crop.OutWidth > 0 && m_Config.Crop.OutHeight > 0) {
+        info << ", cropped to " << m_Config.Crop.OutWidth << "x" << m_Config.Crop.OutHeight;
+    }
+    info << std::endl;
+    m_Information = info.str();
+}
 
-    int nbufs = 4;
+bool V4L2VideoSource::NegotiateFormat(v4l2_format* format) {
+    format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (v4l2_ioctl(m_FileDescriptor, VIDIOC_G_FMT, format) < 0) {
+        SetError("VIDIOC_G_FMT failed", errno);
+        return false;
+    }
+
+    uint32_t want = FourCC(m_Config.PixelFormat);
+    if (m_Config.PixelFormat == V4L2PixelFormat::AUTO) {
+        if (CanConvert(format->fmt.pix.pixelformat)) {
+            want = format->fmt.pix.pixelformat;
+        } else {
+            std::vector<uint32_t> supported;
+            v4l2_fmtdesc desc = {};
+            desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            while (v4l2_ioctl(m_FileDescriptor, VIDIOC_ENUM_FMT, &desc) == 0) {
+                supported.push_back(desc.pixelformat);
+                desc.index++;
+            }
+
+            want = V4L2_PIX_FMT_BGR24; // and hope libv4l can convert to it
+            for (auto& candidate : CONVERTIBLE_FORMATS) {
+                if (std::find(supported.begin(), supported.end(), FourCC(candidate)) != supported.end()) {
+                    want = FourCC(candidate);
+                    break;
+                }
+            }
+        }
+    }
+
+    format->fmt.pix.pixelformat = want;
+    if (v4l2_ioctl(m_FileDescriptor, VIDIOC_S_FMT, format) < 0) {
+        SetError("VIDIOC_S_FMT failed", errno);
+        return false;
+    }
+    if (!CanConvert(format->fmt.pix.pixelformat)) {
+        m_LastError = "Unsupported pixel format: " + FourCCString(format->fmt.pix.pixelformat);
+        m_ErrorState = ErrorState::OTHER_ERROR;
+        return false;
+    }
+    return true;
+}
 
+bool V4L2VideoSource::SetupBuffers(const v4l2_format& format) {
+    auto buffers = std::make_shared<Buffers>();
+    buffers->FileDescriptor = m_FileDescriptor;
+    buffers->Memory = m_Config.Memory;
+    m_Buffers = buffers;
+
+    bool mmapped = m_Config.Memory == V4L2Memory::MMAP;
     v4l2_requestbuffers req = {0};
-    req.count = nbufs;
+    req.count = std::max(m_Config.NumBuffers, 2);
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    req.memory = mmapped ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
     if (v4l2_ioctl(m_FileDescriptor, VIDIOC_REQBUFS, &req) < 0) {
-        std::ostringstream os;
-        os << "VIDIOC_REQBUFS failed: " << strerror(errno);
-        m_LastError = os.str();
-        m_ErrorState = ErrorState::OTHER_ERROR;
-        return;
+        SetError("VIDIOC_REQBUFS failed", errno);
+        return false;
     }
 
-    m_BufferInfos.resize(nbufs);
-    m_Buffers.resize(nbufs);
+    // The driver is free to give us a different number of buffers
+    int nbufs = req.count;
+    buffers->Infos.resize(nbufs);
+    buffers->Data.resize(nbufs, nullptr);
+    buffers->Lengths.resize(nbufs, 0);
+    buffers->DmabufFds.resize(nbufs, -1);
+
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t userLength = (format.fmt.pix.sizeimage + pageSize - 1) / pageSize * pageSize;
     for (int i = 0; i < nbufs; i++) {
-        v4l2_buffer& buf = m_BufferInfos[i];
+        v4l2_buffer& buf = buffers->Infos[i];
         memset(&buf, 0, sizeof(buf));
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+        buf.memory = req.memory;
         buf.index = i;
-        if (v4l2_ioctl(m_FileDescriptor, VIDIOC_QUERYBUF, &buf)) {
-            std::ostringstream os;
-            os << "VIDIOC_REQBUFS failed: " << strerror(errno);
-            m_LastError = os.str();
-            m_ErrorState = ErrorState::OTHER_ERROR;
-            return;
-        }
 
-        m_Buffers[i] = mmap(NULL, 
-            buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, 
-            m_FileDescriptor, buf.m.offset);
-        if (m_Buffers[i] == MAP_FAILED) {
-            std::ostringstream os;
-            os << "map failed: " << strerror(errno);
-            m_LastError = os.str();
-            m_ErrorState = ErrorState::OTHER_ERROR;
-            return;
+        if (mmapped) {
+            if (v4l2_ioctl(m_FileDescriptor, VIDIOC_QUERYBUF, &buf) < 0) {
+                SetError("VIDIOC_QUERYBUF failed", errno);
+                return false;
+            }
+
+            void* data = mmap(NULL, 
+                buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, 
+                m_FileDescriptor, buf.m.offset);
+            if (data == MAP_FAILED) {
+                SetError("map failed", errno);
+                return false;
+            }
+            buffers->Data[i] = reinterpret_cast<uint8_t*>(data);
+            buffers->Lengths[i] = buf.length;
+
+            if (m_Config.ExportDmabuf) {
+                v4l2_exportbuffer exp = {};
+                exp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                exp.index = i;
+                exp.flags = O_RDONLY | O_CLOEXEC;
+                if (v4l2_ioctl(m_FileDescriptor, VIDIOC_EXPBUF, &exp) < 0) {
+                    SetError("VIDIOC_EXPBUF failed", errno);
+                    return false;
+                }
+                buffers->DmabufFds[i] = exp.fd;
+            }
+        } else {
+            void* data = std::aligned_alloc(pageSize, userLength);
+            if (!data) {
+                m_LastError = "Failed allocating capture buffers";
+                m_ErrorState = ErrorState::OTHER_ERROR;
+                return false;
+            }
+            buffers->Data[i] = reinterpret_cast<uint8_t*>(data);
+            buffers->Lengths[i] = userLength;
+            buf.m.userptr = reinterpret_cast<unsigned long>(data);
+            buf.length = static_cast<uint32_t>(userLength);
         }
-
-        memset(m_Buffers[i], 0, buf.length);
     }
 
-    for (auto& buf : m_BufferInfos) {
+    for (auto& buf : buffers->Infos) {
         if (v4l2_ioctl(m_FileDescriptor, VIDIOC_QBUF, &buf) < 0) {
-            std::ostringstream os;
-            os << "VIDIOC_QBUF failed: " << strerror(errno);
-            m_LastError = os.str();
-            m_ErrorState = ErrorState::OTHER_ERROR;
-            return;
+            SetError("VIDIOC_QBUF failed", errno);
+            return false;
         }
     }
-    m_Streamon = false;
-
-    //uint32_t fcc = format.fmt.pix.pixelformat;
-    //std::cout << static_cast<char>((fcc      ) & 0x7f);
-    //std::cout << static_cast<char>((fcc >>  8) & 0x7f);
-    //std::cout << static_cast<char>((fcc >> 16) & 0x7f);
-    //std::cout << static_cast<char>((fcc >> 24) & 0x7f) << std::endl;
-
-
-    m_Information = info.str();
-
+    return true;
 }
 
 void V4L2VideoSource::Close() {
+    // Frames still held elsewhere keep their mapping, but must not requeue
+    // into a closed (or worse, reused) file descriptor
+    std::shared_ptr<Buffers> buffers = std::move(m_Buffers);
+    std::unique_lock<std::mutex> lock;
+    if (buffers) {
+        lock = std::unique_lock<std::mutex>(buffers->Mutex);
+        buffers->FileDescriptor = -1;
+    }
+
     if (m_Streamon) {
         int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (v4l2_ioctl(m_FileDescriptor, VIDIOC_STREAMOFF, &type) < 0) {
-            std::ostringstream os;
-            os << "VIDIOC_STREAMOFF failed: " << strerror(errno);
-            m_LastError = os.str();
-            m_ErrorState = ErrorState::OTHER_ERROR;
+            SetError("VIDIOC_STREAMOFF failed", errno);
         }
         m_Streamon = false;
     }
@@ -186,66 +359,276 @@ void V4L2VideoSource::Close() {
 }
 
 int V4L2VideoSource::Width() const {
+    if (m_Config.Crop.OutWidth > 0 && m_Config.Crop.OutHeight > 0) {
+        return m_Config.Crop.OutWidth;
+    }
     return m_Width;
 }
 
 int V4L2VideoSource::Height() const {
+    if (m_Config.Crop.OutWidth > 0 && m_Config.Crop.OutHeight > 0) {
+        return m_Config.Crop.OutHeight;
+    }
     return m_Height;
 }
 
-GetResult V4L2VideoSource::Get(uint8_t* buffer, int64_t* ptsMilliseconds) {
-    if (m_LastError != "") {
+GetResult V4L2VideoSource::GetRaw(V4L2RawFramePtr* frame) {
+    if (m_LastError != "" || !m_Buffers) {
         return GetResult::FAILURE;
     }
     if (!m_Streamon) {
         int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (v4l2_ioctl(m_FileDescriptor, VIDIOC_STREAMON, &type) < 0) {
-            std::ostringstream os;
-            os << "VIDIOC_STREAMON failed: " << strerror(errno);
-            m_LastError = os.str();
-            m_ErrorState = ErrorState::OTHER_ERROR;
+            SetError("VIDIOC_STREAMON failed", errno);
             return GetResult::FAILURE;
         }
         m_Streamon = true;
     }
-    memset(&m_GetBuffer, 0, sizeof(m_GetBuffer));
-    m_GetBuffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    m_GetBuffer.memory = V4L2_MEMORY_MMAP;
 
-    int ret = v4l2_ioctl(m_FileDescriptor, VIDIOC_DQBUF, &m_GetBuffer);
-    if (ret == 0) {
-        int index = m_GetBuffer.index;
-        if (v4l2_ioctl(m_FileDescriptor, VIDIOC_QBUF, &m_BufferInfos[index]) < 0) {
-            std::ostringstream os;
-            os << "VIDIOC_QBUF failed: " << strerror(errno);
-            m_LastError = os.str();
-            m_ErrorState = ErrorState::OTHER_ERROR;
+    std::shared_ptr<Buffers> buffers = m_Buffers;
+    v4l2_buffer buf = {};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = buffers->Infos[0].memory;
+
+    int ret, err;
+    {
+        std::lock_guard<std::mutex> lock(buffers->Mutex);
+        if (buffers->QueueErrno) {
+            SetError("VIDIOC_QBUF failed", buffers->QueueErrno);
             return GetResult::FAILURE;
         }
+        ret = v4l2_ioctl(m_FileDescriptor, VIDIOC_DQBUF, &buf);
+        err = errno;
+    }
+
+    if (ret == 0) {
+        int index = buf.index;
+        if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+            // A corrupted frame, just skip it
+            buffers->Requeue(index);
+            return GetResult::AGAIN;
+        }
+
+        V4L2RawFrame* f = new V4L2RawFrame;
+        f->Data = buffers->Data[index];
+        f->BytesUsed = buf.bytesused;
+        f->PixelFormat = m_PixelFormat;
+        f->Width = m_Width;
+        f->Height = m_Height;
+        f->BytesPerLine = m_BytesPerLine;
+        f->DmabufFd = buffers->DmabufFds[index];
+        f->PtsMilliseconds = buf.timestamp.tv_sec * 1000 + buf.timestamp.tv_usec / 1000;
+        *frame = V4L2RawFramePtr(f, [buffers, index](const V4L2RawFrame* f) {
+            delete f;
+            buffers->Requeue(index);
+        });
+        return GetResult::SUCCESS;
+    } else if (err == EAGAIN) {
+        return GetResult::AGAIN;
+    }
+
+    SetError("VIDIOC_DQBUF failed", err);
+    return GetResult::FAILURE;
+}
 
-        // Got a frame!
+GetResult V4L2VideoSource::Get(uint8_t* buffer, int64_t* ptsMilliseconds) {
+    V4L2RawFramePtr frame;
+    GetResult res = GetRaw(&frame);
+    if (res == GetResult::SUCCESS) {
+        // Converted before the buffer goes back to the driver
         if (buffer) {
-            std::copy(reinterpret_cast<uint8_t*>(m_Buffers[index]), 
-                    reinterpret_cast<uint8_t*>(m_Buffers[index]) + m_GetBuffer.length, 
-                    buffer);
+            Convert(*frame, buffer);
         }
         if (ptsMilliseconds) {
-            *ptsMilliseconds = m_GetBuffer.timestamp.tv_sec * 1000 + m_GetBuffer.timestamp.tv_usec / 1000;
+            *ptsMilliseconds = frame->PtsMilliseconds;
         }
-        return GetResult::SUCCESS;
-    } else if (errno == EAGAIN) {
-        return GetResult::AGAIN;
+    }
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// As CroppedVideoSource
+static void CropInto(const cv::Mat& in, const VideoCrop& crop, cv::Mat& out) {
+    cv::Rect src, dst;
+    if (CropGeometry(in.cols, in.rows, crop, &src, &dst)) {
+        if (dst.width != out.cols || dst.height != out.rows) {
+            out.setTo(cv::Scalar::all(0));
+        }
+        cv::Mat o = out(dst);
+        cv::resize(in(src), o, dst.size(), 0, 0, cv::INTER_AREA);
     } else {
-        std::ostringstream os;
-        os << "VIDIOC_DQBUF failed: " << strerror(errno);
-        m_LastError = os.str();
-        m_ErrorState = ErrorState::OTHER_ERROR;
-        return GetResult::FAILURE;
+        out.setTo(cv::Scalar::all(0));
     }
+}
 
-    return GetResult::FAILURE;
+static inline uint8_t Clamp8(int v) {
+    return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// BT.601 limited range in 20 bit fixed point, matching OpenCV's COLOR_YUV2BGR_*
+static inline void YUVToBGR(int y, int u, int v, uint8_t* bgr) {
+    int yy = std::max(0, y - 16) * 1220542 + (1 << 19);
+    u -= 128;
+    v -= 128;
+    bgr[0] = Clamp8((yy + 2116026 * u) >> 20);
+    bgr[1] = Clamp8((yy - 409993 * u - 852492 * v) >> 20);
+    bgr[2] = Clamp8((yy + 1673527 * v) >> 20);
 }
 
+void V4L2VideoSource::Convert(const V4L2RawFrame& frame, uint8_t* buffer) {
+    cv::Mat out(Height(), Width(), CV_8UC3, buffer);
+    uint8_t* data = const_cast<uint8_t*>(frame.Data);
+    bool hasCrop = m_Config.Crop.OutWidth > 0 && m_Config.Crop.OutHeight > 0;
+
+    if (IsJPEG(frame.PixelFormat)) {
+        cv::Mat jpeg(1, static_cast<int>(frame.BytesUsed), CV_8UC1, data);
+        if (!hasCrop) {
+            cv::imdecode(jpeg, cv::IMREAD_COLOR, &out);
+            return;
+        }
+
+        // Let the decoder do most of the downscaling when the crop allows
+        VideoCrop crop = m_Config.Crop;
+        int flags = cv::IMREAD_COLOR;
+        for (int reduce : {8, 4, 2}) {
+            if (std::abs(crop.CropRect.Width) >= crop.OutWidth * reduce &&
+                std::abs(crop.CropRect.Height) >= crop.OutHeight * reduce) {
+                flags = reduce == 8 ? cv::IMREAD_REDUCED_COLOR_8 :
+                        reduce == 4 ? cv::IMREAD_REDUCED_COLOR_4 : cv::IMREAD_REDUCED_COLOR_2;
+                crop.CropRect.X /= reduce;
+                crop.CropRect.Y /= reduce;
+                crop.CropRect.Width /= reduce;
+                crop.CropRect.Height /= reduce;
+                break;
+            }
+        }
+        cv::imdecode(jpeg, flags, &m_Decoded);
+        CropInto(m_Decoded, crop, out);
+        return;
+    }
+
+    if (frame.PixelFormat == V4L2_PIX_FMT_BGR24) {
+        cv::Mat in(frame.Height, frame.Width, CV_8UC3, data, frame.BytesPerLine);
+        if (hasCrop) {
+            CropInto(in, m_Config.Crop, out);
+        } else {
+            in.copyTo(out);
+        }
+        return;
+    }
+
+    if (!hasCrop) {
+        if (frame.PixelFormat == V4L2_PIX_FMT_NV12) {
+            cv::Mat in(frame.Height * 3 / 2, frame.Width, CV_8UC1, data, frame.BytesPerLine);
+            cv::cvtColor(in, out, cv::COLOR_YUV2BGR_NV12);
+        } else {
+            cv::Mat in(frame.Height, frame.Width, CV_8UC2, data, frame.BytesPerLine);
+            cv::cvtColor(in, out, cv::COLOR_YUV2BGR_YUYV);
+        }
+        return;
+    }
+
+    cv::Rect src, dst;
+    if (CropGeometry(frame.Width, frame.Height, m_Config.Crop, &src, &dst)) {
+        if (dst.width != out.cols || dst.height != out.rows) {
+            out.setTo(cv::Scalar::all(0));
+        }
+        ConvertYUV(frame, src, dst, out);
+    } else {
+        out.setTo(cv::Scalar::all(0));
+    }
+}
+
+// Box filters the src rect of a YUYV or NV12 frame to the dst rect of out in
+// a single pass, so only output pixels are ever converted. Each output row
+// first sums its source rows into per column accumulators (which vectorizes
+// well), then each output pixel averages its columns and converts.
+void V4L2VideoSource::ConvertYUV(const V4L2RawFrame& frame, const cv::Rect& src,
+        const cv::Rect& dst, cv::Mat& out) {
+    // Chroma is shared by pixel pairs, so work on whole pairs
+    int x0 = src.x & ~1;
+    int x1 = std::min((src.x + src.width + 1) & ~1, frame.Width & ~1);
+    int pairs = (x1 - x0) / 2;
+    if (pairs <= 0) {
+        return;
+    }
+    m_SumY.resize(pairs * 2);
+    m_SumU.resize(pairs);
+    m_SumV.resize(pairs);
+
+    m_ColBegin.resize(dst.width);
+    m_ColEnd.resize(dst.width);
+    for (int i = 0; i < dst.width; i++) {
+        int b = src.x + static_cast<int>(static_cast<int64_t>(i) * src.width / dst.width);
+        int e = src.x + static_cast<int>(static_cast<int64_t>(i + 1) * src.width / dst.width);
+        m_ColEnd[i] = std::min(std::max(e, b + 1) - x0, pairs * 2);
+        m_ColBegin[i] = std::min(b - x0, m_ColEnd[i] - 1);
+    }
+
+    bool nv12 = frame.PixelFormat == V4L2_PIX_FMT_NV12;
+    const uint8_t* uvPlane = frame.Data + static_cast<size_t>(frame.BytesPerLine) * frame.Height;
+    int* sy = m_SumY.data();
+    int* su = m_SumU.data();
+    int* sv = m_SumV.data();
+
+    for (int y = 0; y < dst.height; y++) {
+        int r0 = src.y + static_cast<int>(static_cast<int64_t>(y) * src.height / dst.height);
+        int r1 = src.y + static_cast<int>(static_cast<int64_t>(y + 1) * src.height / dst.height);
+        r1 = std::max(r1, r0 + 1);
+
+        std::fill(m_SumY.begin(), m_SumY.end(), 0);
+        std::fill(m_SumU.begin(), m_SumU.end(), 0);
+        std::fill(m_SumV.begin(), m_SumV.end(), 0);
+        for (int r = r0; r < r1; r++) {
+            const uint8_t* row = frame.Data + static_cast<size_t>(r) * frame.BytesPerLine;
+            if (nv12) {
+                const uint8_t* luma = row + x0;
+                for (int i = 0; i < pairs * 2; i++) {
+                    sy[i] += luma[i];
+                }
+                const uint8_t* uv = uvPlane + static_cast<size_t>(r / 2) * frame.BytesPerLine + x0;
+                for (int i = 0; i < pairs; i++) {
+                    su[i] += uv[i * 2 + 0];
+                    sv[i] += uv[i * 2 + 1];
+                }
+            } else {
+                const uint8_t* yuyv = row + x0 * 2;
+                for (int i = 0; i < pairs; i++) {
+                    sy[i * 2 + 0] += yuyv[i * 4 + 0];
+                    su[i]         += yuyv[i * 4 + 1];
+                    sy[i * 2 + 1] += yuyv[i * 4 + 2];
+                    sv[i]         += yuyv[i * 4 + 3];
+                }
+            }
+        }
+
+        int rows = r1 - r0;
+        uint8_t* o = out.ptr<uint8_t>(dst.y + y) + dst.x * 3;
+        for (int i = 0; i < dst.width; i++) {
+            int b = m_ColBegin[i];
+            int e = m_ColEnd[i];
+            int ty = 0;
+            for (int c = b; c < e; c++) {
+                ty += sy[c];
+            }
+            int pb = b / 2;
+            int pe = (e + 1) / 2;
+            int tu = 0, tv = 0;
+            for (int c = pb; c < pe; c++) {
+                tu += su[c];
+                tv += sv[c];
+            }
+
+            int ny = (e - b) * rows;
+            int nc = (pe - pb) * rows;
+            YUVToBGR((ty + ny / 2) / ny, (tu + nc / 2) / nc, (tv + nc / 2) / nc, o + i * 3);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void V4L2VideoSource::Reopen() {
     Close();
     Open();
@@ -30,15 +30,79 @@
 
 namespace rgms::video {
 
+enum class V4L2PixelFormat {
+    AUTO, // the device's current format if we can convert it, otherwise the first below it supports
+    YUYV,
+    NV12,
+    MJPEG,
+    BGR24, // usually only available through libv4l's software conversion
+};
+#ifdef NLOHMANN_JSON_VERSION_MAJOR
+NLOHMANN_JSON_SERIALIZE_ENUM(V4L2PixelFormat, {
+    {V4L2PixelFormat::AUTO, "auto"},
+    {V4L2PixelFormat::YUYV, "yuyv"},
+    {V4L2PixelFormat::NV12, "nv12"},
+    {V4L2PixelFormat::MJPEG, "mjpeg"},
+    {V4L2PixelFormat::BGR24, "bgr24"},
+});
+#endif
+
+enum class V4L2Memory {
+    MMAP,    // driver allocated buffers mapped into our address space
+    USERPTR, // the driver writes straight into buffers we allocate
+};
+#ifdef NLOHMANN_JSON_VERSION_MAJOR
+NLOHMANN_JSON_SERIALIZE_ENUM(V4L2Memory, {
+    {V4L2Memory::MMAP, "mmap"},
+    {V4L2Memory::USERPTR, "userptr"},
+});
+#endif
+
+struct V4L2VideoSourceConfig {
+    V4L2PixelFormat PixelFormat;
+    V4L2Memory Memory;
+    int NumBuffers; // more buffers tolerate a slower reader at the cost of latency
+    bool ExportDmabuf; // MMAP only, see V4L2RawFrame::DmabufFd
+
+    // Applied while converting to BGR, so the full frame never is. See VideoCrop
+    VideoCrop Crop;
+
+    static V4L2VideoSourceConfig Defaults();
+};
+#ifdef NLOHMANN_JSON_VERSION_MAJOR
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(V4L2VideoSourceConfig,
+    PixelFormat,
+    Memory,
+    NumBuffers,
+    ExportDmabuf
+);
+#endif
+
+// A capture buffer in the device's native format, straight from the driver
+// without copying. It is handed back to the driver when the last reference
+// is dropped, so don't hold on to more than NumBuffers - 2 or capture stalls.
+struct V4L2RawFrame {
+    const uint8_t* Data;
+    size_t BytesUsed;
+    uint32_t PixelFormat; // V4L2_PIX_FMT_*
+    int Width, Height;
+    int BytesPerLine;
+    int DmabufFd; // -1 unless exported, owned by the source (dup it to keep it)
+    int64_t PtsMilliseconds;
+};
+typedef std::shared_ptr<const V4L2RawFrame> V4L2RawFramePtr;
+
 class V4L2VideoSource : public IVideoSource {
 public:
     // As: "/dev/videoX"
-    V4L2VideoSource(const std::string& input); 
+    V4L2VideoSource(const std::string& input,
+            const V4L2VideoSourceConfig& config = V4L2VideoSourceConfig::Defaults()); 
     ~V4L2VideoSource();
 
     int Width() const override final;
     int Height() const override final;
 
+    // Converts the next raw frame to BGR (cropped and scaled as configured)
     GetResult Get(uint8_t* buffer, int64_t* ptsMilliseconds) override final;
     void Reopen() override final;
     void ClearError() override final;
@@ -46,22 +110,40 @@ public:
     std::string GetLastError() override final;
     std::string GetInformation() override final;
 
+    // Zero copy access for callers that can consume the native format (or
+    // import the dmabuf) themselves. Safe to release frames from any thread.
+    GetResult GetRaw(V4L2RawFramePtr* frame);
+    void Convert(const V4L2RawFrame& frame, uint8_t* buffer);
+
 private:
+    struct Buffers;
+
     void Open();
     void Close();
+    bool NegotiateFormat(v4l2_format* format);
+    bool SetupBuffers(const v4l2_format& format);
+    void SetError(const char* what, int err, ErrorState state = ErrorState::OTHER_ERROR); // appends strerror(err)
 
+    void ConvertYUV(const V4L2RawFrame& frame, const cv::Rect& src,
+            const cv::Rect& dst, cv::Mat& out);
 
 private:
     std::string m_Input;
+    V4L2VideoSourceConfig m_Config;
     std::string m_LastError, m_Information;
     ErrorState m_ErrorState;
 
     int m_FileDescriptor;
-    int m_Width, m_Height;
-    std::vector<v4l2_buffer> m_BufferInfos;
-    std::vector<void*> m_Buffers;
-    v4l2_buffer m_GetBuffer;
+    int m_Width, m_Height; // of the device
+    int m_BytesPerLine;
+    uint32_t m_PixelFormat;
+    std::shared_ptr<Buffers> m_Buffers;
     bool m_Streamon;
+
+    // Scratch for conversions, reused between frames
+    cv::Mat m_Decoded;
+    std::vector<int> m_SumY, m_SumU, m_SumV;
+    std::vector<int> m_ColBegin, m_ColEnd;
 };
 
 }
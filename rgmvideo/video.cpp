@@ -23,11 +23,14 @@
 #include <iostream>
 #include <cassert>
 #include <sstream>
+#include <cstring>
+#include <algorithm>
 
 
 #include "fmt/core.h"
 
 #include "rgmvideo/video.h"
+#include "rgmvideo/framecache.h"
 
 using namespace rgms::video;
 
@@ -42,6 +45,193 @@ int IVideoSource::BufferSize() const {
     return Width() * Height() * 3;
 }
 
+int64_t VideoIndex::KeyframeAtOrBefore(int64_t frameIndex) const {
+    auto it = std::upper_bound(Keyframes.begin(), Keyframes.end(), frameIndex);
+    if (it == Keyframes.begin()) {
+        return -1;
+    }
+    return *std::prev(it);
+}
+
+int64_t VideoIndex::KeyframeAfter(int64_t frameIndex) const {
+    auto it = std::upper_bound(Keyframes.begin(), Keyframes.end(), frameIndex);
+    if (it == Keyframes.end()) {
+        return static_cast<int64_t>(Timestamps.size());
+    }
+    return *it;
+}
+
+int64_t VideoIndex::PtsMilliseconds(int64_t frameIndex) const {
+    double pts = static_cast<double>(Timestamps[frameIndex]) *
+        static_cast<double>(TimeBaseNumerator) / static_cast<double>(TimeBaseDenominator);
+    return static_cast<int64_t>(std::round(pts * 1000));
+}
+
+static const char VIDEO_INDEX_MAGIC[4] = {'G', 'I', 'D', 'X'};
+static const uint32_t VIDEO_INDEX_VERSION = 2;
+// magic, version, file size and write time, time base
+static const size_t VIDEO_INDEX_HEADER_SIZE = 4 + 4 + 4 * sizeof(int64_t);
+
+std::string rgms::video::VideoCacheDirectory(const std::string& name) {
+    std::string dir = util::UserCacheDirectory("graphite");
+    if (dir.empty()) {
+        return "";
+    }
+    util::fs::path p = util::fs::path(dir) / name;
+    std::error_code ec;
+    util::fs::create_directories(p, ec);
+    return ec ? "" : p.string();
+}
+
+std::string rgms::video::VideoIndexPath(const std::string& videoPath) {
+    std::string dir = VideoCacheDirectory("index");
+    if (dir.empty()) {
+        return "";
+    }
+    std::string absolutePath = util::fs::absolute(videoPath).string();
+
+    int64_t fileSize, fileWriteTime;
+    StatVideoFile(videoPath, &fileSize, &fileWriteTime);
+    uint64_t hash = util::FNV1a(absolutePath.data(), absolutePath.size());
+    hash = util::FNV1aPOD(fileSize, hash);
+    hash = util::FNV1aPOD(fileWriteTime, hash);
+
+    // The name of the video is only there to make the directory browsable
+    std::string name = fmt::format("{}.{:016x}.gidx",
+            util::fs::path(videoPath).stem().string(), hash);
+    return (util::fs::path(dir) / name).string();
+}
+
+void rgms::video::StatVideoFile(const std::string& videoPath,
+        int64_t* fileSize, int64_t* fileWriteTime) {
+    std::error_code ec;
+    *fileSize = static_cast<int64_t>(util::fs::file_size(videoPath, ec));
+    if (ec) {
+        *fileSize = -1;
+    }
+    *fileWriteTime = static_cast<int64_t>(
+            util::fs::last_write_time(videoPath, ec).time_since_epoch().count());
+    if (ec) {
+        *fileWriteTime = -1;
+    }
+}
+
+template <typename T>
+static void AppendPOD(std::vector<uint8_t>* data, const T& v) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&v);
+    data->insert(data->end(), p, p + sizeof(T));
+}
+
+template <typename T>
+static bool ReadPOD(const std::vector<uint8_t>& data, size_t* offset, T* v) {
+    if (*offset + sizeof(T) > data.size()) {
+        return false;
+    }
+    std::memcpy(v, data.data() + *offset, sizeof(T));
+    *offset += sizeof(T);
+    return true;
+}
+
+static bool ReadPODVector(const std::vector<uint8_t>& data, size_t* offset,
+        std::vector<int64_t>* v) {
+    uint64_t n;
+    if (!ReadPOD(data, offset, &n) || n > (data.size() - *offset) / sizeof(int64_t)) {
+        return false;
+    }
+    v->resize(n);
+    std::memcpy(v->data(), data.data() + *offset, n * sizeof(int64_t));
+    *offset += n * sizeof(int64_t);
+    return true;
+}
+
+bool rgms::video::ReadVideoIndexFile(const std::string& videoPath, VideoIndex* index) {
+    std::string path = VideoIndexPath(videoPath);
+    if (path.empty() || !util::FileExists(path)) {
+        return false;
+    }
+    std::vector<uint8_t> data;
+    try {
+        util::ReadFileToVector(path, &data);
+    } catch (const std::exception&) {
+        return false;
+    }
+
+    size_t offset = 0;
+    char magic[4];
+    uint32_t version;
+    VideoIndex idx;
+    if (!ReadPOD(data, &offset, &magic) ||
+            std::memcmp(magic, VIDEO_INDEX_MAGIC, sizeof(magic)) != 0 ||
+            !ReadPOD(data, &offset, &version) || version != VIDEO_INDEX_VERSION ||
+            !ReadPOD(data, &offset, &idx.FileSize) ||
+            !ReadPOD(data, &offset, &idx.FileWriteTime) ||
+            !ReadPOD(data, &offset, &idx.TimeBaseNumerator) ||
+            !ReadPOD(data, &offset, &idx.TimeBaseDenominator) ||
+            !ReadPODVector(data, &offset, &idx.Timestamps) ||
+            !ReadPODVector(data, &offset, &idx.Keyframes)) {
+        return false;
+    }
+    // The counts have to account for exactly the size of the file
+    size_t expectedSize = VIDEO_INDEX_HEADER_SIZE + 2 * sizeof(uint64_t) +
+        (idx.Timestamps.size() + idx.Keyframes.size()) * sizeof(int64_t);
+    if (offset != data.size() || expectedSize != data.size() ||
+            idx.Keyframes.size() > idx.Timestamps.size()) {
+        return false;
+    }
+
+    int64_t fileSize, fileWriteTime;
+    StatVideoFile(videoPath, &fileSize, &fileWriteTime);
+    if (fileSize != idx.FileSize || fileWriteTime != idx.FileWriteTime ||
+            idx.TimeBaseNumerator <= 0 || idx.TimeBaseDenominator <= 0) {
+        return false;
+    }
+    for (auto & k : idx.Keyframes) {
+        if (k < 0 || k >= static_cast<int64_t>(idx.Timestamps.size())) {
+            return false;
+        }
+    }
+
+    *index = std::move(idx);
+    return true;
+}
+
+void rgms::video::WriteVideoIndexFile(const std::string& videoPath, const VideoIndex& index) {
+    std::vector<uint8_t> data;
+    data.reserve(64 + (index.Timestamps.size() + index.Keyframes.size()) * sizeof(int64_t));
+    AppendPOD(&data, VIDEO_INDEX_MAGIC);
+    AppendPOD(&data, VIDEO_INDEX_VERSION);
+    AppendPOD(&data, index.FileSize);
+    AppendPOD(&data, index.FileWriteTime);
+    AppendPOD(&data, index.TimeBaseNumerator);
+    AppendPOD(&data, index.TimeBaseDenominator);
+    for (auto* v : {&index.Timestamps, &index.Keyframes}) {
+        AppendPOD(&data, static_cast<uint64_t>(v->size()));
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(v->data());
+        data.insert(data.end(), p, p + v->size() * sizeof(int64_t));
+    }
+
+    // Replaced in one step, so readers never see a partly written index
+    std::string path = VideoIndexPath(videoPath);
+    if (path.empty()) {
+        return;
+    }
+    std::string tmpPath = path + ".tmp";
+    util::WriteVectorToFile(tmpPath, data);
+    util::fs::rename(tmpPath, path);
+}
+
+ISeekableVideoSource::ISeekableVideoSource() {
+}
+
+ISeekableVideoSource::~ISeekableVideoSource() {
+}
+
+IVideoIndexer::IVideoIndexer() {
+}
+
+IVideoIndexer::~IVideoIndexer() {
+}
+
 std::string rgms::video::ToString(const GetResult& res) {
     if (res == GetResult::AGAIN) {
         return "GetResult::AGAIN";
@@ -65,14 +255,35 @@ LiveInputFrame::LiveInputFrame(int width, int height)
     , Buffer(new uint8_t[width * height * 3]) {
 }
 
+LiveInputFrame::LiveInputFrame(int width, int height, uint8_t* buffer, std::shared_ptr<void> pin)
+    : Width(width)
+    , Height(height)
+    , Buffer(buffer)
+    , Pin(pin) {
+}
+
 LiveInputFrame::~LiveInputFrame() {
-    if (Buffer) {
+    if (Buffer && !Pin) {
         delete[] Buffer;
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// The ring never resizes, so leave room for the queue capacity to grow
+static constexpr int64_t LIVE_RING_MIN_SIZE = 64;
+// Frames that consumers can hold on to outside of the queue before the
+// watching thread has to wait for one to come back
+static constexpr int LIVE_POOL_SPARE_FRAMES = 8;
+
+static int64_t LiveRingSize(int queueSize) {
+    int64_t n = 1;
+    while (n < std::max(static_cast<int64_t>(queueSize), LIVE_RING_MIN_SIZE)) {
+        n <<= 1;
+    }
+    return n;
+}
+
 LiveVideoThread::LiveVideoThread(IVideoSourcePtr source, int queueSize, bool allowDiscard)
     : m_ShouldStop(false)
     , m_ShouldReset(false)
@@ -82,12 +293,23 @@ LiveVideoThread::LiveVideoThread(IVideoSourcePtr source, int queueSize, bool all
     , m_NumReadFramesSinceLastReset(0)
     , m_NumDiscardedFrames(0)
     , m_NumDiscardedFramesSinceLastReset(0)
-    , m_ResetThreshold(-1)
-    , m_QueueCapacity(queueSize)
     , m_AllowDiscard(allowDiscard)
+    , m_ResetThreshold(-1)
+    , m_RingSize(LiveRingSize(queueSize))
+    , m_QueueCapacity(std::clamp(static_cast<int64_t>(queueSize), int64_t{1}, m_RingSize))
     , m_StartTime(util::mclock::now())
     , m_ResetTime(m_StartTime)
+    , m_LastHit(m_StartTime)
     , m_InformationString(source->GetInformation())
+    , m_Ring(m_RingSize)
+    , m_Head(0)
+    , m_Tail(0)
+    , m_LatestIndex(-1)
+    , m_PoolCapacity(static_cast<int>(m_RingSize) + LIVE_POOL_SPARE_FRAMES)
+    , m_Pool(new LiveInputFramePtr[m_PoolCapacity])
+    , m_PoolSize(0)
+    , m_PoolNext(0)
+    , m_PoolSequence(m_PoolCapacity, -1)
     , m_LiveInput(std::move(source))
 {
     if (!m_LiveInput) {
@@ -102,63 +324,113 @@ LiveVideoThread::~LiveVideoThread() {
     m_WatchingThread.join();
 }
 
+// A pool index read from the ring (or m_LatestIndex) might be recycled by the
+// watching thread before we take our reference. Once we hold it the frame
+// can't be recycled, so it is good if it was still queued afterwards. The
+// fences pair with the one in AcquirePoolFrame.
 LiveInputFramePtr LiveVideoThread::GetLatestFrame() const {
-    LiveInputFramePtr f;
-    {
-        std::lock_guard<std::mutex> lock(m_SharedMutex);
-        f = m_LatestFrame;
+    while (true) {
+        int i = m_LatestIndex.load();
+        if (i < 0) {
+            return nullptr;
+        }
+        LiveInputFramePtr f = m_Pool[i];
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_LatestIndex.load() == i) {
+            return f;
+        }
+    }
+}
+
+LiveInputFramePtr LiveVideoThread::PeekFrame(int index) const {
+    while (true) {
+        int64_t head = m_Head.load();
+        int64_t tail = m_Tail.load();
+        if (index >= tail - head) {
+            return nullptr;
+        }
+        LiveInputFramePtr f = m_Pool[m_Ring[(head + index) & (m_RingSize - 1)].load()];
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_Head.load() == head) {
+            return f;
+        }
     }
-    return f;
 }
 
 LiveInputFramePtr LiveVideoThread::GetFrame(int index, int advance) {
     if (index >= 0) {
-        std::lock_guard<std::mutex> lock(m_SharedMutex);
-        if (m_Queue.empty() || index >= m_Queue.size()) {
-            return nullptr;
+        LiveInputFramePtr p = PeekFrame(index);
+        if (p) {
+            Advance(advance);
         }
-        auto p = m_Queue[index];
-        AdvanceAlreadyLocked(advance);
         return p;
     }
     return nullptr;
 }
 
-
 void LiveVideoThread::Advance(int amt) {
     if (amt > 0) {
-        std::lock_guard<std::mutex> lock(m_SharedMutex);
-        AdvanceAlreadyLocked(amt);
+        int64_t head = m_Head.load();
+        int64_t next;
+        do {
+            next = std::min(head + amt, m_Tail.load());
+        } while (!m_Head.compare_exchange_weak(head, next));
     }
 }
 
-void LiveVideoThread::AdvanceAlreadyLocked(int amt) {
-    if (amt > 0) {
-        if (amt >= m_Queue.size()) {
-            m_Queue.clear();
-        } else {
-            m_Queue.erase(m_Queue.begin(), m_Queue.begin() + amt);
+// Only called from the watching thread. A frame can be reused when it isn't
+// queued, isn't the latest, and the pool holds the only reference.
+int LiveVideoThread::AcquirePoolFrame(int width, int height) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t head = m_Head.load();
+    int latest = m_LatestIndex.load();
+    for (int j = 0; j < m_PoolSize; j++) {
+        int i = (m_PoolNext + j) % m_PoolSize;
+        if (i == latest || m_PoolSequence[i] >= head || m_Pool[i].use_count() != 1) {
+            continue;
+        }
+        // use_count is a relaxed load, pair with the release of the last holder
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        LiveInputFrame* f = m_Pool[i].get();
+        if (f->Width != width || f->Height != height) {
+            delete[] f->Buffer;
+            f->Width = width;
+            f->Height = height;
+            f->Buffer = new uint8_t[width * height * 3];
         }
+        m_PoolNext = (i + 1) % m_PoolSize;
+        return i;
     }
-}
-
 
+    if (m_PoolSize < m_PoolCapacity) {
+        m_Pool[m_PoolSize] = std::make_shared<LiveInputFrame>(width, height);
+        return m_PoolSize++;
+    }
+    return -1;
+}
 
-void LiveVideoThread::ProcessReadFrame(LiveInputFramePtr p) {
-    p->FrameNumber = m_NumReadFrames;
+void LiveVideoThread::ProcessReadFrame(int poolIndex) {
+    m_Pool[poolIndex]->FrameNumber = m_NumReadFrames;
     m_NumReadFrames++;
     m_NumReadFramesSinceLastReset++;
-    {
-        std::lock_guard<std::mutex> lock(m_SharedMutex);
-        if (static_cast<int>(m_Queue.size()) >= m_QueueCapacity && m_AllowDiscard) {
+
+    int64_t tail = m_Tail.load();
+    int64_t head = m_Head.load();
+    int64_t capacity = m_QueueCapacity;
+    while (m_AllowDiscard && tail - head >= capacity) {
+        if (m_Head.compare_exchange_weak(head, head + 1)) {
             m_NumDiscardedFramesSinceLastReset++;
             m_NumDiscardedFrames++;
-            m_Queue.pop_front();
+            head++;
         }
-        m_Queue.push_back(p);
-        m_LatestFrame = p;
-        m_LastHit = util::mclock::now();
     }
+
+    m_PoolSequence[poolIndex] = tail;
+    m_Ring[tail & (m_RingSize - 1)].store(poolIndex);
+    m_Tail.store(tail + 1);
+    m_LatestIndex.store(poolIndex);
+    m_LastHit = util::mclock::now();
 }
 
 int64_t LiveVideoThread::MillisecondsSinceLastFrame() const {
@@ -174,43 +446,45 @@ bool LiveVideoThread::ShouldReset() {
 }
 
 void LiveVideoThread::WatchingThread() {
-    auto AllocFrame = [&](){
-        LiveInputFramePtr p = std::make_shared<LiveInputFrame>(
+    // Preallocate enough for the queue, the latest frame and one being read
+    int n = static_cast<int>(std::min<int64_t>(m_QueueCapacity + 2, m_PoolCapacity));
+    for (; m_PoolSize < n; m_PoolSize++) {
+        m_Pool[m_PoolSize] = std::make_shared<LiveInputFrame>(
                 m_LiveInput->Width(), m_LiveInput->Height());
-        return p;
-    };
-    LiveInputFramePtr p = AllocFrame();
+    }
 
+    int p = -1;
 
     while (!m_ShouldStop) {
         if (ShouldReset()) {
             Reset();
-            p = AllocFrame();
+            p = -1;
         }
         if (m_Paused) {
             std::this_thread::sleep_for(std::chrono::milliseconds(2));
             continue;
         }
 
-        if (!m_AllowDiscard) {
-            bool queueFull = false;
-            {
-                std::lock_guard<std::mutex> lock(m_SharedMutex);
-                queueFull = static_cast<int>(m_Queue.size()) >= m_QueueCapacity;
-            }
+        if (!m_AllowDiscard && m_Tail - m_Head >= m_QueueCapacity) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
 
-            if (queueFull) {
+        if (p < 0) {
+            p = AcquirePoolFrame(m_LiveInput->Width(), m_LiveInput->Height());
+            if (p < 0) {
+                // Consumers are holding on to every spare frame
                 std::this_thread::sleep_for(std::chrono::milliseconds(2));
                 continue;
             }
         }
 
-        GetResult res = m_LiveInput->Get(p->Buffer, &p->PtsMilliseconds);
+        GetResult res = m_LiveInput->Get(m_Pool[p]->Buffer, &m_Pool[p]->PtsMilliseconds);
         if (res == GetResult::AGAIN) {
             std::this_thread::sleep_for(std::chrono::milliseconds(2));
         } else if (res == GetResult::SUCCESS) {
             ProcessReadFrame(p);
-            p = AllocFrame();
+            p = -1;
         } else {
             {
                 std::lock_guard<std::mutex> lock(m_SharedMutex);
@@ -243,7 +517,10 @@ void LiveVideoThread::Reset() {
         m_InformationString = m_LiveInput->GetInformation();
         m_HasError = m_ErrorString != "";
         m_ResetTime = util::mclock::now();
-        m_Queue.clear();
+    }
+    int64_t tail = m_Tail.load();
+    int64_t head = m_Head.load();
+    while (head < tail && !m_Head.compare_exchange_weak(head, tail)) {
     }
     m_ShouldReset = false;
     m_NumReadFramesSinceLastReset = 0;
@@ -288,8 +565,8 @@ int64_t LiveVideoThread::OpenMillisecondsSinceLastReset() const {
 }
 
 int64_t LiveVideoThread::QueueSize() const {
-    std::lock_guard<std::mutex> lock(m_SharedMutex);
-    return static_cast<int64_t>(m_Queue.size());
+    int64_t head = m_Head.load();
+    return m_Tail.load() - head;
 }
 
 int64_t LiveVideoThread::GetResetThresholdMilliseconds() const {
@@ -305,7 +582,7 @@ int64_t LiveVideoThread::GetQueueCapacity() const {
 }
 
 void LiveVideoThread::SetQueueCapacity(int64_t capacity) {
-    m_QueueCapacity = capacity;
+    m_QueueCapacity = std::clamp(capacity, int64_t{1}, m_RingSize);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -392,19 +669,145 @@ std::string CVVideoCaptureSource::GetInformation() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+bool rgms::video::CropGeometry(int frameWidth, int frameHeight, const VideoCrop& crop,
+        cv::Rect* srcRect, cv::Rect* dstRect) {
+    cv::Rect cropRect(crop.CropRect.X, crop.CropRect.Y, crop.CropRect.Width, crop.CropRect.Height);
+    if (cropRect.width < 0) {
+        cropRect.x += cropRect.width;
+        cropRect.width = -cropRect.width;
+    }
+    if (cropRect.height < 0) {
+        cropRect.y += cropRect.height;
+        cropRect.height = -cropRect.height;
+    }
+    if (cropRect.width == 0 || cropRect.height == 0 || crop.OutWidth <= 0 || crop.OutHeight <= 0) {
+        return false;
+    }
+
+    cv::Rect src = cv::Rect(0, 0, frameWidth, frameHeight) & cropRect;
+    if (src.width <= 0 || src.height <= 0) {
+        return false;
+    }
+
+    double sx = static_cast<double>(crop.OutWidth) / cropRect.width;
+    double sy = static_cast<double>(crop.OutHeight) / cropRect.height;
+    int x0 = static_cast<int>(std::round((src.x - cropRect.x) * sx));
+    int x1 = static_cast<int>(std::round((src.x + src.width - cropRect.x) * sx));
+    int y0 = static_cast<int>(std::round((src.y - cropRect.y) * sy));
+    int y1 = static_cast<int>(std::round((src.y + src.height - cropRect.y) * sy));
+    if (x1 <= x0 || y1 <= y0) {
+        return false;
+    }
+
+    *srcRect = src;
+    *dstRect = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+    return true;
+}
+
+CroppedVideoSource::CroppedVideoSource(IVideoSourcePtr source, VideoCrop crop)
+    : m_Source(std::move(source))
+    , m_Seekable(nullptr)
+    , m_Crop(crop)
+{
+    if (!m_Source) {
+        throw std::invalid_argument("must provide source");
+    }
+    if (m_Crop.OutWidth <= 0 || m_Crop.OutHeight <= 0) {
+        throw std::invalid_argument("invalid crop output size");
+    }
+    m_Seekable = dynamic_cast<ISeekableVideoSource*>(m_Source.get());
+}
+
+CroppedVideoSource::~CroppedVideoSource() {
+}
+
+int CroppedVideoSource::Width() const {
+    return m_Crop.OutWidth;
+}
+
+int CroppedVideoSource::Height() const {
+    return m_Crop.OutHeight;
+}
+
+GetResult CroppedVideoSource::Get(uint8_t* buffer, int64_t* ptsMilliseconds) {
+    m_Frame.resize(m_Source->BufferSize());
+    GetResult res = m_Source->Get(m_Frame.data(), ptsMilliseconds);
+    if (res == GetResult::SUCCESS) {
+        cv::Mat in(m_Source->Height(), m_Source->Width(), CV_8UC3, m_Frame.data());
+        cv::Mat out(m_Crop.OutHeight, m_Crop.OutWidth, CV_8UC3, buffer);
+
+        cv::Rect src, dst;
+        if (CropGeometry(in.cols, in.rows, m_Crop, &src, &dst)) {
+            if (dst.width != out.cols || dst.height != out.rows) {
+                out.setTo(cv::Scalar::all(0));
+            }
+            cv::Mat o = out(dst);
+            cv::resize(in(src), o, dst.size(), 0, 0, cv::INTER_AREA);
+        } else {
+            out.setTo(cv::Scalar::all(0));
+        }
+    }
+    return res;
+}
+
+void CroppedVideoSource::Reopen() {
+    m_Source->Reopen();
+}
+
+void CroppedVideoSource::ClearError() {
+    m_Source->ClearError();
+}
+
+ErrorState CroppedVideoSource::GetErrorState() {
+    return m_Source->GetErrorState();
+}
+
+std::string CroppedVideoSource::GetLastError() {
+    return m_Source->GetLastError();
+}
+
+std::string CroppedVideoSource::GetInformation() {
+    return fmt::format("{}\ncropped to {}x{}", m_Source->GetInformation(),
+            m_Crop.OutWidth, m_Crop.OutHeight);
+}
+
+std::shared_ptr<const VideoIndex> CroppedVideoSource::GetIndex() {
+    if (m_Seekable) {
+        return m_Seekable->GetIndex();
+    }
+    return nullptr;
+}
+
+bool CroppedVideoSource::SeekToKeyframe(int64_t keyframeIndex) {
+    if (m_Seekable) {
+        return m_Seekable->SeekToKeyframe(keyframeIndex);
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 StaticVideoBufferConfig StaticVideoBufferConfig::Defaults() {
     StaticVideoBufferConfig cfg;
     cfg.BufferSize = static_cast<size_t>(1024 * 1024 * 1024);
     cfg.ForwardBias = 0.5;
+    cfg.PlayingBias = 0.1;
+    cfg.IdleMillis = 500;
     return cfg;
 }
 
+static constexpr int PINNED_SPARE_SLOTS = 4;
+
 StaticVideoBuffer::StaticVideoBuffer(IVideoSourcePtr source,
-        StaticVideoBufferConfig config)
+        StaticVideoBufferConfig config, int extraSlots)
     : m_Config(config)
     , m_Source(std::move(source))
+    , m_Seekable(nullptr)
+    , m_SeekFailed(false)
     , m_SourceFrameIndex(0)
     , m_TargetFrameIndex(0)
+    , m_TargetChangedAt(util::Now())
+    , m_PlaybackSpeed(0.0f)
     , m_InputWasExhausted(false)
     , m_CurrentKnownNumFrames(0)
     , m_MaxRecords(0)
@@ -412,12 +815,20 @@ StaticVideoBuffer::StaticVideoBuffer(IVideoSourcePtr source,
     if (!m_Source) {
         throw std::invalid_argument("must provide source");
     }
+    m_Seekable = dynamic_cast<ISeekableVideoSource*>(m_Source.get());
 
     int imSize = ImageDataBufferSize();
     if (imSize > 0) {
         m_MaxRecords = m_Config.BufferSize / static_cast<size_t>(imSize);
         m_MaxRecords += 1;
-        m_Data.resize(m_MaxRecords * imSize);
+
+        // A few extra slots so that frames pinned by the ui don't starve the buffer
+        int numSlots = m_MaxRecords + PINNED_SPARE_SLOTS + std::max(extraSlots, 0);
+        m_Data.resize(static_cast<size_t>(numSlots) * imSize);
+        for (int i = 0; i < numSlots; i++) {
+            m_SlotPins.push_back(std::make_shared<int>(i));
+            m_FreeSlots.push_back(numSlots - 1 - i); // acquired from the back
+        }
     }
 }
 
@@ -456,23 +867,172 @@ int64_t StaticVideoBuffer::CurrentKnownNumFrames() const {
     return m_CurrentKnownNumFrames;
 }
 
+std::shared_ptr<const VideoIndex> StaticVideoBuffer::GetIndex() const {
+    if (!m_Seekable) {
+        return nullptr;
+    }
+    return m_Seekable->GetIndex();
+}
+
+int64_t StaticVideoBuffer::TargetFrameIndex() const {
+    return m_TargetFrameIndex;
+}
+
+void StaticVideoBuffer::SetPlaybackSpeed(float speed) {
+    m_PlaybackSpeed = speed;
+}
+
+float StaticVideoBuffer::BehindFraction() const {
+    if (m_PlaybackSpeed == 0.0f ||
+            util::ElapsedMillisFrom(m_TargetChangedAt) > m_Config.IdleMillis) {
+        return m_Config.ForwardBias;
+    }
+    // Faster playback gets further ahead (or behind) of the decoder
+    float behind = m_Config.PlayingBias / std::max(std::abs(m_PlaybackSpeed), 1.0f);
+    if (m_PlaybackSpeed < 0) {
+        behind = 1.0f - behind;
+    }
+    return behind;
+}
+
+void StaticVideoBuffer::TargetWindow(int64_t* lo, int64_t* hi) const {
+    int64_t span = std::max(m_MaxRecords, 1) - 1;
+    *lo = std::max(m_TargetFrameIndex - static_cast<int64_t>(span * BehindFraction()),
+            static_cast<int64_t>(0));
+    *hi = *lo + span;
+}
+
+bool StaticVideoBuffer::HasFreeSlot() const {
+    for (auto & slot : m_FreeSlots) {
+        if (m_SlotPins[slot].use_count() == 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int StaticVideoBuffer::AcquireFreeSlot() {
+    for (auto it = m_FreeSlots.rbegin(); it != m_FreeSlots.rend(); ++it) {
+        int slot = *it;
+        if (m_SlotPins[slot].use_count() == 1) {
+            // use_count is a relaxed load, pair with the release of the last
+            // view so its reads happen before the slot is decoded into
+            std::atomic_thread_fence(std::memory_order_acquire);
+            m_FreeSlots.erase(std::next(it).base());
+            return slot;
+        }
+    }
+    return -1;
+}
+
+int StaticVideoBuffer::AcquireSlot(int64_t frameIndex) {
+    if (m_MaxRecords == 0) {
+        return -1;
+    }
+    int64_t lo, hi;
+    TargetWindow(&lo, &hi);
+    int slot = AcquireFreeSlot();
+    while (slot < 0 && !m_Records.empty()) {
+        // The farthest frame is at one end or the other, relative to how
+        // much of the window is on that side. Only frames that have left the
+        // window are given up
+        auto first = m_Records.begin();
+        auto last = std::prev(m_Records.end());
+        auto distance = [&](int64_t f) {
+            if (f < m_TargetFrameIndex) {
+                return static_cast<double>(m_TargetFrameIndex - f) /
+                    static_cast<double>(std::max(m_TargetFrameIndex - lo, static_cast<int64_t>(1)));
+            }
+            return static_cast<double>(f - m_TargetFrameIndex) /
+                static_cast<double>(std::max(hi - m_TargetFrameIndex, static_cast<int64_t>(1)));
+        };
+        auto farthest = distance(first->first) > distance(last->first) ? first : last;
+        if ((farthest->first >= lo && farthest->first <= hi) ||
+                distance(farthest->first) <= distance(frameIndex)) {
+            break;
+        }
+        ReleaseSlot(farthest->second.Slot);
+        m_Records.erase(farthest);
+        slot = AcquireFreeSlot();
+    }
+    return slot;
+}
+
+uint8_t* StaticVideoBuffer::SlotData(int slot) {
+    return m_Data.data() + static_cast<size_t>(ImageDataBufferSize()) * slot;
+}
+
+void StaticVideoBuffer::InsertFrame(int64_t frameIndex, int64_t pts, int slot) {
+    Record rec;
+    rec.FrameIndex = frameIndex;
+    rec.PTS = pts;
+    rec.Slot = slot;
+    rec.Data = SlotData(slot);
+    if (!m_Records.emplace(frameIndex, rec).second) {
+        ReleaseSlot(slot);
+    }
+    if (frameIndex + 1 > m_CurrentKnownNumFrames) {
+        m_CurrentKnownNumFrames = frameIndex + 1;
+    }
+}
+
+void StaticVideoBuffer::ReleaseSlot(int slot) {
+    m_FreeSlots.push_back(slot);
+}
+
+void StaticVideoBuffer::ReleaseRecords() {
+    for (auto & [frameIndex, rec] : m_Records) {
+        ReleaseSlot(rec.Slot);
+    }
+    m_Records.clear();
+}
+
 bool StaticVideoBuffer::BufferFull() const {
-    return m_Records.size() == m_MaxRecords;
+    // Pinned slots can leave less room than m_MaxRecords
+    return m_Records.size() >= m_MaxRecords || (!m_Records.empty() && !HasFreeSlot());
 }
 
 bool StaticVideoBuffer::MustRewind() const {
     if (m_Records.empty()) {
         return false;
     }
-    return m_TargetFrameIndex < m_Records.front().FrameIndex;
+    return m_TargetFrameIndex < m_Records.begin()->first;
 }
 bool StaticVideoBuffer::MustAdvance() const {
     assert(BufferFull());
-    return (m_TargetFrameIndex - m_Records.front().FrameIndex) >
-            ((m_Records.back().FrameIndex - m_Records.front().FrameIndex) * m_Config.ForwardBias);
+    int64_t front = m_Records.begin()->first;
+    int64_t back = m_Records.rbegin()->first;
+    return (m_TargetFrameIndex - front) > ((back - front) * BehindFraction());
+}
+
+bool StaticVideoBuffer::ShouldSeek(int64_t* keyframeIndex) const {
+    if (!m_Seekable || m_SeekFailed || m_MaxRecords == 0) {
+        return false;
+    }
+    std::shared_ptr<const VideoIndex> index = m_Seekable->GetIndex();
+    if (!index) {
+        return false;
+    }
+    // At most one GOP of decoding before the target is available
+    int64_t k = index->KeyframeAtOrBefore(m_TargetFrameIndex);
+    if (k < 0) {
+        return false;
+    }
+    // Seek backwards rather than reading from the start, and forwards when
+    // the keyframe is past everything decoded so far
+    if (MustRewind() || k > m_SourceFrameIndex) {
+        if (keyframeIndex) {
+            *keyframeIndex = k;
+        }
+        return true;
+    }
+    return false;
 }
 
 bool StaticVideoBuffer::HasWork() const {
+    if (ShouldSeek(nullptr)) {
+        return true;
+    }
     if (MustRewind()) {
         return true;
     }
@@ -480,7 +1040,7 @@ bool StaticVideoBuffer::HasWork() const {
         return false;
     }
     if (!BufferFull()) {
-        return true;
+        return HasFreeSlot();
     }
     if (MustAdvance()) {
         return true;
@@ -498,35 +1058,48 @@ void StaticVideoBuffer::DoWork(int64_t* frameIndex, int64_t* pts) {
     }
     Record newRec;
     newRec.FrameIndex = m_SourceFrameIndex;
+    newRec.Slot = -1;
     newRec.Data = nullptr;
 
+    int64_t keyframeIndex;
+    if (ShouldSeek(&keyframeIndex)) {
+        m_Source->ClearError();
+        if (m_Seekable->SeekToKeyframe(keyframeIndex)) {
+            m_SourceFrameIndex = keyframeIndex;
+            newRec.FrameIndex = keyframeIndex;
+            ReleaseRecords();
+        } else {
+            m_SeekFailed = true;
+        }
+    }
+
     if (MustRewind()) {
-        newRec.Data = m_Data.data();
         m_Source->ClearError();
         m_Source->Reopen();
         m_SourceFrameIndex = 0;
         newRec.FrameIndex = 0;
-        m_Records.clear();
+        ReleaseRecords();
     }
 
     if ((HasError() && GetErrorState() != ErrorState::INPUT_EXHAUSTED)) {
         return;
     }
 
-    if (!BufferFull()) {
-        newRec.Data = m_Data.data() + ImageDataBufferSize() * m_Records.size();
-    } else if (MustAdvance()) {
-        newRec.Data = m_Records.front().Data;
-        m_Records.pop_front();
+    if (BufferFull() && MustAdvance()) {
+        ReleaseSlot(m_Records.begin()->second.Slot);
+        m_Records.erase(m_Records.begin());
     }
 
-    if (!BufferFull() && newRec.Data) {
+    if (!BufferFull()) {
+        newRec.Slot = AcquireFreeSlot();
+        if (newRec.Slot < 0) {
+            return;
+        }
+        newRec.Data = SlotData(newRec.Slot);
+
         if (m_Source->Get(newRec.Data, &newRec.PTS) == GetResult::SUCCESS) {
             m_SourceFrameIndex++;
-            m_Records.push_back(newRec);
-            if (m_SourceFrameIndex > m_CurrentKnownNumFrames) {
-                m_CurrentKnownNumFrames = m_SourceFrameIndex;
-            }
+            InsertFrame(newRec.FrameIndex, newRec.PTS, newRec.Slot);
 
             if (frameIndex) {
                 *frameIndex = newRec.FrameIndex;
@@ -534,49 +1107,41 @@ void StaticVideoBuffer::DoWork(int64_t* frameIndex, int64_t* pts) {
             if (pts) {
                 *pts = newRec.PTS;
             }
+        } else {
+            ReleaseSlot(newRec.Slot);
         }
     }
 }
 
-bool StaticVideoBuffer::RecordIndex(int64_t frameIndex,
-        const std::deque<Record>& records, size_t* recordIndex) const {
-    if (!records.empty() &&
-        frameIndex >= records.front().FrameIndex && frameIndex <= records.back().FrameIndex) {
-
-        if (recordIndex) {
-            *recordIndex = static_cast<size_t>(frameIndex - records.front().FrameIndex);
-        }
-        return true;
-    }
-    return false;
-}
-
 bool StaticVideoBuffer::HasFrame(int64_t frameIndex) const {
-    return RecordIndex(frameIndex, m_Records);
+    return m_Records.find(frameIndex) != m_Records.end();
 }
 
-GetResult StaticVideoBuffer::GetFrame(int64_t frameIndex, int64_t* pts, const uint8_t** imageData) const {
+GetResult StaticVideoBuffer::GetFrame(int64_t frameIndex, int64_t* pts, const uint8_t** imageData,
+        std::shared_ptr<void>* pin) const {
     if (frameIndex < 0) {
         return GetResult::FAILURE;
     }
-    m_TargetFrameIndex = frameIndex;
+    if (frameIndex != m_TargetFrameIndex) {
+        m_TargetFrameIndex = frameIndex;
+        m_TargetChangedAt = util::Now();
+    }
     if (HasError() && GetErrorState() != ErrorState::INPUT_EXHAUSTED) {
         return GetResult::FAILURE;
     }
 
-    size_t recordIndex;
-    const Record* r = nullptr;
-    if (RecordIndex(frameIndex, m_Records, &recordIndex)) {
-        r = &m_Records[recordIndex];
-    }
-
-    if (r) {
+    auto it = m_Records.find(frameIndex);
+    if (it != m_Records.end()) {
+        const Record* r = &it->second;
         if (pts) {
             *pts = r->PTS;
         }
         if (imageData) {
             *imageData = r->Data;
         }
+        if (pin) {
+            *pin = m_SlotPins[r->Slot];
+        }
         return GetResult::SUCCESS;
     }
     return GetResult::AGAIN;
@@ -587,24 +1152,77 @@ GetResult StaticVideoBuffer::GetFrame(int64_t frameIndex, int64_t* pts, const ui
 StaticVideoThreadConfig StaticVideoThreadConfig::Defaults() {
     StaticVideoThreadConfig cfg;
     cfg.StaticVideoBufferCfg = StaticVideoBufferConfig::Defaults();
+    cfg.DecoderThreads = 0;
+    cfg.PrefetchThreads = 4;
+    // Raw frames are about 40GB an hour of video, so only when asked for
+    cfg.FrameCache = false;
+    cfg.FrameCacheJpegQuality = 0;
+    cfg.FrameCachePalette = false;
+    cfg.FrameCacheBudgetMegabytes = 64 * 1024;
     return cfg;
 }
 
 StaticVideoThread::StaticVideoThread(IVideoSourcePtr source,
-        StaticVideoThreadConfig config)
+        StaticVideoThreadConfig config,
+        std::function<void()> onFrameReady)
     : m_Config(config)
+    , m_OnFrameReady(onFrameReady)
     , m_Buffer(std::move(source), config.StaticVideoBufferCfg)
     , m_ShouldStop(false)
     , m_HasError(false)
     , m_CurrentKnownNumFrames(0)
+    , m_MissedFrameIndex(-1)
+{
+    m_BufferThread = std::thread(
+            &StaticVideoThread::BufferThread, this);
+}
+
+StaticVideoThread::StaticVideoThread(std::function<IVideoSourcePtr()> sourceFactory,
+        StaticVideoThreadConfig config,
+        std::function<void()> onFrameReady,
+        const std::string& frameCachePath,
+        std::shared_ptr<const PaletteQuantizer> quantizer)
+    : m_Config(config)
+    , m_SourceFactory(sourceFactory)
+    , m_OnFrameReady(onFrameReady)
+    , m_Buffer(sourceFactory(), config.StaticVideoBufferCfg, config.PrefetchThreads)
+    , m_FrameCachePath(config.FrameCache ? frameCachePath : "")
+    , m_Quantizer(quantizer)
+    , m_ShouldStop(false)
+    , m_HasError(false)
+    , m_CurrentKnownNumFrames(0)
+    , m_MissedFrameIndex(-1)
 {
+    if (!m_FrameCachePath.empty()) {
+        TrimFrameCacheDirectory(util::fs::path(m_FrameCachePath).parent_path().string(),
+                FrameCacheBudgetBytes(), m_FrameCachePath);
+        std::shared_ptr<FrameCache> cache = FrameCache::Open(m_FrameCachePath);
+        if (cache && cache->Width() == m_Buffer.Width() && cache->Height() == m_Buffer.Height()) {
+            UseFrameCache(cache);
+            return; // nothing to decode
+        }
+        m_FrameCacheThread = std::thread(
+                &StaticVideoThread::FrameCacheThread, this);
+    }
+
     m_BufferThread = std::thread(
             &StaticVideoThread::BufferThread, this);
+    for (int i = 0; i < m_Config.PrefetchThreads; i++) {
+        m_PrefetchThreads.emplace_back(&StaticVideoThread::PrefetchThread, this);
+    }
 }
 
 StaticVideoThread::~StaticVideoThread() {
     m_ShouldStop = true;
-    m_BufferThread.join();
+    if (m_BufferThread.joinable()) {
+        m_BufferThread.join();
+    }
+    for (auto & t : m_PrefetchThreads) {
+        t.join();
+    }
+    if (m_FrameCacheThread.joinable()) {
+        m_FrameCacheThread.join();
+    }
 }
 
 bool StaticVideoThread::HasError() const {
@@ -625,17 +1243,116 @@ std::string StaticVideoThread::GetInputInformation() const {
     return m_InformationString;
 }
 
+bool StaticVideoThread::Prefetching() const {
+    return !m_PrefetchThreads.empty() && m_Index != nullptr;
+}
+
+void StaticVideoThread::NotifyIfMissed(int64_t frameIndex, bool* frameReady) {
+    if (m_MissedFrameIndex >= 0 && m_MissedFrameIndex == frameIndex) {
+        m_MissedFrameIndex = -1;
+        *frameReady = true;
+    }
+}
+
+uint64_t StaticVideoThread::FrameCacheBudgetBytes() const {
+    return static_cast<uint64_t>(std::max(m_Config.FrameCacheBudgetMegabytes, 0)) * 1024 * 1024;
+}
+
+void StaticVideoThread::UseFrameCache(std::shared_ptr<FrameCache> cache) {
+    m_FrameCache = cache;
+    m_PTS.resize(m_FrameCache->NumFrames());
+    for (size_t i = 0; i < m_PTS.size(); i++) {
+        m_PTS[i] = m_FrameCache->PtsMilliseconds(static_cast<int64_t>(i));
+    }
+    m_CurrentKnownNumFrames = m_PTS.size();
+}
+
+// Reads the whole video once, in order, on its own source
+void StaticVideoThread::FrameCacheThread() {
+    try {
+        IVideoSourcePtr source = m_SourceFactory();
+        FrameCacheWriter writer(m_FrameCachePath, source->Width(), source->Height(),
+                m_Config.FrameCacheJpegQuality, m_Quantizer.get());
+        std::vector<uint8_t> frame(source->BufferSize());
+        while (!m_ShouldStop) {
+            int64_t pts;
+            GetResult res = source->Get(frame.data(), &pts);
+            if (res == GetResult::SUCCESS) {
+                writer.AddFrame(frame.data(), pts);
+                if (writer.BytesWritten() > FrameCacheBudgetBytes()) {
+                    return; // would never fit, the writer discards it
+                }
+            } else if (source->GetErrorState() == ErrorState::INPUT_EXHAUSTED) {
+                writer.Finish();
+                TrimFrameCacheDirectory(util::fs::path(m_FrameCachePath).parent_path().string(),
+                        FrameCacheBudgetBytes(), m_FrameCachePath);
+                break;
+            } else if (res == GetResult::FAILURE) {
+                return;
+            }
+        }
+        if (m_ShouldStop) {
+            return; // the writer discards the partial cache
+        }
+    } catch (const std::exception&) {
+        return; // Read only directory or similar, carry on decoding
+    }
+
+    std::shared_ptr<FrameCache> cache = FrameCache::Open(m_FrameCachePath);
+    if (cache && cache->Width() == m_Buffer.Width() && cache->Height() == m_Buffer.Height()) {
+        bool frameReady = false;
+        {
+            std::lock_guard<std::mutex> lock(m_BufferMutex);
+            UseFrameCache(cache);
+            frameReady = m_MissedFrameIndex >= 0;
+            m_MissedFrameIndex = -1;
+        }
+        if (frameReady && m_OnFrameReady) {
+            m_OnFrameReady();
+        }
+    }
+}
+
 void StaticVideoThread::BufferThread() {
     while (!m_ShouldStop) {
+        {
+            std::lock_guard<std::mutex> lock(m_BufferMutex);
+            if (m_FrameCache) {
+                break;
+            }
+            if (!m_PrefetchThreads.empty() && !m_Index) {
+                m_Index = m_Buffer.GetIndex();
+                if (m_Index) {
+                    // Every timestamp is known up front, no need to read them
+                    m_PTS.resize(m_Index->Timestamps.size());
+                    for (size_t i = 0; i < m_PTS.size(); i++) {
+                        m_PTS[i] = m_Index->PtsMilliseconds(static_cast<int64_t>(i));
+                    }
+                    m_CurrentKnownNumFrames = m_PTS.size();
+                }
+            }
+            if (Prefetching()) {
+                break; // The prefetch threads take it from here
+            }
+        }
+
         if (m_Buffer.HasWork()) {
+            bool frameReady = false;
             {
                 std::lock_guard<std::mutex> lock(m_BufferMutex);
                 int64_t frameIndex, pts;
                 m_Buffer.DoWork(&frameIndex, &pts);
-                if (frameIndex > static_cast<int>(m_PTS.size())) {
+                if (frameIndex == static_cast<int64_t>(m_PTS.size())) { // not after seeking ahead
                     m_PTS.push_back(pts);
                     m_CurrentKnownNumFrames = m_PTS.size();
                 }
+                if (m_MissedFrameIndex >= 0 && m_Buffer.HasFrame(m_MissedFrameIndex)) {
+                    m_MissedFrameIndex = -1;
+                    frameReady = true;
+                }
+            }
+            if (frameReady && m_OnFrameReady) {
+                m_OnFrameReady();
             }
             std::this_thread::sleep_for(std::chrono::microseconds(100));
         } else {
@@ -644,23 +1361,253 @@ void StaticVideoThread::BufferThread() {
     }
 }
 
+static constexpr int PREFETCH_SEGMENT_RETRIES = 4;
+static constexpr int PREFETCH_RETRY_BASE_MILLIS = 250;
+
+// The unfinished segment in the window nearest to the target, where distance
+// is relative to how much of the window is on that side of the target
+bool StaticVideoThread::NextSegment(const VideoIndex& index, Segment* segment) {
+    util::mclock::time_point now = util::Now();
+    auto retryable = [&](int64_t begin){
+        auto it = m_SegmentsFailed.find(begin);
+        return it == m_SegmentsFailed.end() ||
+            (it->second.Count < PREFETCH_SEGMENT_RETRIES && now >= it->second.RetryAfter);
+    };
+
+    int64_t numFrames = static_cast<int64_t>(index.Timestamps.size());
+    int64_t lo, hi;
+    m_Buffer.TargetWindow(&lo, &hi);
+    hi = std::min(hi, numFrames - 1);
+    if (lo > hi) {
+        return false;
+    }
+    int64_t target = std::clamp(m_Buffer.TargetFrameIndex(), lo, hi);
+    double ahead = static_cast<double>(std::max(hi - target, static_cast<int64_t>(1)));
+    double behind = static_cast<double>(std::max(target - lo, static_cast<int64_t>(1)));
+
+    bool found = false;
+    double bestDistance = 0;
+    int64_t begin = index.KeyframeAtOrBefore(lo);
+    if (begin < 0) {
+        begin = index.KeyframeAfter(lo);
+    }
+    while (begin <= hi) {
+        int64_t end = index.KeyframeAfter(begin);
+        if (m_SegmentsInProgress.count(begin) == 0 && retryable(begin)) {
+            bool missing = false;
+            for (int64_t f = std::max(begin, lo); f < end && f <= hi && !missing; f++) {
+                missing = !m_Buffer.HasFrame(f);
+            }
+
+            double distance = 0;
+            if (target < begin) {
+                distance = static_cast<double>(begin - target) / ahead;
+            } else if (target >= end) {
+                distance = static_cast<double>(target - (end - 1)) / behind;
+            }
+            if (missing && (!found || distance < bestDistance)) {
+                found = true;
+                bestDistance = distance;
+                segment->Begin = begin;
+                segment->End = end;
+            }
+        }
+        begin = end;
+    }
+    return found;
+}
+
+// Returns false if the source failed. The segment is abandoned early once it
+// is out of the window or everything left in it is already buffered.
+bool StaticVideoThread::PrefetchSegment(ISeekableVideoSource* source,
+        const Segment& segment, int64_t* sourceFrameIndex, std::vector<uint8_t>* scratch) {
+    if (*sourceFrameIndex != segment.Begin) {
+        source->ClearError();
+        if (!source->SeekToKeyframe(segment.Begin)) {
+            *sourceFrameIndex = -1;
+            return false;
+        }
+        *sourceFrameIndex = segment.Begin;
+    }
+    scratch->resize(source->BufferSize());
+
+    for (int64_t f = segment.Begin; f < segment.End && !m_ShouldStop; f++) {
+        int slot = -1;
+        uint8_t* data = scratch->data();
+        {
+            std::lock_guard<std::mutex> lock(m_BufferMutex);
+            int64_t lo, hi;
+            m_Buffer.TargetWindow(&lo, &hi);
+            if (f > hi || segment.End <= lo) {
+                return true;
+            }
+            if (f >= lo && !m_Buffer.HasFrame(f)) {
+                slot = m_Buffer.AcquireSlot(f);
+                if (slot >= 0) {
+                    data = m_Buffer.SlotData(slot);
+                }
+            } else {
+                bool missing = false;
+                for (int64_t g = std::max(f, lo); g < segment.End && g <= hi && !missing; g++) {
+                    missing = !m_Buffer.HasFrame(g);
+                }
+                if (!missing) {
+                    return true;
+                }
+            }
+        }
+
+        // Frames that are already buffered still have to be decoded to get
+        // to the ones after them, those go to scratch
+        int64_t pts;
+        if (source->Get(data, &pts) != GetResult::SUCCESS) {
+            if (slot >= 0) {
+                std::lock_guard<std::mutex> lock(m_BufferMutex);
+                m_Buffer.ReleaseSlot(slot);
+            }
+            *sourceFrameIndex = -1;
+            return false;
+        }
+        (*sourceFrameIndex)++;
+
+        if (slot >= 0) {
+            bool frameReady = false;
+            {
+                std::lock_guard<std::mutex> lock(m_BufferMutex);
+                m_Buffer.InsertFrame(f, pts, slot);
+                NotifyIfMissed(f, &frameReady);
+            }
+            if (frameReady && m_OnFrameReady) {
+                m_OnFrameReady();
+            }
+        }
+    }
+    return true;
+}
+
+void StaticVideoThread::PrefetchThread() {
+    IVideoSourcePtr source;
+    ISeekableVideoSource* seekable = nullptr;
+    int64_t sourceFrameIndex = -1; // where the next Get is, -1 if unknown
+    std::vector<uint8_t> scratch;
+
+    while (!m_ShouldStop) {
+        std::shared_ptr<const VideoIndex> index;
+        {
+            std::lock_guard<std::mutex> lock(m_BufferMutex);
+            if (m_FrameCache) {
+                return;
+            }
+            if (Prefetching()) {
+                index = m_Index;
+            }
+        }
+        if (!index) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            continue;
+        }
+
+        if (!source) {
+            source = m_SourceFactory();
+            seekable = dynamic_cast<ISeekableVideoSource*>(source.get());
+            if (!seekable) {
+                return;
+            }
+        }
+        if (!seekable->GetIndex()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            continue;
+        }
+
+        Segment segment;
+        bool haveSegment = false;
+        {
+            std::lock_guard<std::mutex> lock(m_BufferMutex);
+            haveSegment = NextSegment(*index, &segment);
+            if (haveSegment) {
+                m_SegmentsInProgress.insert(segment.Begin);
+            }
+        }
+        if (!haveSegment) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            continue;
+        }
+
+        bool ok = PrefetchSegment(seekable, segment, &sourceFrameIndex, &scratch);
+        {
+            std::lock_guard<std::mutex> lock(m_BufferMutex);
+            m_SegmentsInProgress.erase(segment.Begin);
+            if (ok) {
+                m_SegmentsFailed.erase(segment.Begin);
+            } else {
+                SegmentFailure& failure = m_SegmentsFailed[segment.Begin];
+                failure.Count++;
+                failure.RetryAfter = util::Now() +
+                    std::chrono::milliseconds(PREFETCH_RETRY_BASE_MILLIS << (failure.Count - 1));
+            }
+        }
+        if (!ok) {
+            // Start over on a fresh source in case this one is in a bad state
+            source.reset();
+            seekable = nullptr;
+            sourceFrameIndex = -1;
+        }
+    }
+}
+
 int64_t StaticVideoThread::CurrentKnownNumFrames() const {
     return m_CurrentKnownNumFrames;
 }
 
 LiveInputFramePtr StaticVideoThread::GetFrame(int frameIndex) {
+    std::shared_ptr<FrameCache> cache;
+    {
+        std::lock_guard<std::mutex> lock(m_BufferMutex);
+        cache = m_FrameCache;
+        // The ui asks for the same frame every redraw, only decode it once
+        if (cache && m_LastDecodedFrame && m_LastDecodedFrame->FrameNumber == frameIndex) {
+            return m_LastDecodedFrame;
+        }
+    }
+    if (cache) {
+        if (frameIndex < 0 || frameIndex >= cache->NumFrames()) {
+            return nullptr;
+        }
+        LiveInputFramePtr f;
+        const uint8_t* raw = cache->RawFrame(frameIndex);
+        if (raw) {
+            // A view of the mapping, which the cache keeps alive
+            f = std::make_shared<LiveInputFrame>(cache->Width(), cache->Height(),
+                    const_cast<uint8_t*>(raw), cache);
+        } else {
+            f = std::make_shared<LiveInputFrame>(cache->Width(), cache->Height());
+            if (!cache->DecodeFrame(frameIndex, f->Buffer)) {
+                return nullptr;
+            }
+        }
+        f->FrameNumber = frameIndex;
+        f->PtsMilliseconds = cache->PtsMilliseconds(frameIndex);
+        if (!raw) {
+            std::lock_guard<std::mutex> lock(m_BufferMutex);
+            m_LastDecodedFrame = f;
+        }
+        return f;
+    }
+
     std::lock_guard<std::mutex> lock(m_BufferMutex);
 
     int64_t pts;
     const uint8_t* data;
-    if (m_Buffer.GetFrame(frameIndex, &pts, &data) == GetResult::SUCCESS) {
+    std::shared_ptr<void> pin;
+    if (m_Buffer.GetFrame(frameIndex, &pts, &data, &pin) == GetResult::SUCCESS) {
+        // A view of the buffer's slot, which is not reused while pinned
         LiveInputFramePtr f = std::make_shared<LiveInputFrame>(
-                m_Buffer.Width(), m_Buffer.Height());
+                m_Buffer.Width(), m_Buffer.Height(), const_cast<uint8_t*>(data), pin);
         f->FrameNumber = frameIndex;
         f->PtsMilliseconds = pts;
-        std::memcpy(f->Buffer, data, m_Buffer.ImageDataBufferSize());
         return f;
     }
+    m_MissedFrameIndex = frameIndex;
     return nullptr;
 }
 
@@ -685,6 +1632,11 @@ LiveInputFramePtr StaticVideoThread::GetFramePts(int64_t pts) {
     return GetFrame(targetFrame);
 }
 
+void StaticVideoThread::SetPlaybackSpeed(float speed) {
+    std::lock_guard<std::mutex> lock(m_BufferMutex);
+    m_Buffer.SetPlaybackSpeed(speed);
+}
+
 void StaticVideoThread::UpdatePTS(std::vector<int64_t>* pts) {
     // TODO
     std::lock_guard<std::mutex> lock(m_BufferMutex);
@@ -33,6 +33,9 @@
 #include <atomic>
 #include <chrono>
 #include <queue>
+#include <map>
+#include <set>
+#include <functional>
 
 #include "opencv2/opencv.hpp"
 
@@ -83,24 +86,86 @@ public:
 };
 typedef std::unique_ptr<IVideoSource> IVideoSourcePtr;
 
+// Timestamps of every frame of a video file in presentation order, and which
+// of those frames are keyframes. Frame indices are the same as the order that
+// frames come out of IVideoSource::Get when reading from the start.
+struct VideoIndex {
+    int64_t FileSize;       // of the video, to notice when the index is stale
+    int64_t FileWriteTime;
+    int64_t TimeBaseNumerator;   // seconds per timestamp unit
+    int64_t TimeBaseDenominator;
+    std::vector<int64_t> Timestamps; // in the stream's time base
+    std::vector<int64_t> Keyframes;  // frame indices, ascending
+
+    int64_t KeyframeAtOrBefore(int64_t frameIndex) const; // -1 if none
+    int64_t KeyframeAfter(int64_t frameIndex) const; // Timestamps.size() if none
+    int64_t PtsMilliseconds(int64_t frameIndex) const; // as IVideoSource::Get reports
+};
+
+// A directory of util::UserCacheDirectory("graphite") for caches about
+// videos, created if necessary. Empty if there is no such place
+std::string VideoCacheDirectory(const std::string& name);
+// In the "index" VideoCacheDirectory, keyed by the video's path, size and
+// write time. Empty if there is no cache directory, then nothing is persisted
+std::string VideoIndexPath(const std::string& videoPath);
+// Returns false if the index is missing, damaged or older than the video
+bool ReadVideoIndexFile(const std::string& videoPath, VideoIndex* index);
+void WriteVideoIndexFile(const std::string& videoPath, const VideoIndex& index);
+void StatVideoFile(const std::string& videoPath, int64_t* fileSize, int64_t* fileWriteTime);
+
+// A source that can jump to a keyframe rather than decoding from the start.
+// The index may not be available right away (it can be built in the
+// background) so check GetIndex.
+class ISeekableVideoSource : public IVideoSource {
+public:
+    ISeekableVideoSource();
+    virtual ~ISeekableVideoSource();
+
+    // nullptr until the index is available, it does not change after that
+    virtual std::shared_ptr<const VideoIndex> GetIndex() = 0;
+
+    // On success the next frame from Get is 'keyframeIndex'
+    virtual bool SeekToKeyframe(int64_t keyframeIndex) = 0;
+};
+
+// Loads or builds the index of one video file. Building it means demuxing the
+// whole file, so one indexer is shared by every source reading that file.
+class IVideoIndexer {
+public:
+    IVideoIndexer();
+    virtual ~IVideoIndexer();
+
+    // nullptr until the index is available, it does not change after that
+    virtual std::shared_ptr<const VideoIndex> GetIndex() = 0;
+};
+typedef std::shared_ptr<IVideoIndexer> IVideoIndexerPtr;
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct LiveInputFrame {
     LiveInputFrame();
     LiveInputFrame(int width, int height);
-    ~LiveInputFrame(); // frees buffer
+    // A view of someone else's buffer, which stays valid while pin is held
+    LiveInputFrame(int width, int height, uint8_t* buffer, std::shared_ptr<void> pin);
+    ~LiveInputFrame(); // frees buffer (unless it is a view)
 
     int64_t FrameNumber;
     int64_t PtsMilliseconds;
 
     int Width, Height;
-    uint8_t* Buffer;    // CV_8UC3 BGR order
+    uint8_t* Buffer;    // CV_8UC3 BGR order, read only for views
+    std::shared_ptr<void> Pin;
 };
 typedef std::shared_ptr<LiveInputFrame> LiveInputFramePtr;
 
 // A class that has its own thread that continuously reads from the live video
 // source. Maintains some relevant (health) information.
 // Can reopen the source if necessary (I had a problem with twitch streams...)
+//
+// Frames come out of a pool that is recycled once nobody holds them anymore,
+// and the queue is a single producer / single consumer ring so reading it
+// never waits on the capture thread. Frames are shared with the thread, so
+// treat them as read only.
 class LiveVideoThread {
 public:
     LiveVideoThread(IVideoSourcePtr input, 
@@ -147,12 +212,13 @@ public:
     int64_t GetResetThresholdMilliseconds() const;
     void SetResetThresholdMilliseconds(int64_t resetThreshold);
     int64_t GetQueueCapacity() const;
-    void SetQueueCapacity(int64_t capacity);
+    void SetQueueCapacity(int64_t capacity); // clamped to the ring size fixed at construction
 
 private:
-    void AdvanceAlreadyLocked(int amt);
+    LiveInputFramePtr PeekFrame(int index) const;
+    int AcquirePoolFrame(int width, int height);
     void WatchingThread();
-    void ProcessReadFrame(LiveInputFramePtr p);
+    void ProcessReadFrame(int poolIndex);
     bool ShouldReset();
     void Reset();
 
@@ -169,17 +235,31 @@ private:
     std::atomic<bool> m_AllowDiscard;
 
     std::atomic<int64_t> m_ResetThreshold;
+    const int64_t m_RingSize;
     std::atomic<int64_t> m_QueueCapacity;
 
     const util::mclock::time_point m_StartTime;
     util::mclock::time_point m_ResetTime;
-    util::mclock::time_point m_LastHit;
+    std::atomic<util::mclock::time_point> m_LastHit;
 
     mutable std::mutex m_SharedMutex;
     std::string m_InformationString;
     std::string m_ErrorString;
-    std::deque<LiveInputFramePtr> m_Queue;
-    LiveInputFramePtr m_LatestFrame;
+
+    // The ring holds pool indices, m_Head and m_Tail only ever increase. The
+    // consumer advances m_Head, the watching thread pushes at m_Tail and also
+    // advances m_Head when it discards.
+    std::vector<std::atomic<int>> m_Ring;
+    std::atomic<int64_t> m_Head;
+    std::atomic<int64_t> m_Tail;
+    std::atomic<int> m_LatestIndex;
+
+    // Slots are only ever filled by the watching thread, and never reassigned
+    const int m_PoolCapacity;
+    std::unique_ptr<LiveInputFramePtr[]> m_Pool;
+    int m_PoolSize;
+    int m_PoolNext;
+    std::vector<int64_t> m_PoolSequence; // where each frame was last pushed
 
     IVideoSourcePtr m_LiveInput;
     std::thread m_WatchingThread;
@@ -190,23 +270,34 @@ private:
 struct StaticVideoBufferConfig {
     size_t BufferSize; // in bytes, you should give quite a bit of space!!! (will round up!)
     float ForwardBias; // defaults to 0.5, meaning say you have room for 100 frames and you just read frame #324, we will try to have 274 to 374 in the buffer.
+    float PlayingBias; // used instead of ForwardBias while playing (see SetPlaybackSpeed), divided by the speed and mirrored in reverse
+    int IdleMillis; // after the target has not moved for this long ForwardBias is used again
 
     static StaticVideoBufferConfig Defaults();
 };
 #ifdef NLOHMANN_JSON_VERSION_MAJOR
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(StaticVideoBufferConfig,
     BufferSize,
-    ForwardBias
+    ForwardBias,
+    PlayingBias,
+    IdleMillis
 );
 #endif
 
 // This is a big pain because I don't want to rely on 'seeking' video files.
-// Note that this is not adequate for actual video editing or anything. It reads
-// from the beginning if you go too far back
+// Note that this is not adequate for actual video editing or anything. If the
+// source is an ISeekableVideoSource with its index ready then jumps cost at
+// most one GOP of decoding, otherwise it reads from the beginning if you go too
+// far back.
+//
+// Frames can also be decoded elsewhere (see StaticVideoThread prefetching) and
+// handed over with AcquireSlot / InsertFrame, in which case the buffer keeps
+// the window of frames around the target and evicts whatever is farthest away.
 class StaticVideoBuffer {
 public:
     StaticVideoBuffer(IVideoSourcePtr source,
-            StaticVideoBufferConfig config = StaticVideoBufferConfig::Defaults()); 
+            StaticVideoBufferConfig config = StaticVideoBufferConfig::Defaults(),
+            int extraSlots = 0); // for frames being decoded by InsertFrame users
     ~StaticVideoBuffer();
 
     bool HasError() const;
@@ -227,55 +318,121 @@ public:
     void DoWork(int64_t* frameIndex = nullptr, int64_t* pts = nullptr);
 
     // ImageData is only valid until the next call to DoWork!!!
-    // If you want to keep it then copy it yourself. Watch out for
+    // If you want to keep it then either copy it yourself, or hold on to a copy
+    // of pin, which keeps the frame's slot from being reused. Watch out for
     // GetResult::AGAIN, and GetResult::FAILURE
-    GetResult GetFrame(int64_t frameIndex, int64_t* pts, const uint8_t** imageData) const;
+    GetResult GetFrame(int64_t frameIndex, int64_t* pts, const uint8_t** imageData,
+            std::shared_ptr<void>* pin = nullptr) const;
+
+    // A hint of where the target is going next. 1 is normal forward
+    // playback, negative in reverse, 0 when paused
+    void SetPlaybackSpeed(float speed);
+
+    // nullptr if the source is not seekable or its index is not ready yet
+    std::shared_ptr<const VideoIndex> GetIndex() const;
+    int64_t TargetFrameIndex() const;
+    // The frames [lo, hi] that should be kept around the target
+    void TargetWindow(int64_t* lo, int64_t* hi) const;
+
+    // To decode frameIndex elsewhere. Evicts buffered frames that are outside
+    // the window and farther from the target if it has to, -1 if there is no room. Hand the slot back with
+    // InsertFrame, or ReleaseSlot if decoding failed.
+    int AcquireSlot(int64_t frameIndex);
+    uint8_t* SlotData(int slot);
+    void InsertFrame(int64_t frameIndex, int64_t pts, int slot);
+    void ReleaseSlot(int slot);
     
 private:
     struct Record {
         int64_t FrameIndex;
         int64_t PTS;
+        int Slot;
         uint8_t* Data;
     };
 
-    bool RecordIndex(int64_t frameIndex, const std::deque<Record>& records, 
-            size_t* recordIndex = nullptr) const;
+    float BehindFraction() const; // of the window, behind the target
     bool BufferFull() const;
     bool MustRewind() const;
     bool MustAdvance() const;
+    bool ShouldSeek(int64_t* keyframeIndex) const;
+
+    bool HasFreeSlot() const;
+    int AcquireFreeSlot(); // -1 if every free slot is still pinned
+    void ReleaseRecords();
 
 private:
     StaticVideoBufferConfig m_Config;
 
     IVideoSourcePtr m_Source;
+    ISeekableVideoSource* m_Seekable; // m_Source, if it can seek
+    bool m_SeekFailed;
     int64_t m_SourceFrameIndex;
 
     mutable int64_t m_TargetFrameIndex;
+    mutable util::mclock::time_point m_TargetChangedAt;
+    float m_PlaybackSpeed;
 
     int64_t m_CurrentKnownNumFrames;
     bool m_InputWasExhausted;
 
     int m_MaxRecords;
 
-    std::deque<Record> m_Records; // sequential by frame index
+    std::map<int64_t, Record> m_Records; // by frame index, contiguous when filled by DoWork
     std::vector<uint8_t> m_Data; // Big and preallocated :O
+    std::vector<std::shared_ptr<int>> m_SlotPins; // slot is pinned while use_count() > 1
+    std::vector<int> m_FreeSlots;
 };
 
 struct StaticVideoThreadConfig {
     StaticVideoBufferConfig StaticVideoBufferCfg;
+    int DecoderThreads; // for sources that decode with threads (see OpenVideoFile), 0 is one per core
+    int PrefetchThreads; // GOP segments decoded concurrently once the index is ready, 0 to disable
+    bool FrameCache; // see framecache.h, only used when given a frameCachePath. Off by default
+    int FrameCacheJpegQuality; // 0 stores raw frames, otherwise lossy jpegs of this quality
+    bool FrameCachePalette; // store NES palette indices instead, for callers that have a palette
+    int FrameCacheBudgetMegabytes; // for the caches of every video together
 
     static StaticVideoThreadConfig Defaults();
 };
 #ifdef NLOHMANN_JSON_VERSION_MAJOR
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(StaticVideoThreadConfig,
-    StaticVideoBufferCfg
+    StaticVideoBufferCfg,
+    DecoderThreads,
+    PrefetchThreads,
+    FrameCache,
+    FrameCacheJpegQuality,
+    FrameCachePalette,
+    FrameCacheBudgetMegabytes
 );
 #endif
 
+class FrameCache;
+class PaletteQuantizer;
+
+// onFrameReady (if set) is invoked from the buffer thread when a frame that
+// GetFrame previously could not provide has been decoded.
+//
+// Given a sourceFactory the window around the target is split into GOP
+// segments (keyframe to keyframe) once the source's index is ready, and
+// PrefetchThreads segments are decoded at once, each on its own source from
+// the factory, nearest to the target first. Until then, or for sources that
+// can not seek, frames are read sequentially.
+//
+// Given a frameCachePath (see FrameCachePath) and FrameCache set, frames are
+// served straight from that cache when it exists. Otherwise one more source
+// from the factory transcodes the whole video into it in the background, as
+// palette indices if given a quantizer. The cache directory is kept within
+// FrameCacheBudgetMegabytes.
 class StaticVideoThread {
 public:
     StaticVideoThread(IVideoSourcePtr source,
-            StaticVideoThreadConfig config = StaticVideoThreadConfig::Defaults()); 
+            StaticVideoThreadConfig config = StaticVideoThreadConfig::Defaults(),
+            std::function<void()> onFrameReady = nullptr); 
+    StaticVideoThread(std::function<IVideoSourcePtr()> sourceFactory,
+            StaticVideoThreadConfig config = StaticVideoThreadConfig::Defaults(),
+            std::function<void()> onFrameReady = nullptr,
+            const std::string& frameCachePath = "",
+            std::shared_ptr<const PaletteQuantizer> quantizer = nullptr); 
     ~StaticVideoThread();
 
     bool HasError() const;
@@ -284,16 +441,40 @@ public:
     std::string GetInputInformation() const;
 
     int64_t CurrentKnownNumFrames() const; // will change as the input is read.
+    // Frames are read only views into the buffer, no copies are made
     LiveInputFramePtr GetFrame(int frameIndex);
     LiveInputFramePtr GetFramePts(int64_t pts);
+    void SetPlaybackSpeed(float speed); // see StaticVideoBuffer::SetPlaybackSpeed
 
     void UpdatePTS(std::vector<int64_t>* pts);
 
 private:
+    struct Segment {
+        int64_t Begin; // a keyframe
+        int64_t End;   // the next keyframe
+    };
+    // Failed segments are retried a few times with a growing delay, so one
+    // bad seek or decode doesn't leave a hole in the buffer for good
+    struct SegmentFailure {
+        int Count;
+        util::mclock::time_point RetryAfter;
+    };
+
     void BufferThread();
+    void PrefetchThread();
+    bool NextSegment(const VideoIndex& index, Segment* segment); // under m_BufferMutex
+    bool PrefetchSegment(ISeekableVideoSource* source, const Segment& segment,
+            int64_t* sourceFrameIndex, std::vector<uint8_t>* scratch);
+    bool Prefetching() const; // under m_BufferMutex
+    void NotifyIfMissed(int64_t frameIndex, bool* frameReady); // under m_BufferMutex
+    void FrameCacheThread();
+    void UseFrameCache(std::shared_ptr<FrameCache> cache); // under m_BufferMutex
+    uint64_t FrameCacheBudgetBytes() const;
 
 private:
     StaticVideoThreadConfig m_Config;
+    std::function<IVideoSourcePtr()> m_SourceFactory;
+    std::function<void()> m_OnFrameReady;
 
     std::atomic<bool> m_ShouldStop;
 
@@ -302,10 +483,22 @@ private:
     std::thread m_BufferThread;
     StaticVideoBuffer m_Buffer;
 
+    std::vector<std::thread> m_PrefetchThreads;
+    std::shared_ptr<const VideoIndex> m_Index; // set once prefetching starts
+    std::set<int64_t> m_SegmentsInProgress; // by Begin
+    std::map<int64_t, SegmentFailure> m_SegmentsFailed; // by Begin
+
+    std::string m_FrameCachePath;
+    std::shared_ptr<const PaletteQuantizer> m_Quantizer;
+    std::thread m_FrameCacheThread;
+    std::shared_ptr<FrameCache> m_FrameCache; // once complete, replaces everything above
+    LiveInputFramePtr m_LastDecodedFrame; // from m_FrameCache, when not stored raw
+
     std::atomic<bool> m_HasError;
     std::atomic<ErrorState> m_ErrorState;
 
     std::atomic<int64_t> m_CurrentKnownNumFrames;
+    int64_t m_MissedFrameIndex;
 
     std::string m_InformationString;
     std::string m_ErrorString;
@@ -317,6 +510,47 @@ private:
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+// Crop the video (zero padding where CropRect leaves the frame) and scale the
+// crop to OutWidth x OutHeight. Done by the source on its decoding thread so
+// that buffers only hold the small output frames.
+struct VideoCrop {
+    util::Rect2F CropRect;
+    int OutWidth;   // 0 for no crop
+    int OutHeight;
+};
+
+// The part of the crop that lies inside the frame (srcRect) and where that
+// lands in the output (dstRect). False if nothing of the frame is visible, in
+// which case the output is entirely padding.
+bool CropGeometry(int frameWidth, int frameHeight, const VideoCrop& crop,
+        cv::Rect* srcRect, cv::Rect* dstRect);
+
+// Applies a VideoCrop to any source using OpenCV. Sources that can crop while
+// decoding (LibAVVideoSource) should be preferred.
+class CroppedVideoSource : public ISeekableVideoSource {
+public:
+    CroppedVideoSource(IVideoSourcePtr source, VideoCrop crop);
+    ~CroppedVideoSource();
+
+    int Width() const override final;
+    int Height() const override final;
+    GetResult Get(uint8_t* buffer, int64_t* ptsMilliseconds) override final;
+    void Reopen() override final;
+    void ClearError() override final;
+    ErrorState GetErrorState() override final;
+    std::string GetLastError() override final;
+    std::string GetInformation() override final;
+
+    std::shared_ptr<const VideoIndex> GetIndex() override final;
+    bool SeekToKeyframe(int64_t keyframeIndex) override final;
+
+private:
+    IVideoSourcePtr m_Source;
+    ISeekableVideoSource* m_Seekable;
+    VideoCrop m_Crop;
+    std::vector<uint8_t> m_Frame;
+};
+
 class CVVideoCaptureSource : public IVideoSource {
 public:
     CVVideoCaptureSource(const std::string& input); 
@@ -0,0 +1,81 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2021-2021 FlibidyDibidy
+//
+// This file is part of Graphite.
+//
+// Graphite is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// Graphite is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Graphite; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RGMS_VIDEOFILE_HEADER
+#define RGMS_VIDEOFILE_HEADER
+
+#include "rgmvideo/video.h"
+#ifdef RGMS_VIDEO_LIBAV
+#include "rgmvideo/libavimpl.h"
+#endif
+
+namespace rgms::video {
+
+// The source to use for reading video files. LibAV where it is available
+// (threaded decoding, native cropping, keyframe seeking), otherwise OpenCV.
+// Lives in a header because the LibAV source is only built on some platforms.
+// Sources opened on the same file should share an indexer from
+// OpenVideoIndexer, otherwise each one builds its own index.
+inline IVideoSourcePtr OpenVideoFile(const std::string& path,
+        const StaticVideoThreadConfig& config,
+        const VideoCrop& crop = VideoCrop{util::Rect2F(0, 0, 0, 0), 0, 0},
+        IVideoIndexerPtr indexer = nullptr) {
+#ifdef RGMS_VIDEO_LIBAV
+    return std::make_unique<LibAVVideoSource>(path, crop, config.DecoderThreads, indexer);
+#else
+    IVideoSourcePtr source = std::make_unique<CVVideoCaptureSource>(path);
+    if (crop.OutWidth > 0 && crop.OutHeight > 0) {
+        source = std::make_unique<CroppedVideoSource>(std::move(source), crop);
+    }
+    return source;
+#endif
+}
+
+// nullptr where sources can't seek anyway (streams, or without LibAV)
+inline IVideoIndexerPtr OpenVideoIndexer(const std::string& path) {
+#ifdef RGMS_VIDEO_LIBAV
+    if (!util::fs::is_regular_file(path)) {
+        return nullptr;
+    }
+    return std::make_shared<LibAVVideoIndexer>(path);
+#else
+    return nullptr;
+#endif
+}
+
+// The frame size of a video file without opening a source on it
+inline bool ProbeVideoFile(const std::string& path, int* width, int* height) {
+#ifdef RGMS_VIDEO_LIBAV
+    return LibAVProbeVideoFile(path, width, height);
+#else
+    cv::VideoCapture cap(path);
+    if (!cap.isOpened()) {
+        return false;
+    }
+    *width = static_cast<int>(cap.get(cv::CAP_PROP_FRAME_WIDTH));
+    *height = static_cast<int>(cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+    return true;
+#endif
+}
+}
+
+#endif